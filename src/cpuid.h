@@ -55,6 +55,22 @@ public:
 #endif
         return vendor;
     }
+
+    /* AVX2 needs both the CPU feature and OS support for saving the YMM registers */
+    static bool has_avx2() {
+#if defined(HAVE_ASM_CPUID)
+        if (CPUID(0).EAX() < 7) return false;
+        CPUID leaf1(1);
+        const uint32_t osxsave = 1<<27, avx = 1<<28;
+        if ((leaf1.ECX() & (osxsave|avx)) != (osxsave|avx)) return false;
+        uint32_t xcr0, xcr0_hi;
+        asm volatile ("xgetbv" : "=a" (xcr0), "=d" (xcr0_hi) : "c" (0));
+        if ((xcr0 & 6) != 6) return false;  // XMM and YMM state
+        return (CPUID(7).EBX() & (1<<5)) != 0;
+#else
+        return false;
+#endif
+    }
 };
 
 #endif // CPUID_H
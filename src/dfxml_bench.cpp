@@ -0,0 +1,779 @@
+/*
+ * DFXML writer benchmarks.
+ *
+ * Writes a synthetic fiwalk-style file and reports elements/sec.
+ *
+ * Usage:
+ *   dfxml_bench [test] [count]
+ *
+ * where test is all, flush, async, escape, tags, sink, backend, fileobject, reorder, index, profile, writer_stats, to8601,
+ * attributes, compact or memory.
+ *
+ * Copyright (C) 2021 Simson L. Garfinkel.
+ *
+ * LICENSE: LGPL Version 3. See COPYING.md for further information.
+ */
+
+#include "dfxml_config.h"
+#include "dfxml_writer.h"
+#include "dfxml_reader.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <optional>
+#include <thread>
+#include <vector>
+
+static const char *bench_file = "/tmp/dfxml_bench.xml";
+
+/* Each fileobject is one push, five elements and one pop */
+static const int elements_per_fileobject = 7;
+
+static std::string read_file(const std::string &fname)
+{
+    std::ifstream in(fname, std::ios::binary);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+static void write_fileobjects(dfxml_writer &dw, int count)
+{
+    dw.push("dfxml","version='1.0'");
+    dw.push("volume","offset='0'");
+    for (int i=0; i<count; i++) {
+        dw.push("fileobject");
+        dw.xmlout("filename", "dir/subdir/file" + std::to_string(i) + ".txt");
+        dw.xmlout("filesize", (uint64_t)i * 4096);
+        dw.xmlout("inode", (int64_t)(i + 100));
+        dw.xmlout("hashdigest", "d41d8cd98f00b204e9800998ecf8427e", "type='md5'", false);
+        dw.xmlout("byte_run", "", "img_offset='1048576' len='4096'", false);
+        dw.pop();
+    }
+    dw.pop();
+    dw.pop();
+}
+
+/* As write_fileobjects(), with interned tags */
+static void write_fileobjects_interned(dfxml_writer &dw, int count)
+{
+    namespace tags = dfxml::tags;
+    dw.push(tags::dfxml,"version='1.0'");
+    dw.push(tags::volume,"offset='0'");
+    for (int i=0; i<count; i++) {
+        dw.push(tags::fileobject);
+        dw.xmlout(tags::filename, "dir/subdir/file" + std::to_string(i) + ".txt");
+        dw.xmlout(tags::filesize, (uint64_t)i * 4096);
+        dw.xmlout(tags::inode, (int64_t)(i + 100));
+        dw.xmlout(tags::hashdigest, "d41d8cd98f00b204e9800998ecf8427e", "type='md5'", false);
+        dw.xmlout(tags::byte_run, "", "img_offset='1048576' len='4096'", false);
+        dw.pop();
+    }
+    dw.pop();
+    dw.pop();
+}
+
+/* Time fn, which writes count fileobjects, and print the rate */
+static double report(const std::string &name, int count, std::function<void()> fn)
+{
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    double rate = (double)count * elements_per_fileobject / elapsed.count();
+    std::cout << "  " << name << ": " << (uint64_t)rate << " elements/sec\n";
+    return rate;
+}
+
+static void bench_flush(int count)
+{
+    std::cout << "flush policies (" << count << " fileobjects):\n";
+    std::vector<std::pair<std::string, dfxml_writer::flush_policy_t>> policies = {
+        {"always",          dfxml_writer::flush_policy_t::always()},
+        {"never",           dfxml_writer::flush_policy_t::never()},
+        {"every 1MiB",      dfxml_writer::flush_policy_t::every_bytes(1024*1024)},
+        {"every 100ms",     dfxml_writer::flush_policy_t::every_msec(100)},
+        {"on pop(volume)",  dfxml_writer::flush_policy_t::on_pop("volume")},
+        {"on pop(fileobject)", dfxml_writer::flush_policy_t::on_pop("fileobject")},
+    };
+    std::string reference;
+    for (const auto &it : policies) {
+        report(it.first, count, [&]() {
+            dfxml_writer dw(bench_file, false);
+            dw.set_flush_policy(it.second);
+            write_fileobjects(dw, count);
+            dw.close();
+        });
+        std::string contents = read_file(bench_file);
+        if (reference.empty()) reference = contents;
+        if (contents != reference) {
+            std::cerr << "  " << it.first << ": output differs from the 'always' policy\n";
+            exit(1);
+        }
+    }
+    unlink(bench_file);
+}
+
+/* Several threads commit fileobject fragments, with and without the writer thread */
+static void bench_async(int count)
+{
+    static const int nthreads = 4;
+    std::cout << "fragments from " << nthreads << " threads (" << count << " fileobjects):\n";
+    for (int async = 0; async < 2; async++) {
+        report(async ? "async" : "sync", count, [&]() {
+            dfxml_writer dw(bench_file, false);
+            if (async) dw.start_async();
+            dw.push("dfxml","version='1.0'");
+            std::vector<std::thread> threads;
+            for (int t=0; t<nthreads; t++) {
+                threads.emplace_back([&dw, count, t]() {
+                    dfxml_writer::fragment f(dw);
+                    for (int i=t; i<count; i+=nthreads) {
+                        f.push("fileobject");
+                        f.xmlout("filename", "dir/subdir/file" + std::to_string(i) + ".txt");
+                        f.xmlout("filesize", (uint64_t)i * 4096);
+                        f.xmlout("inode", (int64_t)(i + 100));
+                        f.xmlout("hashdigest", "d41d8cd98f00b204e9800998ecf8427e", "type='md5'", false);
+                        f.xmlout("byte_run", "", "img_offset='1048576' len='4096'", false);
+                        f.pop();
+                        dw.commit(f);
+                    }
+                });
+            }
+            for (auto &th : threads) th.join();
+            dw.pop();
+            dw.close();
+        });
+    }
+    unlink(bench_file);
+}
+
+/* Ordered commits from several threads, against unordered commit(), with a
+ * reorder buffer large enough never to stall and one that stalls often.
+ */
+static void bench_reorder(int count)
+{
+    static const int nthreads = 4;
+    std::cout << "ordered fragments from " << nthreads << " threads (" << count << " fileobjects):\n";
+    struct run {
+        std::string name;
+        bool        ordered;
+        size_t      max_fragments;
+    };
+    for (const auto &it : {run{"unordered", false, 0}, run{"ordered", true, 65536}, run{"ordered, 4 pending", true, 4}}) {
+        dfxml_writer::reorder_stats_t stats;
+        report(it.name, count, [&]() {
+            dfxml_writer dw(bench_file, false);
+            dw.set_flush_policy(dfxml_writer::flush_policy_t::never());
+            dfxml_writer::reorder_policy_t policy;
+            policy.max_fragments = it.max_fragments;
+            dw.set_reorder(0, policy);
+            dw.push("dfxml","version='1.0'");
+            std::vector<std::thread> threads;
+            for (int t=0; t<nthreads; t++) {
+                threads.emplace_back([&dw, &it, count, t]() {
+                    dfxml_writer::fragment f(dw);
+                    for (int i=t; i<count; i+=nthreads) {
+                        f.push("fileobject");
+                        f.xmlout("filename", "dir/subdir/file" + std::to_string(i) + ".txt");
+                        f.xmlout("filesize", (uint64_t)i * 4096);
+                        f.xmlout("inode", (int64_t)(i + 100));
+                        f.xmlout("hashdigest", "d41d8cd98f00b204e9800998ecf8427e", "type='md5'", false);
+                        f.xmlout("byte_run", "", "img_offset='1048576' len='4096'", false);
+                        f.pop();
+                        if (it.ordered) {
+                            dw.commit(f, i);
+                        } else {
+                            dw.commit(f);
+                        }
+                    }
+                });
+            }
+            for (auto &th : threads) th.join();
+            dw.pop();
+            dw.close();
+            stats = dw.get_reorder_stats();
+        });
+        if (it.ordered) {
+            std::cout << "    max pending " << stats.max_pending << ", " << stats.max_pending_bytes << " bytes; "
+                      << stats.stalls << " stalls, " << stats.stall_usec << " usec\n";
+        }
+    }
+    unlink(bench_file);
+}
+
+static void bench_tags(int count)
+{
+    std::cout << "string vs interned tags (" << count << " fileobjects):\n";
+    report("string tags", count, [&]() {
+        dfxml_writer dw(bench_file, false);
+        dw.set_flush_policy(dfxml_writer::flush_policy_t::never());
+        write_fileobjects(dw, count);
+        dw.close();
+    });
+    std::string reference = read_file(bench_file);
+    report("interned tags", count, [&]() {
+        dfxml_writer dw(bench_file, false);
+        dw.set_flush_policy(dfxml_writer::flush_policy_t::never());
+        write_fileobjects_interned(dw, count);
+        dw.close();
+    });
+    if (read_file(bench_file) != reference) {
+        std::cerr << "  interned tags: output differs\n";
+        exit(1);
+    }
+    unlink(bench_file);
+}
+
+/* Plain and compressed output; compression runs on the writer thread */
+static void bench_sink(int count)
+{
+    std::cout << "output sinks (" << count << " fileobjects):\n";
+    for (const char *fname : {"/tmp/dfxml_bench.xml", "/tmp/dfxml_bench.xml.gz", "/tmp/dfxml_bench.xml.zst"}) {
+        std::unique_ptr<dfxml::output_sink> sink;
+        try {
+            sink = dfxml::make_file_sink(fname);
+        } catch (const std::runtime_error &e) {
+            std::cout << "  " << e.what() << "\n";
+            continue;
+        }
+        report(fname, count, [&]() {
+            dfxml_writer dw(std::move(sink));
+            write_fileobjects(dw, count);
+            dw.close();
+        });
+        std::cout << "    " << std::filesystem::file_size(fname) << " bytes\n";
+        unlink(fname);
+    }
+}
+
+/* File backends, with output drained in obuf_max pieces and flushed only at the end */
+static void bench_backend(int count)
+{
+    std::cout << "file backends (" << count << " fileobjects):\n";
+    std::vector<std::pair<std::string, dfxml::io_backend_t>> backends = {
+        {"ofstream", dfxml::IO_OSTREAM},
+        {"write(2)", dfxml::IO_WRITE},
+        {"O_DIRECT", dfxml::IO_DIRECT},
+        {"io_uring", dfxml::IO_URING},
+    };
+    for (const auto &it : backends) {
+        std::unique_ptr<dfxml::output_sink> sink;
+        try {
+            sink = dfxml::make_file_sink(bench_file, it.second);
+        } catch (const std::runtime_error &e) {
+            std::cout << "  " << it.first << ": " << e.what() << "\n";
+            continue;
+        }
+        auto start = std::chrono::steady_clock::now();
+        report(it.first, count, [&]() {
+            dfxml_writer dw(std::move(sink));
+            dw.set_flush_policy(dfxml_writer::flush_policy_t::never());
+            write_fileobjects(dw, count);
+            dw.close();
+        });
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "    " << (uint64_t)(std::filesystem::file_size(bench_file) / elapsed.count() / 1e6) << " MB/s\n";
+    }
+    unlink(bench_file);
+}
+
+/* Element-at-a-time calls vs write(file_object), with several threads */
+static void bench_fileobject(int count)
+{
+    static const int nthreads = 4;
+    std::cout << "fileobjects from " << nthreads << " threads (" << count << " fileobjects):\n";
+    for (int whole = 0; whole < 2; whole++) {
+        report(whole ? "write(file_object)" : "push/xmlout/pop under a mutex", count, [&]() {
+            dfxml_writer dw(bench_file, false);
+            dw.set_flush_policy(dfxml_writer::flush_policy_t::never());
+            dw.push("dfxml","version='1.0'");
+            std::mutex M;           // element-at-a-time callers must serialize whole fileobjects
+            std::vector<std::thread> threads;
+            for (int t=0; t<nthreads; t++) {
+                threads.emplace_back([&dw, &M, count, t, whole]() {
+                    dfxml::file_object fo;
+                    dfxml::byte_run run;
+                    run.img_offset = 1048576;
+                    run.len = 4096;
+                    fo.byte_runs.push_back(run);
+                    fo.hashdigest["md5"] = "d41d8cd98f00b204e9800998ecf8427e";
+                    for (int i=t; i<count; i+=nthreads) {
+                        fo._tags["filename"] = "dir/subdir/file" + std::to_string(i) + ".txt";
+                        fo._tags["filesize"] = std::to_string((uint64_t)i * 4096);
+                        fo._tags["inode"]    = std::to_string(i + 100);
+                        if (whole) {
+                            dw.write(fo);
+                            continue;
+                        }
+                        const std::lock_guard<std::mutex> lock(M);
+                        dw.push("fileobject");
+                        dw.xmlout("filename", fo._tags["filename"]);
+                        dw.xmlout("filesize", fo._tags["filesize"]);
+                        dw.xmlout("inode", fo._tags["inode"]);
+                        dw.xmlout("hashdigest", fo.hashdigest["md5"], "type='md5'", false);
+                        dw.push("byte_runs");
+                        dw.xmlout("byte_run", "", "file_offset='0' img_offset='1048576' len='4096'", false);
+                        dw.pop();
+                        dw.pop();
+                    }
+                });
+            }
+            for (auto &th : threads) th.join();
+            dw.pop();
+            dw.close();
+        });
+    }
+    unlink(bench_file);
+}
+
+/* The cost of writing the index sidecar, and of finding a fileobject with it */
+static void bench_index(int count)
+{
+    std::cout << "index sidecar (" << count << " fileobjects):\n";
+    const std::string idx = std::string(bench_file) + ".idx";
+    for (int indexed = 0; indexed < 2; indexed++) {
+        report(indexed ? "with index" : "without index", count, [&]() {
+            dfxml_writer dw(bench_file, false);
+            dw.set_flush_policy(dfxml_writer::flush_policy_t::never());
+            if (indexed) dw.set_index();
+            write_fileobjects(dw, count);
+            dw.close();
+        });
+    }
+    dfxml::index_reader ir(idx);
+    std::ifstream is(bench_file, std::ios::binary);
+    std::string fo;
+    auto start = std::chrono::steady_clock::now();
+    const uint64_t lookups = 10000;
+    for (uint64_t i=0; i<lookups; i++) {
+        const dfxml::index_record &r = ir[(i * 7919) % ir.size()];
+        fo.resize(r.length);
+        is.seekg(r.offset);
+        is.read(&fo[0], r.length);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "  random fileobject reads: " << (uint64_t)(lookups / elapsed.count()) << " /sec\n";
+    unlink(idx.c_str());
+    unlink(bench_file);
+}
+
+static void bench_profile(int count)
+{
+    std::cout << "timing spans (" << count << " fileobjects):\n";
+    for (int spans = 0; spans < 2; spans++) {
+        report(spans ? "span per fileobject" : "no spans", count, [&]() {
+            dfxml_writer dw(bench_file, false);
+            dw.set_flush_policy(dfxml_writer::flush_policy_t::never());
+            dw.push("dfxml","version='1.0'");
+            for (int i=0; i<count; i++) {
+                std::optional<dfxml::profiler::span> s;
+                if (spans) s.emplace(dw.get_profiler(), "fileobject");
+                dw.push("fileobject");
+                dw.xmlout("filename", "dir/subdir/file" + std::to_string(i) + ".txt");
+                dw.xmlout("filesize", (uint64_t)i * 4096);
+                dw.xmlout("inode", (int64_t)(i + 100));
+                dw.xmlout("hashdigest", "d41d8cd98f00b204e9800998ecf8427e", "type='md5'", false);
+                dw.xmlout("byte_run", "", "img_offset='1048576' len='4096'", false);
+                dw.pop();
+            }
+            if (spans) dw.add_profile();
+            dw.pop();
+            dw.close();
+        });
+    }
+    dfxml::profiler p;
+    auto start = std::chrono::steady_clock::now();
+    for (int i=0; i<count; i++) {
+        dfxml::profiler::span outer(p, "outer");
+        dfxml::profiler::span inner(p, "inner");
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "  nested span pair: " << (uint64_t)(elapsed.count() * 1e9 / count) << " ns\n";
+    unlink(bench_file);
+}
+
+/* Lock statistics on and off, from one thread and from several threads contending for
+ * the lock. Runs alternate between on and off; min and median of each are reported.
+ */
+static void bench_writer_stats(int count)
+{
+    static const int nthreads = 4;
+    static const int reps = 15;
+    auto timed = [&](int threads, bool on, dfxml_writer::writer_stats_t *st) {
+        auto start = std::chrono::steady_clock::now();
+        dfxml_writer dw(bench_file, false);
+        dw.set_flush_policy(dfxml_writer::flush_policy_t::never());
+        dw.set_writer_stats(on);
+        if (threads==1) {
+            write_fileobjects(dw, count);
+        } else {
+            dw.push("dfxml","version='1.0'");
+            std::vector<std::thread> workers;
+            for (int t=0; t<threads; t++) {
+                workers.emplace_back([&dw, count, t, threads]() {
+                    dfxml::file_object fo;
+                    dfxml::byte_run run;
+                    run.img_offset = 1048576;
+                    run.len = 4096;
+                    fo.byte_runs.push_back(run);
+                    fo.hashdigest["md5"] = "d41d8cd98f00b204e9800998ecf8427e";
+                    for (int i=t; i<count; i+=threads) {
+                        fo._tags["filename"] = "dir/subdir/file" + std::to_string(i) + ".txt";
+                        fo._tags["inode"]    = std::to_string(i + 100);
+                        dw.write(fo);
+                    }
+                });
+            }
+            for (auto &th : workers) th.join();
+            dw.pop();
+        }
+        dw.close();
+        if (st) *st = dw.get_writer_stats();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count();
+    };
+    std::cout << "writer stats (" << count << " fileobjects, " << reps << " runs each):\n";
+    for (int threads : {1, nthreads}) {
+        std::vector<double> times[2];
+        dfxml_writer::writer_stats_t st;
+        timed(threads, false, nullptr); // warm up
+        for (int r=0; r<reps; r++) {
+            for (int on = 0; on < 2; on++) times[on].push_back(timed(threads, on, on ? &st : nullptr));
+        }
+        double median[2], min[2];
+        for (int on = 0; on < 2; on++) {
+            std::sort(times[on].begin(), times[on].end());
+            min[on]    = times[on][0];
+            median[on] = times[on][reps/2];
+            std::cout << "  " << threads << (threads==1 ? " thread" : " threads") << ", lock stats "
+                      << (on ? "on: " : "off:") << " min " << (uint64_t)(times[on][0] * 1e6)
+                      << " usec, median " << (uint64_t)(median[on] * 1e6) << " usec\n";
+        }
+        std::cout << "    overhead " << std::fixed << std::setprecision(1)
+                  << 100.0 * (min[1] - min[0]) / min[0] << "% (min), "
+                  << 100.0 * (median[1] - median[0]) / median[0] << "% (median); "
+                  << st.lock_acquisitions << " acquisitions, " << st.lock_wait.count << " contended\n";
+        std::cout << std::defaultfloat;
+    }
+    unlink(bench_file);
+}
+
+/* Timestamps as a scan sees them: mostly clustered, some scattered, many whole seconds */
+static std::vector<struct timeval> make_timestamps(int count, bool clustered)
+{
+    std::vector<struct timeval> ret(count);
+    uint64_t x = 88172645463325252ULL;
+    time_t t = 1614834367;
+    for (auto &it : ret) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        if (clustered) {
+            t += x % 120;               // files written together
+            it.tv_sec = t;
+        } else {
+            it.tv_sec = 946684800 + x % (20ULL*365*86400); // anywhere in 20 years
+        }
+        it.tv_usec = (x >> 40) % 4 ? (x >> 20) % 1000000 : 0;
+    }
+    return ret;
+}
+
+static void bench_to8601(int count)
+{
+    std::cout << "to8601 (" << count << " timestamps):\n";
+    const std::pair<const char *, bool> corpora[] = {{"clustered", true}, {"scattered over 20 years", false}};
+    for (const auto &corpus : corpora) {
+        const std::vector<struct timeval> ts = make_timestamps(count, corpus.second);
+        std::cout << "  " << corpus.first << ":\n";
+        auto rate = [&](const std::string &name, std::function<size_t(const struct timeval &)> fn) {
+            size_t total = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (const auto &it : ts) total += fn(it);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            volatile size_t sink = total;
+            (void)sink;
+            std::cout << "    " << name << ": " << (uint64_t)(ts.size() / elapsed.count()) << " /sec\n";
+        };
+        rate("strftime", [](const struct timeval &t) { return dfxml_writer::to8601_strftime(t).size(); });
+        rate("to8601", [](const struct timeval &t) { return dfxml_writer::to8601(t).size(); });
+        char buf[dfxml_writer::iso8601_max];
+        rate("format_8601 (no string)", [&buf](const struct timeval &t) {
+            return dfxml_writer::format_8601(buf, t.tv_sec, t.tv_usec);
+        });
+    }
+}
+
+/* byte_run attributes built with stringstreams, as callers used to, and with attribute_list */
+static void bench_attributes(int count)
+{
+    std::cout << "attributes (" << count << " byte_runs):\n";
+    auto rate = [&](const std::string &name, std::function<void()> fn) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "  " << name << ": " << (uint64_t)(count / elapsed.count()) << " byte_runs/sec\n";
+    };
+    for (int round = 0; round < 2; round++) { // the first round warms up
+        rate("stringstream", [&]() {
+            dfxml_writer dw(bench_file, false);
+            dw.set_flush_policy(dfxml_writer::flush_policy_t::never());
+            dw.push("byte_runs");
+            for (int i = 0; i < count; i++) {
+                std::stringstream ss;
+                ss << "file_offset='" << (uint64_t)i*4096 << "' img_offset='" << (uint64_t)i*4096 + 1048576
+                   << "' len='" << 4096 << "'";
+                dw.xmlout("byte_run", "", ss.str(), false);
+            }
+            dw.pop();
+            dw.close();
+        });
+        rate("attribute_list", [&]() {
+            dfxml_writer dw(bench_file, false);
+            dw.set_flush_policy(dfxml_writer::flush_policy_t::never());
+            dw.push("byte_runs");
+            dfxml_writer::attribute_list attrs;
+            for (int i = 0; i < count; i++) {
+                attrs.clear();
+                attrs.add("file_offset", (uint64_t)i*4096).add("img_offset", (uint64_t)i*4096 + 1048576).add("len", 4096);
+                dw.xmlout("byte_run", "", attrs, false);
+            }
+            dw.pop();
+            dw.close();
+        });
+    }
+    unlink(bench_file);
+}
+
+/* Indented output, one line per fileobject as fiwalk writes it, and compact output of fiwalk-like fileobjects, by rate and size */
+static void bench_compact(int count)
+{
+    std::cout << "layout (" << count << " fileobjects):\n";
+    dfxml::file_object fo;
+    fo._tags["partition"] = "1";
+    fo._tags["name_type"] = "r";
+    fo._tags["filesize"]  = "12288";
+    fo._tags["alloc"]     = "1";
+    fo._tags["mtime"]     = "2021-03-04T05:06:07Z";
+    fo._tags["crtime"]    = "2021-03-04T05:06:07Z";
+    fo.hashdigest["md5"]  = "d41d8cd98f00b204e9800998ecf8427e";
+    fo.hashdigest["sha1"] = "da39a3ee5e6b4b0d3255bfef95601890afd80709";
+    for (int i = 0; i < 3; i++) {
+        dfxml::byte_run run;
+        run.file_offset = i*4096;
+        run.img_offset  = 1048576 + i*65536;
+        run.len         = 4096;
+        fo.byte_runs.push_back(run);
+    }
+    uint64_t indented = 0;
+    for (int mode = 0; mode < 3; mode++) {
+        report(mode==0 ? "indented" : mode==1 ? "oneline fileobjects" : "compact", count, [&]() {
+            dfxml_writer dw(bench_file, false);
+            dw.set_flush_policy(dfxml_writer::flush_policy_t::never());
+            dw.set_compact(mode==2);
+            dw.push("dfxml","version='1.0'");
+            dw.push("volume","offset='0'");
+            for (int i=0; i<count; i++) {
+                fo._tags["filename"] = "dir/subdir/file" + std::to_string(i) + ".txt";
+                fo._tags["inode"]    = std::to_string(i + 100);
+                dw.set_oneline(mode==1);
+                dw.write(fo);
+                dw.set_oneline(false);
+            }
+            dw.pop();
+            dw.pop();
+            dw.close();
+        });
+        const uint64_t bytes = std::filesystem::file_size(bench_file);
+        if (mode==0) indented = bytes;
+        std::cout << "    " << bytes << " bytes (" << (int)(100.0 * bytes / indented) << "% of indented)\n";
+    }
+    unlink(bench_file);
+}
+
+/* Many small documents, as a service makes one per request, to a file and in memory */
+static void bench_memory(int count)
+{
+    std::cout << "small documents (" << count << " documents):\n";
+    auto document = [](dfxml_writer &dw, int i) {
+        dw.push("dfxml", "version='1.0'");
+        dw.push("fileobject");
+        dw.xmlout("filename", "dir/subdir/file.txt");
+        dw.xmlout("filesize", (uint64_t)i * 4096);
+        dw.xmlout("hashdigest", "d41d8cd98f00b204e9800998ecf8427e", "type='md5'", false);
+        dw.pop();
+        dw.pop();
+        dw.close();
+    };
+    auto rate = [&](const std::string &name, std::function<void()> fn) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "  " << name << ": " << (uint64_t)(count / elapsed.count()) << " documents/sec\n";
+    };
+    rate("file", [&]() {
+        for (int i = 0; i < count; i++) {
+            dfxml_writer dw(bench_file, false);
+            document(dw, i);
+        }
+    });
+    unlink(bench_file);
+    rate("reused buffer", [&]() {
+        std::string buffer;
+        for (int i = 0; i < count; i++) {
+            buffer.clear();
+            dfxml_writer dw(dfxml::buffer_target(buffer));
+            document(dw, i);
+        }
+    });
+#ifdef DFXML_SINK_PMR
+    rate("arena buffer", [&]() {
+        std::vector<char> block(64*1024);
+        for (int i = 0; i < count; i++) {
+            std::pmr::monotonic_buffer_resource arena(block.data(), block.size());
+            std::pmr::string buffer(&arena);
+            dfxml_writer dw(dfxml::buffer_target(buffer));
+            document(dw, i);
+        }
+    });
+#endif
+    rate("callback", [&]() {
+        size_t total = 0;
+        for (int i = 0; i < count; i++) {
+            dfxml_writer dw([&total](std::string_view s) { total += s.size(); });
+            document(dw, i);
+        }
+    });
+}
+
+/* Filename corpora for the escape benchmark */
+static std::vector<std::string> make_filenames(int count, bool escape_heavy)
+{
+    static const char *dirs[] = {"Windows/System32/drivers/etc", "Users/jdoe/AppData/Local/Temp",
+                                 "Program Files (x86)/Common Files", "home/user/.cache/mozilla/firefox",
+                                 "var/log/journal", "Users/jdoe/Documents/Projects/2021"};
+    static const char *clean[] = {"hosts", "~DF3A2B.tmp", "report_final_v2.docx", "IMG_20210704_153012.jpg",
+                                  "index.sqlite-wal", "system.journal", "libcrypto.so.1.1"};
+    static const char *dirty[] = {"Tom & Jerry's <draft>.doc", "\"quoted\" name.txt", "a<b>c&d.txt",
+                                  "tab\tseparated.csv", "line\nbreak.txt", "R&D 'Q3' <final>.xlsx"};
+    std::vector<std::string> names;
+    srandom(1);
+    for (int i=0; i<count; i++) {
+        std::string name = dirs[random() % 6];
+        name += "/";
+        name += escape_heavy ? dirty[random() % 6] : clean[random() % 7];
+        names.push_back(name);
+    }
+    return names;
+}
+
+/* The original implementation, for comparison */
+static std::string xmlescape_stringstream(const std::string &xml)
+{
+    std::stringstream ret;
+    for(char ch: xml){
+        switch(ch){
+        case '>':  ret << dfxml_writer::xml_gt; break;
+        case '<':  ret << dfxml_writer::xml_lt; break;
+        case '&':  ret << dfxml_writer::xml_am; break;
+        case '\'': ret << dfxml_writer::xml_ap; break;
+        case '"':  ret << dfxml_writer::xml_qu; break;
+        case '\000':  ret << dfxml_writer::encoding_null; break;
+        case '\r':  ret << dfxml_writer::encoding_r; break;
+        case '\n':  ret << dfxml_writer::encoding_n; break;
+        case '\t':  ret << dfxml_writer::encoding_t; break;
+        default:
+            ret << ch;
+        }
+    }
+    return ret.str();
+}
+
+static void bench_escape_corpus(const std::string &title, const std::vector<std::string> &names)
+{
+    const int rounds = 20;
+    size_t bytes = 0;
+    for (const auto &name : names) bytes += name.size();
+    bytes *= rounds;
+
+    auto mbps = [bytes](const std::string &name, std::function<size_t()> fn) {
+        auto start = std::chrono::steady_clock::now();
+        volatile size_t sink = fn();
+        (void)sink;
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "    " << name << ": " << (uint64_t)(bytes / elapsed.count() / 1e6) << " MB/s\n";
+    };
+    auto scan = [&names](dfxml_writer::find_escape_t fn) {
+        size_t total = 0;
+        for (int r=0; r<rounds; r++) {
+            for (const auto &name : names) total += fn(name.data(), name.size());
+        }
+        return total;
+    };
+
+    std::cout << "  " << title << ":\n";
+    mbps("scan scalar", [&]() { return scan(dfxml_writer::find_escape_scalar); });
+#ifdef DFXML_ESCAPE_SSE2
+    mbps("scan sse2", [&]() { return scan(dfxml_writer::find_escape_sse2); });
+#endif
+#ifdef DFXML_ESCAPE_AVX2
+    if (CPUID::has_avx2()) mbps("scan avx2", [&]() { return scan(dfxml_writer::find_escape_avx2); });
+#endif
+    mbps("xmlescape stringstream", [&]() {
+        size_t total = 0;
+        for (int r=0; r<rounds; r++) {
+            for (const auto &name : names) total += xmlescape_stringstream(name).size();
+        }
+        return total;
+    });
+    mbps("xmlescape", [&]() {
+        size_t total = 0;
+        for (int r=0; r<rounds; r++) {
+            for (const auto &name : names) total += dfxml_writer::xmlescape(name).size();
+        }
+        return total;
+    });
+    mbps("append_escaped (reused buffer)", [&]() {
+        size_t total = 0;
+        std::string buf;
+        for (int r=0; r<rounds; r++) {
+            for (const auto &name : names) {
+                buf.clear();
+                dfxml_writer::append_escaped(buf, name);
+                total += buf.size();
+            }
+        }
+        return total;
+    });
+}
+
+static void bench_escape(int count)
+{
+    std::cout << "xmlescape (" << count << " filenames, scanner " << dfxml_writer::escape_scanner_name() << "):\n";
+    bench_escape_corpus("clean filenames", make_filenames(count, false));
+    bench_escape_corpus("escape-heavy filenames", make_filenames(count, true));
+}
+
+int main(int argc, char **argv)
+{
+    std::string test = argc > 1 ? argv[1] : "all";
+    int count = argc > 2 ? atoi(argv[2]) : 200000;
+
+    if (test=="all" || test=="flush") bench_flush(count);
+    if (test=="all" || test=="async") bench_async(count);
+    if (test=="all" || test=="escape") bench_escape(count);
+    if (test=="all" || test=="tags") bench_tags(count);
+    if (test=="all" || test=="sink") bench_sink(count);
+    if (test=="all" || test=="backend") bench_backend(count);
+    if (test=="all" || test=="fileobject") bench_fileobject(count);
+    if (test=="all" || test=="reorder") bench_reorder(count);
+    if (test=="all" || test=="index") bench_index(count);
+    if (test=="all" || test=="profile") bench_profile(count);
+    if (test=="all" || test=="writer_stats") bench_writer_stats(count);
+    if (test=="all" || test=="to8601") bench_to8601(count);
+    if (test=="all" || test=="attributes") bench_attributes(count);
+    if (test=="all" || test=="compact") bench_compact(count);
+    if (test=="all" || test=="memory") bench_memory(count);
+    return 0;
+}
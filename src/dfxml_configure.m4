@@ -12,10 +12,15 @@
 #
 
 AC_MSG_NOTICE([dfxml_cpp/src/dfxml_configure.m4 start])
-AC_CHECK_HEADERS([expat.h sys/resource.h sys/utsname.h unistd.h winsock2.h boost/version.hpp pwd.h uuid/uuid.h])
-AC_CHECK_FUNCS([gmtime_r getuid gethostname getpwuid getrusage vasprintf ])
+AC_CHECK_HEADERS([expat.h fcntl.h linux/io_uring.h linux/perf_event.h sys/ioctl.h sys/mman.h sys/resource.h sys/syscall.h sys/utsname.h unistd.h winsock2.h boost/version.hpp pwd.h uuid/uuid.h])
+AC_CHECK_FUNCS([copy_file_range gmtime_r getuid gethostname getpwuid getrusage vasprintf ])
 AC_MSG_NOTICE([dfxml_cpp/src/dfxml_configure.m4 checked initial headers and funcs])
 
+# zlib and zstd are optional; they enable compressed output
+AC_CHECK_HEADERS([zlib.h zstd.h])
+AC_CHECK_LIB([z],[deflateInit2_])
+AC_CHECK_LIB([zstd],[ZSTD_compressStream2])
+
 # Expat is required
 have_expat=yes
 AC_CHECK_HEADER([expat.h])
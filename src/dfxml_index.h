@@ -0,0 +1,224 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/*
+ * The byte-offset index that dfxml_writer can write next to its output.
+ * foo.xml.idx holds a fixed header and then one fixed-size record per
+ * top-level <fileobject>, in output order, so a reader can seek to object
+ * N or split the file at object boundaries without parsing it. The file
+ * is in host byte order and can be mapped directly.
+ * Include this AFTER your config file with the HAVE statements.
+ */
+
+/*
+ * Revision History:
+ * 2026 - DFXML contributors - Created.
+ *
+ * Copyright (C) 2026 DFXML contributors.
+ *
+ * LICENSE: LGPL Version 3. See COPYING.md for further information.
+ */
+
+#ifndef DFXML_INDEX_H
+#define DFXML_INDEX_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_UNISTD_H) && defined(HAVE_FCNTL_H)
+#define DFXML_INDEX_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace dfxml {
+    inline constexpr char     index_magic[8]   = {'D','F','X','M','L','I','D','X'};
+    inline constexpr uint32_t index_version    = 1;
+    inline constexpr uint32_t index_byte_order = 0x01020304; // reads back differently on the other byte order
+    inline constexpr uint64_t index_none       = UINT64_MAX; // a key field that the fileobject does not have
+
+    enum index_flags_t {
+        INDEX_COMPRESSED = 1            // offsets are into the uncompressed output
+    };
+
+    struct index_header {
+        char     magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        uint32_t record_size;           // sizeof(index_record), so that later versions can append fields
+        uint32_t flags;
+        uint64_t count;                 // records that follow the header
+        int64_t  offset_adjust;         // already added to each offset; non-zero if the DTD moved the body
+        uint64_t reserved[3];
+    };
+    static_assert(sizeof(index_header)==64, "index_header must be 64 bytes");
+
+    struct index_record {
+        uint64_t ordinal;               // counts fileobjects from 0, across shards
+        uint64_t offset;                // of the '<' of <fileobject>
+        uint64_t length;                // through the '>' of </fileobject>
+        uint64_t inode;
+        uint64_t img_offset;            // of the first byte_run
+    };
+    static_assert(sizeof(index_record)==40, "index_record must be 40 bytes");
+
+    /* Appends records as they come and writes the header on close().
+     * If the offsets change after they were recorded, close() rewrites them.
+     */
+    class index_writer {
+        std::fstream          f;
+        std::filesystem::path fname;
+        index_header          hdr {};
+        std::vector<index_record> buf {};
+        static inline const size_t buf_records = 4096;
+
+        void write_buf() {
+            f.write(reinterpret_cast<const char *>(buf.data()), buf.size()*sizeof(index_record));
+            buf.clear();
+        }
+        explicit index_writer(const std::filesystem::path &fname_): // an existing index; see reopen()
+            f(fname_, std::ios::in | std::ios::out | std::ios::binary), fname(fname_) {
+            if (!f.is_open()) throw std::runtime_error(fname.string());
+            buf.reserve(buf_records);
+        }
+    public:
+        index_writer(const std::filesystem::path &fname_, uint32_t flags):
+            f(fname_, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc), fname(fname_) {
+            if (!f.is_open()) throw std::runtime_error(fname.string());
+            memcpy(hdr.magic, index_magic, sizeof(hdr.magic));
+            hdr.version     = index_version;
+            hdr.byte_order  = index_byte_order;
+            hdr.record_size = sizeof(index_record);
+            hdr.flags       = flags;
+            f.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr)); // count is filled in by close()
+            buf.reserve(buf_records);
+        }
+        /* Reopen an index that a checkpoint left with count records, dropping any after them */
+        static std::unique_ptr<index_writer> reopen(const std::filesystem::path &fname, uint64_t count) {
+            if (std::filesystem::file_size(fname) < sizeof(index_header) + count*sizeof(index_record)) {
+                throw std::runtime_error(fname.string() + ": index is shorter than its checkpoint");
+            }
+            std::filesystem::resize_file(fname, sizeof(index_header) + count*sizeof(index_record));
+            std::unique_ptr<index_writer> w(new index_writer(fname));
+            w->f.read(reinterpret_cast<char *>(&w->hdr), sizeof(w->hdr));
+            if (!w->f.good() || memcmp(w->hdr.magic, index_magic, sizeof(w->hdr.magic))!=0) {
+                throw std::runtime_error(fname.string() + ": not a DFXML index");
+            }
+            w->hdr.count = count;
+            w->f.seekp(0, std::ios::end);
+            return w;
+        }
+        index_writer(const index_writer &) = delete;
+        index_writer &operator=(const index_writer &) = delete;
+
+        void add(const index_record &r) {
+            buf.push_back(r);
+            hdr.count++;
+            if (buf.size()==buf_records) write_buf();
+        }
+        uint64_t count() const { return hdr.count; }
+        void flush() {                  // the header is written by close()
+            write_buf();
+            f.flush();
+            if (f.fail()) throw std::runtime_error(fname.string() + ": cannot write index");
+        }
+        const std::filesystem::path &path() const { return fname; }
+
+        /* offset_adjust is added to every offset already written */
+        void close(int64_t offset_adjust) {
+            if (!f.is_open()) return;
+            write_buf();
+            if (offset_adjust!=0) {
+                std::vector<index_record> recs(buf_records);
+                for (uint64_t i=0; i<hdr.count; i+=recs.size()) {
+                    const size_t n = std::min<uint64_t>(recs.size(), hdr.count-i);
+                    const std::streamoff pos = sizeof(hdr) + i*sizeof(index_record);
+                    f.seekg(pos);
+                    f.read(reinterpret_cast<char *>(recs.data()), n*sizeof(index_record));
+                    for (size_t j=0; j<n; j++) recs[j].offset += offset_adjust;
+                    f.seekp(pos);
+                    f.write(reinterpret_cast<const char *>(recs.data()), n*sizeof(index_record));
+                }
+            }
+            hdr.offset_adjust = offset_adjust;
+            f.seekp(0);
+            f.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+            f.close();
+            if (f.fail()) throw std::runtime_error(fname.string() + ": cannot write index");
+        }
+    };
+
+    /* Reads an index, mapping it where possible */
+    class index_reader {
+        const index_header *hdr {nullptr};
+        const index_record *recs {nullptr};
+        std::vector<char>   data {};    // if not mapped
+        void               *map {nullptr};
+        size_t              map_len {0};
+
+        void check(const std::filesystem::path &fname, size_t len) {
+            if (len < sizeof(index_header)) throw std::runtime_error(fname.string() + ": not a DFXML index");
+            if (memcmp(hdr->magic, index_magic, sizeof(hdr->magic))!=0) {
+                throw std::runtime_error(fname.string() + ": not a DFXML index");
+            }
+            if (hdr->byte_order!=index_byte_order) {
+                throw std::runtime_error(fname.string() + ": index was written with the other byte order");
+            }
+            if (hdr->version!=index_version) {
+                throw std::runtime_error(fname.string() + ": unsupported index version");
+            }
+            if (hdr->record_size!=sizeof(index_record)) {
+                throw std::runtime_error(fname.string() + ": unsupported index record size");
+            }
+            if (len < sizeof(index_header) + hdr->count*sizeof(index_record)) {
+                throw std::runtime_error(fname.string() + ": index is truncated");
+            }
+            recs = reinterpret_cast<const index_record *>(reinterpret_cast<const char *>(hdr) + sizeof(index_header));
+        }
+    public:
+        explicit index_reader(const std::filesystem::path &fname) {
+#ifdef DFXML_INDEX_MMAP
+            int fd = ::open(fname.c_str(), O_RDONLY);
+            if (fd<0) throw std::runtime_error(fname.string() + ": " + strerror(errno));
+            map_len = std::filesystem::file_size(fname);
+            if (map_len>0) {
+                map = mmap(nullptr, map_len, PROT_READ, MAP_SHARED, fd, 0);
+                if (map==MAP_FAILED) map = nullptr;
+            }
+            ::close(fd);
+            if (map) {
+                hdr = static_cast<const index_header *>(map);
+                check(fname, map_len);
+                return;
+            }
+#endif
+            std::ifstream is(fname, std::ios::binary);
+            if (!is.is_open()) throw std::runtime_error(fname.string());
+            data.assign(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+            hdr = reinterpret_cast<const index_header *>(data.data());
+            check(fname, data.size());
+        }
+        index_reader(const index_reader &) = delete;
+        index_reader &operator=(const index_reader &) = delete;
+        ~index_reader() {
+#ifdef DFXML_INDEX_MMAP
+            if (map) munmap(map, map_len);
+#endif
+        }
+        const index_header &header() const { return *hdr; }
+        uint64_t size() const { return hdr->count; }
+        const index_record &operator[](uint64_t i) const { return recs[i]; }
+        const index_record *begin() const { return recs; }
+        const index_record *end() const { return recs + hdr->count; }
+    };
+}
+#endif
@@ -0,0 +1,702 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/*
+ * Timing spans for dfxml_writer. A span times a named phase on the
+ * steady clock from its construction to its destruction. Spans opened
+ * while another is open on the same thread nest inside it, so "hash"
+ * opened inside "scan" is recorded as the phase scan/hash. Each phase
+ * keeps a count, the total, minimum and maximum time and a log2
+ * histogram, summed over all threads that ran it.
+ *
+ * Also the resource sampler, which records the process's rusage,
+ * resident set and I/O counters at intervals into a fixed ring, and
+ * hardware performance counters and resource use for the process or
+ * for each thread that registers, and a mutex that counts contention.
+ * Include this AFTER your config file with the HAVE statements.
+ */
+
+/*
+ * Revision History:
+ * 2026 - DFXML contributors - Created.
+ *
+ * Copyright (C) 2026 DFXML contributors.
+ *
+ * LICENSE: LGPL Version 3. See COPYING.md for further information.
+ */
+
+#ifndef DFXML_PROFILE_H
+#define DFXML_PROFILE_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && defined(HAVE_SYS_SYSCALL_H) && defined(HAVE_UNISTD_H) && defined(HAVE_SYS_RESOURCE_H)
+#define DFXML_THREAD_RESOURCES
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(HAVE_LINUX_PERF_EVENT_H) && defined(HAVE_SYS_SYSCALL_H) \
+    && defined(HAVE_SYS_IOCTL_H) && defined(HAVE_UNISTD_H)
+#define DFXML_PERF
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+namespace dfxml {
+    enum perf_event_t {
+        PERF_CYCLES,
+        PERF_INSTRUCTIONS,
+        PERF_CACHE_MISSES,
+        PERF_BRANCH_MISSES,
+        PERF_CONTEXT_SWITCHES,
+        PERF_EVENTS
+    };
+    inline const char *perf_event_name(size_t e) {
+        static const char *names[PERF_EVENTS] = {"cycles", "instructions", "cache_misses",
+                                                 "branch_misses", "context_switches"};
+        return names[e];
+    }
+    typedef std::array<uint64_t, PERF_EVENTS> perf_values_t;
+
+    /* Hardware performance counters from perf_event_open(2), for the whole
+     * process or for the calling thread. A counter that cannot be opened,
+     * because the CPU or a VM has no PMU or because perf_event_paranoid
+     * forbids it, reads as 0 and is reported with the errno it got.
+     * Process counters include threads started after they are opened.
+     */
+    class perf_counters {
+        std::array<int, PERF_EVENTS> fd;
+        std::array<int, PERF_EVENTS> err;   // errno if fd is -1
+#ifdef DFXML_PERF
+        static int open_event(uint32_t type, uint64_t config, bool thread) {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size        = sizeof(attr);
+            attr.type        = type;
+            attr.config      = config;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            attr.inherit     = !thread;
+            attr.exclude_hv  = 1;
+            int f = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+            if (f<0 && (errno==EACCES || errno==EPERM)) { // perf_event_paranoid>=2 allows user space only
+                attr.exclude_kernel = 1;
+                f = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+            }
+            return f;
+        }
+#endif
+    public:
+        enum scope_t { PROCESS, THREAD };
+        explicit perf_counters(scope_t scope): fd(), err() {
+            fd.fill(-1);
+            err.fill(ENOSYS);
+#ifdef DFXML_PERF
+            static const std::pair<uint32_t, uint64_t> events[PERF_EVENTS] = {
+                {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+                {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+                {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+                {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+                {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+            };
+            for (size_t i=0; i<PERF_EVENTS; i++) {
+                fd[i]  = open_event(events[i].first, events[i].second, scope==THREAD);
+                err[i] = fd[i]<0 ? errno : 0;
+            }
+#else
+            (void)scope;
+#endif
+        }
+        perf_counters(const perf_counters &) = delete;
+        perf_counters &operator=(const perf_counters &) = delete;
+        ~perf_counters() {
+#ifdef DFXML_PERF
+            for (int f : fd) if (f>=0) ::close(f);
+#endif
+        }
+        bool available(size_t e) const { return fd[e]>=0; }
+        int  error(size_t e) const { return err[e]; }
+        bool any() const { return mask()!=0; }
+        uint32_t mask() const {         // bit e is set if event e is available
+            uint32_t m = 0;
+            for (size_t i=0; i<PERF_EVENTS; i++) if (fd[i]>=0) m |= 1U<<i;
+            return m;
+        }
+        // counts so far, scaled up if the kernel multiplexed the counter
+        perf_values_t read() const {
+            perf_values_t ret {};
+#ifdef DFXML_PERF
+            for (size_t i=0; i<PERF_EVENTS; i++) {
+                uint64_t v[3];          // value, time enabled, time running
+                if (fd[i]<0 || ::read(fd[i], v, sizeof(v))!=(ssize_t)sizeof(v)) continue;
+                ret[i] = (v[2]>0 && v[2]<v[1]) ? (uint64_t)((double)v[0] * v[1] / v[2]) : v[0];
+            }
+#endif
+            return ret;
+        }
+    };
+
+    /* What one thread has used. A thread can read its own rusage exactly
+     * (RUSAGE_THREAD); another thread's comes from /proc/self/task/<tid>,
+     * in clock ticks, and only while it runs.
+     */
+    struct thread_resources {
+        uint32_t    index       {0};    // see profiler
+        uint64_t    tid         {0};
+        std::string name        {};
+        bool        exited      {false}; // read as the thread exited
+        bool        valid       {false}; // could be read at all
+        bool        has_io      {false};
+        uint64_t    utime_usec  {0};
+        uint64_t    stime_usec  {0};
+        uint64_t    minflt      {0};
+        uint64_t    majflt      {0};
+        uint64_t    nvcsw       {0};
+        uint64_t    nivcsw      {0};
+        uint64_t    rchar       {0};
+        uint64_t    wchar       {0};
+        uint64_t    read_bytes  {0};
+        uint64_t    write_bytes {0};
+
+        static uint64_t gettid() {
+#ifdef DFXML_THREAD_RESOURCES
+            return syscall(SYS_gettid);
+#else
+            return 0;
+#endif
+        }
+#ifdef DFXML_THREAD_RESOURCES
+        std::string task_file(const char *name_) const {
+            return "/proc/self/task/" + std::to_string(tid) + "/" + name_;
+        }
+        void read_io() {
+            std::ifstream io(task_file("io"));
+            std::string field;
+            uint64_t value = 0;
+            while (io >> field >> value) {
+                if      (field=="rchar:")       rchar = value;
+                else if (field=="wchar:")       wchar = value;
+                else if (field=="read_bytes:")  read_bytes = value;
+                else if (field=="write_bytes:") write_bytes = value;
+                else continue;
+                has_io = true;
+            }
+        }
+#endif
+        // called by the thread itself
+        void read_self() {
+#ifdef DFXML_THREAD_RESOURCES
+            struct rusage ru;
+            memset(&ru, 0, sizeof(ru));
+            if (getrusage(RUSAGE_THREAD, &ru)!=0) return;
+            utime_usec = (uint64_t)ru.ru_utime.tv_sec*1000000 + ru.ru_utime.tv_usec;
+            stime_usec = (uint64_t)ru.ru_stime.tv_sec*1000000 + ru.ru_stime.tv_usec;
+            minflt     = ru.ru_minflt;
+            majflt     = ru.ru_majflt;
+            nvcsw      = ru.ru_nvcsw;
+            nivcsw     = ru.ru_nivcsw;
+            valid      = true;
+            read_io();
+#endif
+        }
+        // called by any thread, while thread tid runs
+        void read_task() {
+#ifdef DFXML_THREAD_RESOURCES
+            std::ifstream stat(task_file("stat"));
+            std::string line;
+            if (!std::getline(stat, line)) return;
+            const size_t comm_end = line.rfind(')'); // the name may hold spaces
+            if (comm_end==std::string::npos) return;
+            std::istringstream fields(line.substr(comm_end+1));
+            std::vector<std::string> f;      // f[0] is field 3, the state
+            for (std::string tok; fields >> tok; ) f.push_back(tok);
+            if (f.size() < 13) return;
+            const uint64_t tick_usec = 1000000 / sysconf(_SC_CLK_TCK);
+            minflt     = std::stoull(f[7]);
+            majflt     = std::stoull(f[9]);
+            utime_usec = std::stoull(f[11]) * tick_usec;
+            stime_usec = std::stoull(f[12]) * tick_usec;
+            std::ifstream status(task_file("status"));
+            std::string field;
+            while (status >> field) {
+                if      (field=="voluntary_ctxt_switches:")    status >> nvcsw;
+                else if (field=="nonvoluntary_ctxt_switches:") status >> nivcsw;
+            }
+            valid = true;
+            read_io();
+#endif
+        }
+    };
+
+    struct phase_stats {
+        static inline const size_t buckets = 48; // bucket i counts durations in [2^i,2^(i+1)) ns; 0 counts 0 and 1
+        uint64_t count    {0};
+        uint64_t total_ns {0};
+        uint64_t min_ns   {UINT64_MAX};
+        uint64_t max_ns   {0};
+        uint32_t threads  {1};          // threads that ran the phase
+        std::array<uint64_t, buckets> histogram {};
+        perf_values_t perf {};          // counted by spans on threads with perf counters
+        uint64_t perf_count {0};        // spans that counted them
+        uint32_t perf_mask {0};         // perf_counters::mask() of those threads
+
+        static size_t bucket(uint64_t ns) {
+            return ns<2 ? 0 : std::min<size_t>(63 - __builtin_clzll(ns), buckets-1);
+        }
+        void add(uint64_t ns) {
+            count++;
+            total_ns += ns;
+            min_ns = std::min(min_ns, ns);
+            max_ns = std::max(max_ns, ns);
+            histogram[bucket(ns)]++;
+        }
+        void merge(const phase_stats &s) {
+            count    += s.count;
+            total_ns += s.total_ns;
+            min_ns    = std::min(min_ns, s.min_ns);
+            max_ns    = std::max(max_ns, s.max_ns);
+            threads  += s.threads;
+            for (size_t i=0; i<buckets; i++) histogram[i] += s.histogram[i];
+            for (size_t i=0; i<PERF_EVENTS; i++) perf[i] += s.perf[i];
+            perf_count += s.perf_count;
+            perf_mask  |= s.perf_mask;
+        }
+    };
+
+    /* A mutex that can count its acquisitions, time the ones that had to
+     * wait, and time one hold in hold_sample, so that the clock is read
+     * rarely on the fast path. With stats off it is a std::mutex and the
+     * test of a flag. The stats are guarded by the mutex itself.
+     */
+    class stat_mutex {
+    public:
+        struct stats_t {
+            uint64_t    acquisitions {0};
+            phase_stats wait {};        // of the acquisitions that found it locked
+            phase_stats hold {};        // sampled
+        };
+        static inline const uint64_t hold_sample = 256;
+    private:
+        std::mutex        m {};
+        std::atomic<bool> on {false};
+        bool              timing {false}; // this hold is sampled
+        std::chrono::steady_clock::time_point held {};
+        stats_t           st {};
+
+        static uint64_t since(std::chrono::steady_clock::time_point t) {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t).count();
+        }
+        void acquired() {
+            if (++st.acquisitions % hold_sample == 0) {
+                timing = true;
+                held = std::chrono::steady_clock::now();
+            }
+        }
+    public:
+        stat_mutex() {}
+        stat_mutex(const stat_mutex &) = delete;
+        stat_mutex &operator=(const stat_mutex &) = delete;
+
+        void lock() {
+            if (!on.load(std::memory_order_relaxed)) {
+                m.lock();
+                return;
+            }
+            if (!m.try_lock()) {
+                const auto t = std::chrono::steady_clock::now();
+                m.lock();
+                st.wait.add(since(t));
+            }
+            acquired();
+        }
+        bool try_lock() {
+            if (!m.try_lock()) return false;
+            if (on.load(std::memory_order_relaxed)) acquired();
+            return true;
+        }
+        void unlock() {
+            if (timing) {
+                st.hold.add(since(held));
+                timing = false;
+            }
+            m.unlock();
+        }
+        void set_stats(bool on_) { on.store(on_, std::memory_order_relaxed); }
+        stats_t get_stats() {
+            const std::lock_guard<std::mutex> lock(m);
+            return st;
+        }
+    };
+
+    /* Orders paths so that a phase's children follow it directly: scan, scan/hash, scan-x */
+    struct path_less {
+        typedef void is_transparent;
+        static int key(char ch) { return ch=='/' ? 0 : (unsigned char)ch + 1; }
+        bool operator()(std::string_view a, std::string_view b) const {
+            return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end(),
+                                                [](char x, char y) { return key(x) < key(y); });
+        }
+    };
+
+    class profiler {
+    public:
+        typedef std::map<std::string, phase_stats, path_less> phase_map_t; // keyed by path, e.g. "scan/hash"
+    private:
+        struct node {                   // a phase, under the phase it ran in
+            phase_stats stats {};
+            node       *parent {nullptr};
+            std::map<std::string, std::unique_ptr<node>, std::less<>> children {};
+        };
+        struct thread_state {
+            std::mutex  M {};           // taken by the owning thread to change, and by phases() to read
+            node        root {};
+            node       *cur {&root};    // the innermost open span
+            uint32_t    index {0};      // in the order the threads were first seen
+            bool        registered {false};
+            std::unique_ptr<perf_counters> perf {}; // if the thread registered
+            thread_resources resources {}; // tid and name from registration; the rest on exit
+        };
+        typedef std::map<uint64_t, std::shared_ptr<thread_state>> thread_map_t; // by thread_serial()
+        /* Records a registered thread's resources as it exits. Holds the states
+         * weakly, as the profiler may be gone by then.
+         */
+        struct exit_guard {
+            std::vector<std::weak_ptr<thread_state>> states {};
+            ~exit_guard() {
+                for (const auto &it : states) {
+                    const std::shared_ptr<thread_state> ts = it.lock();
+                    if (!ts) continue;
+                    thread_resources r = ts->resources;
+                    r.read_self();
+                    r.exited = true;
+                    const std::lock_guard<std::mutex> lock(ts->M);
+                    ts->resources = r;
+                }
+            }
+        };
+        struct cache_entry {
+            uint64_t      profiler {0};
+            thread_state *state {nullptr};
+        };
+
+        const uint64_t     id {next_id()};
+        mutable std::mutex M {};
+        thread_map_t       threads {};
+        uint32_t           next_index {0};
+
+        static uint64_t next_id() {
+            static std::atomic<uint64_t> n {0};
+            return ++n;
+        }
+        static uint64_t thread_serial() { // unlike std::thread::id, never reused
+            static std::atomic<uint64_t> n {0};
+            thread_local const uint64_t serial = ++n;
+            return serial;
+        }
+        // the calling thread's state; the last one used is cached, so one profiler costs no lock
+        thread_state &local() {
+            thread_local cache_entry cache;
+            if (cache.profiler==id) return *cache.state;
+            const std::lock_guard<std::mutex> lock(M);
+            auto &ts = threads[thread_serial()];
+            if (!ts) {
+                ts = std::make_shared<thread_state>();
+                ts->index = next_index++;
+            }
+            cache.profiler = id;
+            cache.state    = ts.get();
+            return *ts;
+        }
+    public:
+        profiler() {}
+        profiler(const profiler &) = delete;
+        profiler &operator=(const profiler &) = delete;
+
+        /* Times its scope. Spans on one thread must end in the reverse order
+         * they began, which scoping ensures. Names should not contain '/'.
+         */
+        class span {
+            thread_state *ts;
+            node         *n {nullptr};
+            perf_values_t perf0 {};
+            std::chrono::steady_clock::time_point t0 {};
+        public:
+            span(profiler &p, std::string_view name): ts(&p.local()) {
+                auto it = ts->cur->children.find(name); // only this thread changes the tree
+                if (it==ts->cur->children.end()) {
+                    const std::lock_guard<std::mutex> lock(ts->M);
+                    it = ts->cur->children.emplace(std::string(name), std::make_unique<node>()).first;
+                    it->second->parent = ts->cur;
+                }
+                n = ts->cur = it->second.get();
+                if (ts->perf) perf0 = ts->perf->read();
+                t0 = std::chrono::steady_clock::now();
+            }
+            span(const span &) = delete;
+            span &operator=(const span &) = delete;
+            ~span() {
+                const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - t0).count();
+                const perf_values_t perf1 = ts->perf ? ts->perf->read() : perf_values_t();
+                {
+                    const std::lock_guard<std::mutex> lock(ts->M);
+                    n->stats.add(ns);
+                    if (ts->perf) {
+                        for (size_t i=0; i<PERF_EVENTS; i++) n->stats.perf[i] += perf1[i] - perf0[i];
+                        n->stats.perf_count++;
+                        n->stats.perf_mask |= ts->perf->mask();
+                    }
+                }
+                ts->cur = n->parent;
+            }
+        };
+
+        static void add_phases(phase_map_t &phases, const node &n, const std::string &path) {
+            for (const auto &it : n.children) {
+                const std::string child = path.empty() ? it.first : path + "/" + it.first;
+                const phase_stats &st = it.second->stats;
+                if (st.count>0) {
+                    auto pos = phases.find(child);
+                    if (pos==phases.end()) {
+                        phases.emplace(child, st);
+                    } else {
+                        pos->second.merge(st);
+                    }
+                }
+                add_phases(phases, *it.second, child);
+            }
+        }
+        // every phase that has ended at least once, summed over the threads
+        phase_map_t phases() const {
+            phase_map_t ret;
+            const std::lock_guard<std::mutex> lock(M);
+            for (const auto &it : threads) {
+                const std::lock_guard<std::mutex> tlock(it.second->M);
+                add_phases(ret, it.second->root, "");
+            }
+            return ret;
+        }
+        /* Register the calling thread, so that its resource use is reported
+         * and it gets perf counters. Its spans then also count them, which
+         * costs a read(2) per counter at each end of the span.
+         * Returns whether any counter could be opened.
+         */
+        bool register_thread(std::string_view name={}) {
+            thread_state &ts = local();
+            if (!ts.registered) {
+                auto perf = std::make_unique<perf_counters>(perf_counters::THREAD);
+                thread_local exit_guard guard;
+                {
+                    const std::lock_guard<std::mutex> lock(M);
+                    guard.states.push_back(threads.at(thread_serial()));
+                }
+                const std::lock_guard<std::mutex> lock(ts.M);
+                ts.registered      = true;
+                ts.perf            = std::move(perf);
+                ts.resources.index = ts.index;
+                ts.resources.tid   = thread_resources::gettid();
+                ts.resources.name  = name;
+            }
+            return ts.perf->any();
+        }
+        // the resources used by the threads that registered, in index order
+        std::vector<thread_resources> registered_resources() const {
+            std::vector<thread_resources> ret;
+            {
+                const std::lock_guard<std::mutex> lock(M);
+                for (const auto &it : threads) {
+                    const std::lock_guard<std::mutex> tlock(it.second->M);
+                    if (it.second->registered) ret.push_back(it.second->resources);
+                }
+            }
+            const uint64_t self = thread_resources::gettid();
+            for (auto &it : ret) {
+                if (it.exited) continue;
+                if (it.tid==self) {
+                    it.read_self();
+                } else {
+                    it.read_task();
+                }
+            }
+            std::sort(ret.begin(), ret.end(), [](const thread_resources &a, const thread_resources &b) { return a.index < b.index; });
+            return ret;
+        }
+        struct thread_perf {
+            uint32_t      index;
+            perf_values_t values;
+            const perf_counters *counters; // which are available; lives as long as the profiler
+        };
+        // the counters of the threads that registered, in index order
+        std::vector<thread_perf> registered_threads() const {
+            std::vector<thread_perf> ret;
+            const std::lock_guard<std::mutex> lock(M);
+            for (const auto &it : threads) {
+                const std::lock_guard<std::mutex> tlock(it.second->M);
+                if (it.second->perf) ret.push_back({it.second->index, it.second->perf->read(), it.second->perf.get()});
+            }
+            std::sort(ret.begin(), ret.end(), [](const thread_perf &a, const thread_perf &b) { return a.index < b.index; });
+            return ret;
+        }
+        size_t thread_count() const {
+            const std::lock_guard<std::mutex> lock(M);
+            return threads.size();
+        }
+    };
+
+    /* One reading of the process's resources. Fields that cannot be read
+     * on this system are left 0, and has_rss or has_io is false.
+     */
+    struct resource_sample {
+        uint64_t usec        {0};       // since the sampler started
+        uint64_t utime_usec  {0};
+        uint64_t stime_usec  {0};
+        uint64_t maxrss_kb   {0};
+        uint64_t rss_kb      {0};
+        uint64_t minflt      {0};
+        uint64_t majflt      {0};
+        uint64_t inblock     {0};
+        uint64_t oublock     {0};
+        uint64_t nvcsw       {0};
+        uint64_t nivcsw      {0};
+        uint64_t rchar       {0};       // bytes read and written through system calls
+        uint64_t wchar       {0};
+        uint64_t read_bytes  {0};       // bytes fetched from and sent to storage
+        uint64_t write_bytes {0};
+        bool     has_rss     {false};
+        bool     has_io      {false};
+
+        static resource_sample read() {
+            resource_sample r;
+#ifdef HAVE_GETRUSAGE
+            struct rusage ru;
+            memset(&ru, 0, sizeof(ru));
+            if (getrusage(RUSAGE_SELF, &ru)==0) {
+                r.utime_usec = (uint64_t)ru.ru_utime.tv_sec*1000000 + ru.ru_utime.tv_usec;
+                r.stime_usec = (uint64_t)ru.ru_stime.tv_sec*1000000 + ru.ru_stime.tv_usec;
+                r.maxrss_kb  = ru.ru_maxrss;
+                r.minflt     = ru.ru_minflt;
+                r.majflt     = ru.ru_majflt;
+                r.inblock    = ru.ru_inblock;
+                r.oublock    = ru.ru_oublock;
+                r.nvcsw      = ru.ru_nvcsw;
+                r.nivcsw     = ru.ru_nivcsw;
+            }
+#endif
+#if defined(__linux__) && defined(HAVE_UNISTD_H)
+            {
+                std::ifstream statm("/proc/self/statm");
+                uint64_t size = 0, resident = 0;
+                if (statm >> size >> resident) {
+                    r.rss_kb  = resident * (uint64_t)sysconf(_SC_PAGESIZE) / 1024;
+                    r.has_rss = true;
+                }
+            }
+            {
+                std::ifstream io("/proc/self/io"); // not readable on every kernel
+                std::string name;
+                uint64_t value = 0;
+                while (io >> name >> value) {
+                    if      (name=="rchar:")       r.rchar = value;
+                    else if (name=="wchar:")       r.wchar = value;
+                    else if (name=="read_bytes:")  r.read_bytes = value;
+                    else if (name=="write_bytes:") r.write_bytes = value;
+                    else continue;
+                    r.has_io = true;
+                }
+            }
+#endif
+            return r;
+        }
+    };
+
+    /* Takes a resource_sample every interval on its own thread. The ring holds
+     * the most recent capacity samples; older ones are counted in dropped().
+     */
+    class resource_sampler {
+        const std::chrono::milliseconds interval;
+        const std::chrono::steady_clock::time_point t0 {std::chrono::steady_clock::now()};
+        mutable std::mutex M {};
+        std::condition_variable cv {};
+        std::vector<resource_sample> ring;
+        size_t   next {0};              // where the next sample goes
+        uint64_t taken {0};
+        bool     stopping {false};
+        std::thread thread {};
+
+        void take() {
+            resource_sample r = resource_sample::read();
+            r.usec = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count();
+            const std::lock_guard<std::mutex> lock(M);
+            ring[next] = r;
+            next = (next+1) % ring.size();
+            taken++;
+        }
+        void run() {
+            std::unique_lock<std::mutex> lock(M);
+            while (!cv.wait_for(lock, interval, [this]() { return stopping; })) {
+                lock.unlock();
+                take();
+                lock.lock();
+            }
+        }
+    public:
+        resource_sampler(std::chrono::milliseconds interval_, size_t capacity):
+            interval(interval_), ring(std::max<size_t>(capacity, 1)) {
+            take();
+            thread = std::thread(&resource_sampler::run, this);
+        }
+        resource_sampler(const resource_sampler &) = delete;
+        resource_sampler &operator=(const resource_sampler &) = delete;
+        ~resource_sampler() { stop(); }
+
+        // takes a last sample, so that the timeline reaches the end of the run
+        void stop() {
+            if (!thread.joinable()) return;
+            {
+                const std::lock_guard<std::mutex> lock(M);
+                stopping = true;
+            }
+            cv.notify_one();
+            thread.join();
+            take();
+        }
+        std::chrono::milliseconds get_interval() const { return interval; }
+        // oldest first
+        std::vector<resource_sample> samples() const {
+            const std::lock_guard<std::mutex> lock(M);
+            std::vector<resource_sample> ret;
+            const size_t n = std::min<uint64_t>(taken, ring.size());
+            ret.reserve(n);
+            for (size_t i=0; i<n; i++) ret.push_back(ring[(next + ring.size() - n + i) % ring.size()]);
+            return ret;
+        }
+        uint64_t dropped() const {
+            const std::lock_guard<std::mutex> lock(M);
+            return taken - std::min<uint64_t>(taken, ring.size());
+        }
+    };
+}
+#endif
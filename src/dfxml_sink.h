@@ -0,0 +1,752 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/*
+ * Output sinks for dfxml_writer: a stream, a file, a file written
+ * through a streaming gzip or zstd compressor, a buffer in memory, or
+ * a callback. A file can also be written with write(2) (fd_sink), with
+ * O_DIRECT (direct_sink) or through io_uring (uring_sink).
+ * Include this AFTER your config file with the HAVE statements.
+ */
+
+/*
+ * Revision History:
+ * 2026 - DFXML contributors - Created.
+ *
+ * Copyright (C) 2026 DFXML contributors.
+ *
+ * LICENSE: LGPL Version 3. See COPYING.md for further information.
+ */
+
+#ifndef DFXML_SINK_H
+#define DFXML_SINK_H
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__has_include)
+#if __has_include(<memory_resource>)
+#define DFXML_SINK_PMR
+#include <memory_resource>
+#endif
+#endif
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_ZSTD_H
+#include <zstd.h>
+#endif
+
+#if defined(HAVE_UNISTD_H) && defined(HAVE_FCNTL_H)
+#define DFXML_SINK_FD
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(DFXML_SINK_FD) && defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_MMAN_H) && defined(HAVE_SYS_SYSCALL_H)
+#define DFXML_SINK_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+namespace dfxml {
+    /* fsync a file by name; a no-op where there is no fsync */
+    inline void sync_file(const std::filesystem::path &fname) {
+#ifdef DFXML_SINK_FD
+        const int fd = ::open(fname.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error(fname.string() + ": " + strerror(errno));
+        const int ret = ::fsync(fd);
+        const int err = errno;
+        ::close(fd);
+        if (ret != 0) throw std::runtime_error(fname.string() + ": fsync: " + strerror(err));
+#else
+        (void)fname;
+#endif
+    }
+
+#ifdef DFXML_SINK_FD
+    /* write_trailer() for a file descriptor whose data ends at pos */
+    inline void pwrite_trailer(const std::filesystem::path &fname, int fd, off_t pos,
+                               std::string_view trailer, off_t &trailer_end) {
+        size_t done = 0;
+        while (done < trailer.size()) {
+            const ssize_t n = ::pwrite(fd, trailer.data()+done, trailer.size()-done, pos+done);
+            if (n < 0) {
+                if (errno==EINTR) continue;
+                throw std::runtime_error(fname.string() + ": pwrite: " + strerror(errno));
+            }
+            done += n;
+        }
+        const off_t end = pos + trailer.size();
+        if (end < trailer_end && ::ftruncate(fd, end)!=0) {
+            throw std::runtime_error(fname.string() + ": ftruncate: " + strerror(errno));
+        }
+        trailer_end = end;
+    }
+#endif
+
+    /* Where dfxml_writer's output goes. Only one thread calls a sink at a time. */
+    class output_sink {
+    public:
+        output_sink() {}
+        virtual ~output_sink() {}
+        output_sink(const output_sink &) = delete;
+        output_sink &operator=(const output_sink &) = delete;
+
+        virtual void write(const char *data, size_t len) = 0;
+        virtual void flush() {}
+        virtual void close() {}         // finishes the output; throws on error
+        /* Flushes, and forces what has been written to stable storage. Output
+         * that cannot be truncated and extended again, such as a compressed
+         * stream, cannot be synced for a checkpoint.
+         */
+        virtual void sync() { throw std::runtime_error(path().string() + ": output cannot be checkpointed"); }
+        /* Flushes, then writes trailer after the output without advancing past
+         * it, so that the next write() overwrites it. A shorter trailer than the
+         * last one cuts the file. Only a file that can be rewritten supports this.
+         */
+        virtual void write_trailer(std::string_view trailer) {
+            (void)trailer;
+            throw std::runtime_error(path().string() + ": output cannot have a trailer");
+        }
+
+        /* The file being written, if any. If patchable(), its bytes are the bytes
+         * written and may be rewritten after close(), e.g. to insert the DTD.
+         */
+        virtual std::filesystem::path path() const { return {}; }
+        virtual bool patchable() const { return false; }
+        virtual bool compresses() const { return false; }
+    };
+
+    /* Writes to a stream that the caller owns, e.g. std::cout */
+    class ostream_sink : public output_sink {
+        std::ostream &os;
+    public:
+        explicit ostream_sink(std::ostream &os_):os(os_) {}
+        void write(const char *data, size_t len) override { os.write(data, len); }
+        void flush() override { os.flush(); }
+    };
+
+    /* Appends to a buffer that the caller owns: a std::string, a std::vector<char>,
+     * or a std::pmr::string whose allocator draws on an arena. Clearing the
+     * buffer between documents keeps its capacity, so that producing many
+     * small documents does not reallocate it.
+     */
+    template<typename Buffer>
+    class basic_buffer_sink : public output_sink {
+        Buffer &buf;
+    public:
+        explicit basic_buffer_sink(Buffer &buf_):buf(buf_) {}
+        void write(const char *data, size_t len) override { buf.insert(buf.end(), data, data+len); }
+    };
+    typedef basic_buffer_sink<std::string> buffer_sink;
+#ifdef DFXML_SINK_PMR
+    typedef basic_buffer_sink<std::pmr::string> pmr_buffer_sink;
+#endif
+
+    /* Names a buffer as the writer's output, so that a std::string holding a
+     * file name cannot be taken for one: dfxml_writer dw(dfxml::buffer_target(buf));
+     */
+    template<typename Buffer>
+    struct buffer_target_t {
+        explicit buffer_target_t(Buffer &buf_):buf(buf_) {}
+        Buffer &buf;
+    };
+    template<typename Buffer>
+    buffer_target_t<Buffer> buffer_target(Buffer &buf) { return buffer_target_t<Buffer>(buf); }
+
+    /* Hands each piece of output to a callback, which must not keep the view */
+    class callback_sink : public output_sink {
+    public:
+        typedef std::function<void(std::string_view)> callback_t;
+        typedef std::function<void()> flush_t;
+    private:
+        callback_t callback;
+        flush_t    on_flush;
+    public:
+        explicit callback_sink(callback_t callback_, flush_t on_flush_={}):
+            callback(std::move(callback_)), on_flush(std::move(on_flush_)) {
+            if (!callback) throw std::runtime_error("dfxml::callback_sink: no callback");
+        }
+        void write(const char *data, size_t len) override { callback(std::string_view(data, len)); }
+        void flush() override { if (on_flush) on_flush(); }
+    };
+
+    class file_sink : public output_sink {
+        std::ofstream         os;
+        std::filesystem::path fname;
+        uint64_t              trailer_end {0};
+    public:
+        // with append, writing continues at the end of an existing file
+        explicit file_sink(const std::filesystem::path &fname_, bool append=false):
+            os(fname_, append ? std::ios_base::in | std::ios_base::out : std::ios_base::out), fname(fname_) {
+            if (!os.is_open()) throw std::runtime_error(fname.string());
+            if (append) os.seekp(0, std::ios_base::end);
+        }
+        void write(const char *data, size_t len) override { os.write(data, len); }
+        void flush() override { os.flush(); }
+        void sync() override {
+            os.flush();
+            if (os.fail()) throw std::runtime_error(fname.string() + ": write failed");
+            sync_file(fname);
+        }
+        void write_trailer(std::string_view trailer) override {
+            const std::streampos pos = os.tellp();
+            os.write(trailer.data(), trailer.size());
+            os.flush();
+            os.seekp(pos);
+            if (os.fail()) throw std::runtime_error(fname.string() + ": write failed");
+            const uint64_t end = (uint64_t)pos + trailer.size();
+            if (end < trailer_end) std::filesystem::resize_file(fname, end);
+            trailer_end = end;
+        }
+        void close() override {
+            if (!os.is_open()) return;
+            os.close();
+            if (os.fail()) throw std::runtime_error(fname.string() + ": write failed");
+        }
+        std::filesystem::path path() const override { return fname; }
+        bool patchable() const override { return true; }
+    };
+
+#ifdef HAVE_ZLIB_H
+    /* A gzip stream. flush() ends a deflate block, so a reader can decompress
+     * everything written so far; it costs some compression.
+     */
+    class gzip_sink : public output_sink {
+        std::ofstream         os;
+        std::filesystem::path fname;
+        z_stream              zs {};
+        std::vector<char>     zbuf;
+        bool                  finished {false};
+
+        void deflate_all(int mode) {
+            for (;;) {
+                zs.next_out  = reinterpret_cast<Bytef *>(zbuf.data());
+                zs.avail_out = zbuf.size();
+                const int ret = deflate(&zs, mode);
+                if (ret==Z_STREAM_ERROR) throw std::runtime_error(fname.string() + ": deflate failed");
+                os.write(zbuf.data(), zbuf.size() - zs.avail_out);
+                if (mode==Z_FINISH ? ret==Z_STREAM_END : (zs.avail_out!=0 && zs.avail_in==0)) return;
+            }
+        }
+    public:
+        explicit gzip_sink(const std::filesystem::path &fname_, int level=Z_DEFAULT_COMPRESSION):
+            os(fname_, std::ios::binary), fname(fname_), zbuf(128*1024) {
+            if (!os.is_open()) throw std::runtime_error(fname.string());
+            if (deflateInit2(&zs, level, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY) != Z_OK) { // 15+16: gzip header
+                throw std::runtime_error(fname.string() + ": deflateInit2 failed");
+            }
+        }
+        gzip_sink(const gzip_sink &) = delete;
+        gzip_sink &operator=(const gzip_sink &) = delete;
+        ~gzip_sink() override {
+            try { close(); } catch (const std::exception &) {}
+            deflateEnd(&zs);
+        }
+        void write(const char *data, size_t len) override {
+            while (len > 0) {
+                const uInt n = len > (1u<<30) ? (1u<<30) : (uInt)len;
+                zs.next_in  = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+                zs.avail_in = n;
+                deflate_all(Z_NO_FLUSH);
+                data += n;
+                len  -= n;
+            }
+        }
+        void flush() override {
+            deflate_all(Z_SYNC_FLUSH);
+            os.flush();
+        }
+        void close() override {
+            if (finished) return;
+            finished = true;
+            deflate_all(Z_FINISH);
+            os.close();
+            if (os.fail()) throw std::runtime_error(fname.string() + ": write failed");
+        }
+        std::filesystem::path path() const override { return fname; }
+        bool compresses() const override { return true; }
+    };
+#endif
+
+#ifdef HAVE_ZSTD_H
+    /* A zstd stream. flush() ends the current block, as gzip_sink does. */
+    class zstd_sink : public output_sink {
+        std::ofstream         os;
+        std::filesystem::path fname;
+        ZSTD_CCtx             *cctx {nullptr};
+        std::vector<char>     zbuf;
+        bool                  finished {false};
+
+        // returns when the input has been consumed and, for flush and end, the frame is written
+        void compress(const char *data, size_t len, ZSTD_EndDirective mode) {
+            ZSTD_inBuffer in = {data, len, 0};
+            for (;;) {
+                ZSTD_outBuffer out = {zbuf.data(), zbuf.size(), 0};
+                const size_t remaining = ZSTD_compressStream2(cctx, &out, &in, mode);
+                if (ZSTD_isError(remaining)) {
+                    throw std::runtime_error(fname.string() + ": " + ZSTD_getErrorName(remaining));
+                }
+                os.write(zbuf.data(), out.pos);
+                if (mode==ZSTD_e_continue ? in.pos==in.size : remaining==0) return;
+            }
+        }
+    public:
+        explicit zstd_sink(const std::filesystem::path &fname_, int level=3):
+            os(fname_, std::ios::binary), fname(fname_), zbuf(ZSTD_CStreamOutSize()) {
+            if (!os.is_open()) throw std::runtime_error(fname.string());
+            cctx = ZSTD_createCCtx();
+            if (cctx==nullptr) throw std::runtime_error(fname.string() + ": ZSTD_createCCtx failed");
+            ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+        }
+        zstd_sink(const zstd_sink &) = delete;
+        zstd_sink &operator=(const zstd_sink &) = delete;
+        ~zstd_sink() override {
+            try { close(); } catch (const std::exception &) {}
+            ZSTD_freeCCtx(cctx);
+        }
+        void write(const char *data, size_t len) override { compress(data, len, ZSTD_e_continue); }
+        void flush() override {
+            compress(nullptr, 0, ZSTD_e_flush);
+            os.flush();
+        }
+        void close() override {
+            if (finished) return;
+            finished = true;
+            compress(nullptr, 0, ZSTD_e_end);
+            os.close();
+            if (os.fail()) throw std::runtime_error(fname.string() + ": write failed");
+        }
+        std::filesystem::path path() const override { return fname; }
+        bool compresses() const override { return true; }
+    };
+#endif
+
+#ifdef DFXML_SINK_FD
+    /* A page-aligned buffer, as O_DIRECT requires */
+    class aligned_buffer {
+        char   *p {nullptr};
+        size_t n {0};
+    public:
+        static inline const size_t alignment = 4096;
+        explicit aligned_buffer(size_t n_):n((n_ + alignment - 1) & ~(alignment - 1)) {
+            p = static_cast<char *>(std::aligned_alloc(alignment, n));
+            if (p==nullptr) throw std::bad_alloc();
+        }
+        aligned_buffer(aligned_buffer &&that) noexcept:p(that.p),n(that.n) { that.p = nullptr; }
+        aligned_buffer(const aligned_buffer &) = delete;
+        aligned_buffer &operator=(const aligned_buffer &) = delete;
+        ~aligned_buffer() { std::free(p); }
+        char   *data() const { return p; }
+        size_t size() const { return n; }
+    };
+
+    /* Writes with write(2) from a large aligned buffer, bypassing iostreams */
+    class fd_sink : public output_sink {
+    protected:
+        std::filesystem::path fname;
+        int                   fd {-1};
+        aligned_buffer        buf;
+        size_t                used {0};
+        off_t                 trailer_end {0};
+
+        void fail(const std::string &what) const {
+            throw std::runtime_error(fname.string() + ": " + what + ": " + strerror(errno));
+        }
+        void write_all(const char *data, size_t len) {
+            while (len > 0) {
+                const ssize_t n = ::write(fd, data, len);
+                if (n < 0) {
+                    if (errno==EINTR) continue;
+                    fail("write");
+                }
+                data += n;
+                len  -= n;
+            }
+        }
+        virtual void drain() {          // write the buffer
+            write_all(buf.data(), used);
+            used = 0;
+        }
+        fd_sink(const std::filesystem::path &fname_, int flags, size_t bufsize):fname(fname_), buf(bufsize) {
+            fd = ::open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC | flags, 0666);
+            if (fd < 0 && errno==EINVAL && flags!=0) { // e.g. O_DIRECT on a file system without it
+                fd = ::open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            }
+            if (fd < 0) fail("open");
+        }
+    public:
+        static inline const size_t default_bufsize = 1024*1024;
+        explicit fd_sink(const std::filesystem::path &fname_, size_t bufsize=default_bufsize):
+            fd_sink(fname_, 0, bufsize) {}
+        fd_sink(const fd_sink &) = delete;
+        fd_sink &operator=(const fd_sink &) = delete;
+        ~fd_sink() override {
+            try { close(); } catch (const std::exception &) {}
+        }
+        void write(const char *data, size_t len) override {
+            while (len > 0) {
+                const size_t n = std::min(len, buf.size() - used);
+                memcpy(buf.data() + used, data, n);
+                used += n;
+                data += n;
+                len  -= n;
+                if (used == buf.size()) drain();
+            }
+        }
+        void flush() override { drain(); }
+        void sync() override {
+            drain();
+            if (used > 0) throw std::runtime_error(fname.string() + ": O_DIRECT output cannot be checkpointed");
+            if (::fsync(fd) != 0) fail("fsync");
+        }
+        void write_trailer(std::string_view trailer) override {
+            drain();
+            if (used > 0) throw std::runtime_error(fname.string() + ": O_DIRECT output cannot have a trailer");
+            pwrite_trailer(fname, fd, lseek(fd, 0, SEEK_CUR), trailer, trailer_end);
+        }
+        void close() override {
+            if (fd < 0) return;
+            drain();
+            const int ret = ::close(fd);
+            fd = -1;
+            if (ret != 0) fail("close");
+        }
+        std::filesystem::path path() const override { return fname; }
+        bool patchable() const override { return true; }
+    };
+
+    /* Writes with O_DIRECT, bypassing the page cache. Only whole blocks can be
+     * written that way, so flush() leaves a partial block in the buffer and
+     * close() writes it after turning O_DIRECT off. If the file system does
+     * not support O_DIRECT, this is an fd_sink.
+     */
+    class direct_sink : public fd_sink {
+        bool is_direct {false};
+        void drain() override {
+            if (!is_direct) {
+                fd_sink::drain();
+                return;
+            }
+            const size_t whole = used & ~(aligned_buffer::alignment - 1);
+            write_all(buf.data(), whole);
+            memmove(buf.data(), buf.data() + whole, used - whole);
+            used -= whole;
+        }
+        static int open_flags() {
+#ifdef O_DIRECT
+            return O_DIRECT;
+#else
+            return 0;
+#endif
+        }
+    public:
+        explicit direct_sink(const std::filesystem::path &fname_, size_t bufsize=default_bufsize):
+            fd_sink(fname_, open_flags(), bufsize) {
+            is_direct = open_flags()!=0 && (fcntl(fd, F_GETFL) & open_flags())!=0;
+        }
+        ~direct_sink() override {
+            try { close(); } catch (const std::exception &) {}
+        }
+        void close() override {
+            if (fd < 0) return;
+            drain();
+#ifdef O_DIRECT
+            if (is_direct && used > 0) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+                is_direct = false;
+            }
+#endif
+            fd_sink::close();
+        }
+        bool direct() const { return is_direct; }
+    };
+#endif
+
+#ifdef DFXML_SINK_IO_URING
+    /* Writes through io_uring, with several buffers in flight at once so that
+     * the caller fills one buffer while the kernel writes the others. The
+     * kernel interface is used directly, so liburing is not required.
+     */
+    class uring_sink : public output_sink {
+        std::filesystem::path fname;
+        int                   fd {-1};
+        int                   ring_fd {-1};
+        void                  *sq_ptr {nullptr};
+        void                  *cq_ptr {nullptr};
+        size_t                sq_size {0};
+        size_t                cq_size {0};
+        struct io_uring_sqe   *sqes {nullptr};
+        size_t                sqes_size {0};
+        unsigned              *sq_tail {nullptr};
+        unsigned              *sq_mask {nullptr};
+        unsigned              *sq_array {nullptr};
+        unsigned              *cq_head {nullptr};
+        unsigned              *cq_tail {nullptr};
+        unsigned              *cq_mask {nullptr};
+        struct io_uring_cqe   *cqes {nullptr};
+
+        std::vector<aligned_buffer> bufs {};
+        std::vector<struct iovec>   iov {};     // what is being written from each buffer
+        std::vector<off_t>          offsets {};
+        std::vector<bool>           busy {};
+        size_t                cur {0};          // buffer being filled
+        size_t                used {0};
+        off_t                 off {0};          // file offset of the buffer being filled
+        off_t                 trailer_end {0};
+        unsigned              inflight {0};
+        int                   error {0};        // errno of a failed write
+
+        void fail(const std::string &what, int err) const {
+            throw std::runtime_error(fname.string() + ": " + what + ": " + strerror(err));
+        }
+        int enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+            for (;;) {
+                const int ret = (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+                if (ret >= 0 || errno != EINTR) return ret;
+            }
+        }
+        void submit(size_t i, size_t len) {
+            iov[i].iov_base = bufs[i].data();
+            iov[i].iov_len  = len;
+            offsets[i]      = off;
+            busy[i]         = true;
+            const unsigned tail = *sq_tail;
+            const unsigned idx  = tail & *sq_mask;
+            struct io_uring_sqe *sqe = &sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode    = IORING_OP_WRITEV;
+            sqe->fd        = fd;
+            sqe->addr      = (uint64_t)(uintptr_t)&iov[i];
+            sqe->len       = 1;
+            sqe->off       = off;
+            sqe->user_data = i;
+            sq_array[idx]  = idx;
+            __atomic_store_n(sq_tail, tail+1, __ATOMIC_RELEASE);
+            if (enter(1, 0, 0) < 0) fail("io_uring_enter", errno);
+            inflight++;
+            off += len;
+        }
+        void complete(size_t i, int res) {
+            if (res < 0) {
+                if (error==0) error = -res;
+            } else if ((size_t)res < iov[i].iov_len) { // short write; finish it here
+                const char *p = static_cast<const char *>(iov[i].iov_base) + res;
+                size_t len = iov[i].iov_len - res;
+                off_t  o   = offsets[i] + res;
+                while (len > 0) {
+                    const ssize_t n = pwrite(fd, p, len, o);
+                    if (n < 0) {
+                        if (errno==EINTR) continue;
+                        if (error==0) error = errno;
+                        break;
+                    }
+                    p += n; len -= n; o += n;
+                }
+            }
+            busy[i] = false;
+            inflight--;
+        }
+        void reap(bool wait) {
+            if (wait && enter(0, 1, IORING_ENTER_GETEVENTS) < 0) fail("io_uring_enter", errno);
+            unsigned head = *cq_head;
+            while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                const struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+                complete(cqe->user_data, cqe->res);
+                head++;
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            if (error) fail("write", error);
+        }
+        void next_buffer() {            // submit the current buffer and wait for a free one
+            if (used > 0) submit(cur, used);
+            used = 0;
+            for (;;) {
+                for (size_t i=0; i<bufs.size(); i++) {
+                    if (!busy[i]) {
+                        cur = i;
+                        return;
+                    }
+                }
+                reap(true);
+            }
+        }
+        void wait_all() {
+            while (inflight > 0) reap(true);
+        }
+        void unmap() {
+            if (sqes) munmap(sqes, sqes_size);
+            if (cq_ptr && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+            if (sq_ptr) munmap(sq_ptr, sq_size);
+            if (ring_fd >= 0) ::close(ring_fd);
+            sqes = nullptr; cq_ptr = nullptr; sq_ptr = nullptr; ring_fd = -1;
+        }
+    public:
+        static inline const size_t default_bufsize = 1024*1024;
+        static inline const size_t default_depth = 4;  // buffers in flight
+
+        explicit uring_sink(const std::filesystem::path &fname_, size_t bufsize=default_bufsize, size_t depth=default_depth):
+            fname(fname_) {
+            struct io_uring_params p;
+            memset(&p, 0, sizeof(p));
+            ring_fd = (int)syscall(__NR_io_uring_setup, (unsigned)depth, &p);
+            if (ring_fd < 0) fail("io_uring_setup", errno);
+            sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+            cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+            if (p.features & IORING_FEAT_SINGLE_MMAP) sq_size = cq_size = std::max(sq_size, cq_size);
+            sq_ptr = mmap(nullptr, sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+            if (sq_ptr==MAP_FAILED) { sq_ptr = nullptr; unmap(); fail("mmap", errno); }
+            if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                cq_ptr = sq_ptr;
+            } else {
+                cq_ptr = mmap(nullptr, cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+                if (cq_ptr==MAP_FAILED) { cq_ptr = nullptr; unmap(); fail("mmap", errno); }
+            }
+            sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+            void *s = mmap(nullptr, sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+            if (s==MAP_FAILED) { unmap(); fail("mmap", errno); }
+            sqes = static_cast<struct io_uring_sqe *>(s);
+            char *sq = static_cast<char *>(sq_ptr);
+            char *cq = static_cast<char *>(cq_ptr);
+            sq_tail  = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+            sq_mask  = reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+            sq_array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+            cq_head  = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+            cq_tail  = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+            cq_mask  = reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+            cqes     = reinterpret_cast<struct io_uring_cqe *>(cq + p.cq_off.cqes);
+
+            fd = ::open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (fd < 0) { const int err = errno; unmap(); fail("open", err); }
+            for (size_t i=0; i<std::min<size_t>(depth, p.sq_entries); i++) bufs.emplace_back(bufsize);
+            iov.resize(bufs.size());
+            offsets.resize(bufs.size());
+            busy.resize(bufs.size());
+        }
+        uring_sink(const uring_sink &) = delete;
+        uring_sink &operator=(const uring_sink &) = delete;
+        ~uring_sink() override {
+            try { close(); } catch (const std::exception &) {}
+            if (fd >= 0) ::close(fd);
+            unmap();
+        }
+        void write(const char *data, size_t len) override {
+            while (len > 0) {
+                const size_t n = std::min(len, bufs[cur].size() - used);
+                memcpy(bufs[cur].data() + used, data, n);
+                used += n;
+                data += n;
+                len  -= n;
+                if (used == bufs[cur].size()) next_buffer();
+            }
+        }
+        /* Waits until everything written so far is in the file */
+        void flush() override {
+            next_buffer();
+            wait_all();
+        }
+        void sync() override {
+            flush();
+            if (::fsync(fd) != 0) fail("fsync", errno);
+        }
+        void write_trailer(std::string_view trailer) override {
+            flush();
+            pwrite_trailer(fname, fd, off, trailer, trailer_end);
+        }
+        void close() override {
+            if (fd < 0) return;
+            flush();
+            const int ret = ::close(fd);
+            fd = -1;
+            if (ret != 0) fail("close", errno);
+            unmap();
+        }
+        std::filesystem::path path() const override { return fname; }
+        bool patchable() const override { return true; }
+    };
+#endif
+
+    enum compression_t {
+        COMPRESS_AUTO,                  // from the file extension
+        COMPRESS_NONE,
+        COMPRESS_GZIP,                  // .gz
+        COMPRESS_ZSTD                   // .zst
+    };
+
+    inline compression_t compression_for(const std::filesystem::path &fname) {
+        const std::string ext = fname.extension().string();
+        if (ext==".gz")  return COMPRESS_GZIP;
+        if (ext==".zst") return COMPRESS_ZSTD;
+        return COMPRESS_NONE;
+    }
+
+    inline std::unique_ptr<output_sink> make_file_sink(const std::filesystem::path &fname,
+                                                       compression_t compression=COMPRESS_AUTO) {
+        if (compression==COMPRESS_AUTO) compression = compression_for(fname);
+        switch (compression) {
+        case COMPRESS_GZIP:
+#ifdef HAVE_ZLIB_H
+            return std::make_unique<gzip_sink>(fname);
+#else
+            throw std::runtime_error(fname.string() + ": gzip output requires zlib");
+#endif
+        case COMPRESS_ZSTD:
+#ifdef HAVE_ZSTD_H
+            return std::make_unique<zstd_sink>(fname);
+#else
+            throw std::runtime_error(fname.string() + ": zstd output requires libzstd");
+#endif
+        case COMPRESS_AUTO:
+        case COMPRESS_NONE:
+            break;
+        }
+        return std::make_unique<file_sink>(fname);
+    }
+
+    /* How a file is written */
+    enum io_backend_t {
+        IO_OSTREAM,                     // std::ofstream
+        IO_WRITE,                       // write(2) from a large buffer
+        IO_DIRECT,                      // write(2) with O_DIRECT
+        IO_URING                        // io_uring, several writes in flight
+    };
+
+    inline std::unique_ptr<output_sink> make_file_sink(const std::filesystem::path &fname, io_backend_t backend) {
+        switch (backend) {
+#ifdef DFXML_SINK_FD
+        case IO_WRITE:  return std::make_unique<fd_sink>(fname);
+        case IO_DIRECT: return std::make_unique<direct_sink>(fname);
+#else
+        case IO_WRITE:
+        case IO_DIRECT:
+            throw std::runtime_error(fname.string() + ": write(2) output is not available");
+#endif
+#ifdef DFXML_SINK_IO_URING
+        case IO_URING:  return std::make_unique<uring_sink>(fname);
+#else
+        case IO_URING:
+            throw std::runtime_error(fname.string() + ": io_uring output is not available");
+#endif
+        case IO_OSTREAM:
+            break;
+        }
+        return std::make_unique<file_sink>(fname);
+    }
+}
+
+#endif
@@ -26,22 +26,33 @@
 #endif
 
 /* c++ */
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <charconv>
+#include <chrono>
 #include <cinttypes>
+#include <condition_variable>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
 #include <cstdarg>
 #include <fstream>
 #include <filesystem>
+#include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <set>
 #include <sstream>
 #include <stack>
 #include <string>
+#include <string_view>
 #include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
 #include <sys/time.h>
 
@@ -66,6 +77,10 @@
 #include <unistd.h>
 #endif
 
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>                      // for copy_file_range
+#endif
+
 // Common
 
 #ifdef HAVE_SYS_RESOURCE_H
@@ -97,6 +112,118 @@
 #endif
 
 #include "cpuid.h"
+#include "dfxml_index.h"
+#include "dfxml_profile.h"
+#include "dfxml_sink.h"
+
+// Vector scanners for xmlescape(). AVX2 is selected at runtime with cpuid.h.
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define DFXML_ESCAPE_SSE2
+#endif
+
+#if defined(DFXML_ESCAPE_SSE2) && defined(__GNUC__) && defined(HAVE_ASM_CPUID)
+#include <immintrin.h>
+#define DFXML_ESCAPE_AVX2
+#endif
+
+namespace dfxml {
+    class file_object;                  // in dfxml_reader.h
+
+    /* An interned XML tag.
+     * Tags that are written often are declared once, as constants:
+     *
+     *   static const dfxml::tag TAG_FILENAME("filename");
+     *   dw.xmlout(TAG_FILENAME, name);
+     *
+     * The name is checked and the open and close tags are built when the tag is
+     * declared, so writing it does not allocate, scan or search the tag set.
+     * Each distinct name gets a small integer id from a process-wide registry,
+     * which the writer uses to record the tags it has written for the DTD.
+     */
+    class tag {
+        std::string name_;
+        std::string open_;              // <name>
+        std::string close_;             // </name>
+        size_t      id_;
+
+        struct registry_t {
+            std::mutex                    M {};
+            std::map<std::string,size_t>  ids {};
+            std::vector<std::string>      names {};
+        };
+        static registry_t &registry() {
+            static registry_t r;
+            return r;
+        }
+        static size_t intern(const std::string &name) {
+            if (name.empty() || name.find(' ') != std::string::npos) {
+                throw std::invalid_argument("dfxml::tag: invalid tag '" + name + "'");
+            }
+            registry_t &r = registry();
+            const std::lock_guard<std::mutex> lock(r.M);
+            auto it = r.ids.find(name);
+            if (it != r.ids.end()) return it->second;
+            r.names.push_back(name);
+            r.ids[name] = r.names.size()-1;
+            return r.names.size()-1;
+        }
+    public:
+        explicit tag(const std::string &name):
+            name_(name), open_("<"+name+">"), close_("</"+name+">"), id_(intern(name)) {}
+        const std::string &name()  const { return name_; }
+        const std::string &open()  const { return open_; }
+        const std::string &close() const { return close_; }
+        size_t id() const { return id_; }
+
+        static std::string name_of(size_t id) {
+            registry_t &r = registry();
+            const std::lock_guard<std::mutex> lock(r.M);
+            return r.names.at(id);
+        }
+        static inline const size_t none = SIZE_MAX;
+        // the id of an interned tag, or none
+        static size_t find(const std::string &name) {
+            registry_t &r = registry();
+            const std::lock_guard<std::mutex> lock(r.M);
+            auto it = r.ids.find(name);
+            return it==r.ids.end() ? none : it->second;
+        }
+    };
+
+    /* Interned tags for the elements of a fiwalk-style <fileobject> */
+    namespace tags {
+        inline const tag dfxml       {"dfxml"};
+        inline const tag creator     {"creator"};
+        inline const tag source      {"source"};
+        inline const tag volume      {"volume"};
+        inline const tag fileobject  {"fileobject"};
+        inline const tag parent_object {"parent_object"};
+        inline const tag filename    {"filename"};
+        inline const tag filesize    {"filesize"};
+        inline const tag partition   {"partition"};
+        inline const tag id          {"id"};
+        inline const tag name_type   {"name_type"};
+        inline const tag meta_type   {"meta_type"};
+        inline const tag inode       {"inode"};
+        inline const tag mode        {"mode"};
+        inline const tag nlink       {"nlink"};
+        inline const tag uid         {"uid"};
+        inline const tag gid         {"gid"};
+        inline const tag alloc       {"alloc"};
+        inline const tag unalloc     {"unalloc"};
+        inline const tag used        {"used"};
+        inline const tag mtime       {"mtime"};
+        inline const tag ctime       {"ctime"};
+        inline const tag atime       {"atime"};
+        inline const tag crtime      {"crtime"};
+        inline const tag seq         {"seq"};
+        inline const tag libmagic    {"libmagic"};
+        inline const tag byte_runs   {"byte_runs"};
+        inline const tag byte_run    {"byte_run"};
+        inline const tag hashdigest  {"hashdigest"};
+    }
+}
 
 class dfxml_writer {
 public:
@@ -113,35 +240,180 @@ public:
     static inline std::string encoding_t = "%09";
     static inline std::string const xml_header = "<?xml version='1.0' encoding='UTF-8'?>\n";
 
+    /* Flush policy.
+     * By default every threadsafe call flushes the output, so that the file can be
+     * followed while it is written. That costs a system call per element. The other
+     * policies collect the output in the writer's buffer and hand it to the
+     * operating system less often. The bytes written are the same in every case.
+     * FLUSH_MSEC is checked when the next element is written; in async mode the
+     * writer thread also flushes once the interval ends with nothing more arriving.
+     */
+    enum flush_mode_t {
+        FLUSH_ALWAYS,                   // flush after every element (the default)
+        FLUSH_NEVER,                    // flush only when the buffer fills and on close()
+        FLUSH_BYTES,                    // flush once flush_policy_t::bytes have accumulated
+        FLUSH_MSEC,                     // flush once flush_policy_t::msec have elapsed
+        FLUSH_ON_POP                    // flush on pop() of flush_policy_t::tag
+    };
+    struct flush_policy_t {
+        flush_mode_t mode {FLUSH_ALWAYS};
+        size_t       bytes {0};
+        unsigned int msec {0};
+        std::string  tag {};
+        static flush_policy_t always()                   { return flush_policy_t(); }
+        static flush_policy_t never()                    { flush_policy_t p; p.mode = FLUSH_NEVER; return p; }
+        static flush_policy_t every_bytes(size_t n)      { flush_policy_t p; p.mode = FLUSH_BYTES; p.bytes = n; return p; }
+        static flush_policy_t every_msec(unsigned int n) { flush_policy_t p; p.mode = FLUSH_MSEC; p.msec = n; return p; }
+        static flush_policy_t on_pop(const std::string &tag_) { flush_policy_t p; p.mode = FLUSH_ON_POP; p.tag = tag_; return p; }
+    };
+
+    /* What commit() does in async mode when the writer thread's queue is full */
+    enum backpressure_t {
+        BACKPRESSURE_BLOCK,             // wait for space
+        BACKPRESSURE_DROP               // discard the fragment and count it
+    };
+
+    /* Reports that set_final_reports() writes just before the root element closes */
+    enum report_t {
+        REPORT_PROFILE           = 1,   // add_profile()
+        REPORT_RESOURCE_TIMELINE = 2,   // add_resource_timeline()
+        REPORT_PERF_COUNTERS     = 4,   // add_perf_counters()
+        REPORT_THREADS           = 8,   // add_thread_resources()
+        REPORT_WRITER_STATS      = 16   // add_writer_stats()
+    };
+
+    /* Ordered commits.
+     * commit(f, seq) writes fragments in sequence-number order no matter which
+     * thread finishes first, so parallel producers give the same output as a
+     * single one. Fragments that arrive early are held in a reorder buffer until
+     * the gap before them is filled. The policy bounds that buffer and says what
+     * happens when it is full.
+     */
+    enum reorder_stall_t {
+        REORDER_BLOCK,                  // wait for the missing sequence numbers
+        REORDER_WRITE,                  // give up on the gap and write the lowest pending fragment
+        REORDER_THROW                   // throw std::runtime_error; the fragment is not consumed
+    };
+    struct reorder_policy_t {
+        size_t          max_bytes {64*1024*1024}; // buffered fragment bytes
+        size_t          max_fragments {65536};
+        reorder_stall_t stall {REORDER_BLOCK};
+    };
+    struct reorder_stats_t {
+        uint64_t committed {0};         // fragments committed with a sequence number
+        uint64_t skipped {0};           // sequence numbers passed to skip_sequence()
+        uint64_t out_of_order {0};      // written out of sequence under REORDER_WRITE
+        uint64_t stalls {0};            // commits that waited under REORDER_BLOCK
+        uint64_t stall_usec {0};        // total time spent waiting
+        size_t   max_pending {0};       // high-water marks of the reorder buffer
+        size_t   max_pending_bytes {0};
+    };
+
+    /* From get_writer_stats(); the lock figures are 0 unless set_writer_stats() was called */
+    struct writer_stats_t {
+        uint64_t    elements {0};
+        uint64_t    bytes {0};          // formatted, before any compression
+        uint64_t    flushes {0};
+        uint64_t    fileobjects {0};
+        std::chrono::steady_clock::duration elapsed {}; // since the writer was made
+        uint64_t    lock_acquisitions {0};
+        dfxml::phase_stats lock_wait {}; // acquisitions that waited; count is the contended ones
+        dfxml::phase_stats lock_hold {}; // one hold in dfxml::stat_mutex::hold_sample
+    };
+
+    /* Sharding.
+     * With set_sharding() the output rolls over to a new, well-formed file once a
+     * shard holds shard_policy_t::fileobjects fileobjects or shard_policy_t::bytes
+     * bytes. Rollover happens only between fileobjects: the open elements are
+     * closed, and re-opened with their attributes in the next shard, after the
+     * creator block. close() writes a manifest that lists the shards.
+     */
+    struct shard_policy_t {
+        uint64_t fileobjects {0};       // 0 for no limit
+        uint64_t bytes {0};             // uncompressed; 0 for no limit
+    };
+    struct shard_t {
+        std::filesystem::path filename {};
+        uint64_t fileobjects {0};
+        uint64_t bytes {0};             // size on disk
+    };
+    typedef std::function<std::unique_ptr<dfxml::output_sink>(const std::filesystem::path &)> sink_factory_t;
+
+    /* Where close() puts the DTD */
+    enum dtd_mode_t {
+        DTD_NONE,
+        DTD_INTERNAL,                   // patched into space reserved after the XML header
+        DTD_EXTERNAL                    // written to get_dtd_filename(), referenced from the DOCTYPE
+    };
+    static inline const size_t dtd_reserve_default = 4096;
+
+    /* Compressed output is flushed this often, by default */
+    static inline const size_t compressed_flush_bytes = 1024*1024;
+
     /* This is the main interface: */
     // defaults to stdout
-    dfxml_writer():out(&std::cout) {
-        gettimeofday(&t0,0);
-        gettimeofday(&t_last_timestamp,0);
-        *out << xml_header;
+    dfxml_writer():out(std::make_unique<dfxml::ostream_sink>(std::cout)) {
+        obuf.append(xml_header);
     }
 
-    // write to a file, optionally making a DTD
+    // write to a file, optionally making a DTD. Files ending .gz or .zst are compressed.
     dfxml_writer(const std::filesystem::path outfilename_, bool makeDTD):
-        outf(outfilename_,std::ios_base::out),
-        tempfile_template( outfilename_.string() + "_tmp_XXXXXXXX"),
-        outfilename(outfilename_) {
-        if (!outf.is_open()){
-            throw std::runtime_error(outfilename_.string());
+        dfxml_writer(outfilename_, makeDTD ? DTD_INTERNAL : DTD_NONE) {}
+
+    /* With DTD_INTERNAL, dtd_reserve bytes are left blank after the XML header.
+     * close() writes the DTD there if it fits, and otherwise copies the body
+     * into a new file after the DTD.
+     */
+    dfxml_writer(const std::filesystem::path outfilename_, dtd_mode_t dtd_mode_, size_t dtd_reserve_=dtd_reserve_default):
+        dfxml_writer(dfxml::make_file_sink(outfilename_), dtd_mode_, dtd_reserve_) {}
+
+    /* Write to memory: the document is appended to target's buffer, which the
+     * caller may clear and reuse for the next document. A std::pmr::string
+     * buffer allocates from the caller's memory resource, e.g. an arena.
+     */
+    template<typename Buffer>
+    explicit dfxml_writer(dfxml::buffer_target_t<Buffer> target):
+        dfxml_writer(std::make_unique<dfxml::basic_buffer_sink<Buffer>>(target.buf)) {}
+    // hand the output to callback as it is drained; see dfxml::callback_sink
+    explicit dfxml_writer(dfxml::callback_sink::callback_t callback):
+        dfxml_writer(std::make_unique<dfxml::callback_sink>(std::move(callback))) {}
+
+    /* Write to any sink. A compressed sink cannot be patched, so it gets an
+     * external DTD instead of DTD_INTERNAL, and the writer starts in async mode
+     * so that compression runs on the writer thread while the caller keeps
+     * emitting. Its flush policy defaults to every compressed_flush_bytes.
+     */
+    dfxml_writer(std::unique_ptr<dfxml::output_sink> sink, dtd_mode_t dtd_mode_=DTD_NONE, size_t dtd_reserve_=dtd_reserve_default):
+        out(std::move(sink)),
+        tempfile_template( out->path().empty() ? "/tmp/xml_XXXXXXXX" : out->path().string() + "_tmp_XXXXXXXX"),
+        dtd_mode(out->path().empty() ? DTD_NONE :
+                 (dtd_mode_==DTD_INTERNAL && !out->patchable()) ? DTD_EXTERNAL : dtd_mode_),
+        dtd_reserve(dtd_mode==DTD_INTERNAL ? dtd_reserve_ : 0),
+        outfilename(out->path()),
+        checkpoint_filename(outfilename.empty() ? std::filesystem::path() : std::filesystem::path(outfilename.string() + ".checkpoint")) {
+        obuf.append(xml_header);
+        if (dtd_reserve>0) {
+            obuf.append(dtd_reserve-1, ' ');
+            obuf.push_back('\n');
+        }
+        if (out->compresses()) {
+            flush_policy = flush_policy_t::every_bytes(compressed_flush_bytes);
+            start_async();
         }
-        gettimeofday(&t0,0);
-        gettimeofday(&t_last_timestamp,0);
-        out = &outf;                                                // use this one instead
-        *out << xml_header;
     }
-    virtual ~dfxml_writer(){};
+    virtual ~dfxml_writer(){
+        stop_async();
+        if (!obuf.empty()) flush_output(); // close() was not called
+    };
 
     // adds the creator, build_environment, and execution environment
     void add_DFXML_creator(const std::string &program,const std::string &version,
                            const std::string &git_commit,
                            int argc,char * const *argv) {
         const std::string command_line = make_command_line(argc,argv);
+        const size_t begin = obuf.size();
 
+        capturing = true;               // keep the block in obuf, to repeat it in each shard
         push("creator","version='1.0'");
         xmlout("program",program);
         xmlout("version",version);
@@ -149,6 +421,13 @@ public:
         add_DFXML_build_environment();
         add_DFXML_execution_environment(command_line);
         pop();                  // creator
+        capturing = false;
+        if (creator_block.empty()) {
+            creator_block = obuf.substr(begin);
+            creator_depth = tag_stack.size();
+        }
+        const std::lock_guard<dfxml::stat_mutex> lock(M);
+        flush_point();
     }
 
     /*** neither copying nor assignment is implemented ***/
@@ -158,49 +437,943 @@ public:
     typedef std::map<std::string,std::string> strstrmap_t;
     typedef std::set<std::string> stringset_t;
     typedef std::set<std::string> tagid_set_t;
+    typedef dfxml::tag tag_t;
+
+    /* A tag argument: either an interned tag_t, or a string that is checked
+     * each time it is written.
+     */
+    class tagref {
+    public:
+        const tag_t      *interned {nullptr};
+        std::string_view name {};
+        tagref(const tag_t &t):interned(&t),name(t.name()) {}
+        tagref(const std::string &s):name(s) {}
+        tagref(const char *s):name(s) {}
+        tagref(std::string_view s):name(s) {}
+        tagref(const tagref &) = default;
+        tagref &operator=(const tagref &) = default;
+    };
+
+    /* An entry on the tag stack. A string tag is copied, which allocates only
+     * if it is too long for the small-string buffer; interned tags never allocate.
+     */
+    struct open_tag {
+        const tag_t *interned {nullptr};
+        std::string  name {};           // if not interned
+        explicit open_tag(const tagref &t):interned(t.interned),name(t.interned ? std::string_view() : t.name) {}
+        open_tag(const open_tag &) = default;
+        open_tag &operator=(const open_tag &) = default;
+        const std::string &get_name() const { return interned ? interned->name() : name; }
+        tagref ref() const { return interned ? tagref(*interned) : tagref(name); }
+    };
+    typedef std::vector<open_tag> tag_stack_t;
+
+    /* The tags that have been written, for the DTD. Interned tags are a bit each. */
+    class tag_usage {
+        std::set<std::string,std::less<>> strings {};
+        std::vector<bool>  interned {};
+        uint64_t           count {0};   // of the calls to note(), one per element
+    public:
+        void note(const tagref &tag) {
+            count++;
+            if (tag.interned) {
+                const size_t id = tag.interned->id();
+                if (id >= interned.size()) interned.resize(id+1);
+                interned[id] = true;
+                return;
+            }
+            std::string_view name = tag.name;
+            if (!name.empty() && name[0]=='/') name.remove_prefix(1); // tagout("/tag")
+            check_tag(name);
+            if (strings.find(name)==strings.end()) strings.emplace(name);
+        }
+        void merge(const tag_usage &that) {
+            count += that.count;
+            strings.insert(that.strings.begin(), that.strings.end());
+            if (that.interned.size() > interned.size()) interned.resize(that.interned.size());
+            for (size_t i=0; i<that.interned.size(); i++) {
+                if (that.interned[i]) interned[i] = true;
+            }
+        }
+        /* id is name's interned id, or tag_t::none; a tag is counted under its
+         * id when written as an interned tag and under its name otherwise
+         */
+        bool contains(std::string_view name, size_t id) const {
+            if (id!=tag_t::none && id<interned.size() && interned[id]) return true;
+            return strings.find(name)!=strings.end();
+        }
+        stringset_t names() const {     // built from the registry when the DTD is written
+            stringset_t ret(strings.begin(), strings.end());
+            for (size_t i=0; i<interned.size(); i++) {
+                if (interned[i]) ret.insert(tag_t::name_of(i));
+            }
+            return ret;
+        }
+        uint64_t elements() const { return count; }
+        void clear() {
+            strings.clear();
+            interned.clear();
+            count = 0;
+        }
+    };
 
 private:
-    std::mutex     M {};
-    std::fstream   outf {};          // if we are writing to a file...
-    std::ostream   *out {};          // where it is being written; defaults to stdout
-    stringset_t    tags {};          // XML tags
-    std::stack<std::string>tag_stack {};
+    /* Bounded lock-free multi-producer, single-consumer queue of output buffers,
+     * drained into the stream by a dedicated writer thread. This is Dmitry Vyukov's
+     * bounded MPMC queue with a single consumer. Each cell keeps its buffer, so once
+     * the buffers have grown to size the queue does not allocate.
+     */
+    class async_queue {
+        struct cell {
+            std::atomic<size_t> seq {0};
+            std::string         data {};
+            bool                flush {false};
+        };
+        dfxml::output_sink  *out;
+        const size_t        mask;
+        const backpressure_t backpressure;
+        const flush_mode_t  mode;           // BYTES and MSEC are applied here
+        const size_t        flush_bytes;
+        const std::chrono::milliseconds flush_msec;
+        std::unique_ptr<cell[]> cells;
+        alignas(64) std::atomic<size_t> enqueue_pos {0};
+        alignas(64) std::atomic<size_t> dequeue_pos {0}; // written only by the writer thread
+        std::atomic<size_t> completed {0};  // buffers written, and flushed if they asked to be
+        std::atomic<uint64_t> dropped {0};
+        std::atomic<bool>   stopping {false};
+        std::atomic<bool>   sleeping {false};
+        std::mutex          sleep_M {};
+        std::condition_variable sleep_cv {};
+        std::atomic<size_t> idle_waiters {0};
+        std::mutex          idle_M {};
+        std::condition_variable idle_cv {};
+        std::thread         thread {};
+
+        static size_t round_up(size_t n) {
+            size_t r = 2;
+            while (r < n) r <<= 1;
+            return r;
+        }
+        bool try_push(std::string_view data, bool flush) {
+            size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+            cell *c = nullptr;
+            for (;;) {
+                c = &cells[pos & mask];
+                size_t seq = c->seq.load(std::memory_order_acquire);
+                intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+                if (dif == 0) {
+                    if (enqueue_pos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) break;
+                } else if (dif < 0) {
+                    return false;   // full
+                } else {
+                    pos = enqueue_pos.load(std::memory_order_relaxed);
+                }
+            }
+            c->data.assign(data);
+            c->flush = flush;
+            c->seq.store(pos+1, std::memory_order_release);
+            return true;
+        }
+        bool ready() const {            // a buffer is waiting; called by the writer thread
+            const size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+            return (intptr_t)cells[pos & mask].seq.load(std::memory_order_acquire) - (intptr_t)(pos+1) >= 0;
+        }
+        bool try_pop(std::string &data, bool &flush) {
+            size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+            cell *c = &cells[pos & mask];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            if ((intptr_t)seq - (intptr_t)(pos+1) < 0) return false; // empty
+            data.swap(c->data);         // the cell gets our (empty) buffer back
+            flush = c->flush;
+            c->seq.store(pos+mask+1, std::memory_order_release);
+            dequeue_pos.store(pos+1, std::memory_order_release);
+            return true;
+        }
+        void run() {
+            std::string data;
+            bool flush = false;
+            size_t unflushed = 0;
+            auto last_flush = std::chrono::steady_clock::now();
+            for (;;) {
+                if (try_pop(data, flush)) {
+                    out->write(data.data(), data.size());
+                    unflushed += data.size();
+                    data.clear();
+                    if (flush
+                        || (mode==FLUSH_BYTES && unflushed >= flush_bytes)
+                        || (mode==FLUSH_MSEC && std::chrono::steady_clock::now()-last_flush >= flush_msec)) {
+                        out->flush();
+                        unflushed = 0;
+                        last_flush = std::chrono::steady_clock::now();
+                    }
+                    completed.fetch_add(1);
+                    if (idle_waiters.load()>0) {
+                        const std::lock_guard<std::mutex> lock(idle_M);
+                        idle_cv.notify_all();
+                    }
+                    continue;
+                }
+                if (stopping.load(std::memory_order_acquire)) {
+                    if (try_pop(data, flush)) continue; // pushed before stop()
+                    break;
+                }
+                /* Announce the sleep before the last look at the queue; a
+                 * producer that pushes after that look sees sleeping and wakes us.
+                 */
+                bool timed_out = false;
+                {
+                    std::unique_lock<std::mutex> lock(sleep_M);
+                    sleeping.store(true, std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    auto woken = [this]() { return ready() || stopping.load(std::memory_order_acquire); };
+                    if (mode==FLUSH_MSEC && unflushed>0) {
+                        timed_out = !sleep_cv.wait_until(lock, last_flush + flush_msec, woken);
+                    } else {
+                        sleep_cv.wait(lock, woken);
+                    }
+                    sleeping.store(false, std::memory_order_relaxed);
+                }
+                if (timed_out) {        // the producer went quiet; don't hold its output
+                    out->flush();
+                    unflushed = 0;
+                    last_flush = std::chrono::steady_clock::now();
+                }
+            }
+            out->flush();
+        }
+        void wake() {
+            std::atomic_thread_fence(std::memory_order_seq_cst); // orders the push before the test
+            if (sleeping.load(std::memory_order_relaxed)) {
+                const std::lock_guard<std::mutex> lock(sleep_M);
+                sleep_cv.notify_one();
+            }
+        }
+    public:
+        async_queue(dfxml::output_sink *out_, size_t capacity, backpressure_t backpressure_, const flush_policy_t &policy):
+            out(out_), mask(round_up(capacity)-1), backpressure(backpressure_),
+            mode(policy.mode), flush_bytes(policy.bytes), flush_msec(policy.msec),
+            cells(new cell[mask+1]) {
+            for (size_t i=0; i<=mask; i++) cells[i].seq.store(i, std::memory_order_relaxed);
+            thread = std::thread(&async_queue::run, this);
+        }
+        async_queue(const async_queue &) = delete;
+        async_queue &operator=(const async_queue &) = delete;
+        ~async_queue() { stop(); }
+
+        /* Returns false if the buffer was dropped */
+        bool push(std::string_view data, bool flush, bool droppable) {
+            while (!try_push(data, flush)) {
+                if (droppable && backpressure==BACKPRESSURE_DROP) {
+                    dropped.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                wake();
+                std::this_thread::yield();
+            }
+            wake();
+            return true;
+        }
+        /* Wait until everything pushed so far has been written, and flushed
+         * where it asked to be
+         */
+        void wait_idle() {
+            const size_t target = enqueue_pos.load(std::memory_order_acquire);
+            idle_waiters.fetch_add(1);
+            {
+                std::unique_lock<std::mutex> lock(idle_M);
+                idle_cv.wait(lock, [this, target]() { return completed.load() >= target; });
+            }
+            idle_waiters.fetch_sub(1);
+        }
+        void stop() {
+            if (!thread.joinable()) return;
+            {
+                const std::lock_guard<std::mutex> lock(sleep_M);
+                stopping.store(true, std::memory_order_release);
+                sleep_cv.notify_one();
+            }
+            thread.join();
+        }
+        uint64_t get_dropped() const { return dropped.load(); }
+    };
+
+    dfxml::stat_mutex M {};              // counts contention after set_writer_stats()
+    std::unique_ptr<dfxml::output_sink> out {}; // where it is being written; defaults to stdout
+    tag_usage      tags {};          // XML tags
+    tag_stack_t    tag_stack {};
     std::string    tempfilename {};
     std::string    tempfile_template {"/tmp/xml_XXXXXXXX"};
-    struct timeval t0 {};
-    struct timeval t_last_timestamp {};	// for creating delta timestamps
-    bool           make_dtd {false};
+    typedef std::chrono::steady_clock::time_point steady_time_t;
+    steady_time_t  t0 {std::chrono::steady_clock::now()};
+    steady_time_t  t_last_timestamp {t0};  // for creating delta timestamps
+    dfxml::profiler prof {};
+    std::unique_ptr<dfxml::resource_sampler> sampler {};
+    std::unique_ptr<dfxml::perf_counters> perf {}; // for the process
+    unsigned int   final_reports {0};     // report_t bits
+    dtd_mode_t     dtd_mode {DTD_NONE};
+    size_t         dtd_reserve {0};   // bytes reserved for the DTD after the XML header
+    std::string    root_tag {};       // first tag pushed; names the DOCTYPE
     std::filesystem::path    outfilename {};
     bool           oneline {false};    // output entire DFXML on a single line. Can be toggled on and off
+    bool           compact {false};    // no whitespace between elements; forces oneline
+
+    /* Output is formatted into obuf and handed to *out by drain().
+     * The flush policy decides when *out is flushed.
+     */
+    static inline const size_t obuf_max = 65536; // drain to *out at least this often
+    std::string    obuf {};
+    flush_policy_t flush_policy {};
+    size_t         flush_tag_id {tag_t::none}; // flush_policy.tag, if it is interned
+    size_t         bytes_unflushed {0};   // drained to *out since the last flush
+    std::chrono::steady_clock::time_point t_last_flush {std::chrono::steady_clock::now()};
+    std::unique_ptr<async_queue> aq {};   // set in async mode; changed only under M
+    /* aq as lock-free committers see it. stop_async_locked() clears it and
+     * waits for the committers counted in aq_inflight before deleting aq.
+     */
+    std::atomic<async_queue *> aq_live {nullptr};
+    std::atomic<size_t> aq_inflight {0};
+    uint64_t       async_dropped {0};     // dropped by previous async queues
+
+    size_t         async_capacity {0};    // to restart the queue on a new shard
+    backpressure_t async_backpressure {BACKPRESSURE_BLOCK};
+
+    /* Sharding state */
+    shard_policy_t shard_policy {};
+    sink_factory_t shard_factory {};
+    std::filesystem::path shard_base {};  // shard n is shard_base.nnnnn<shard_ext>
+    std::string    shard_ext {};
+    std::vector<shard_t> shards {};       // finished shards
+    std::vector<std::string> tag_attributes {}; // parallel to tag_stack while sharding
+    uint64_t       shard_fileobjects {0};
+    uint64_t       fileobject_count {0};  // top-level fileobjects in all shards
+    uint64_t       file_bytes {0};        // handed to *out or the queue, in this file
+    uint64_t       bytes_written {0};     // handed to *out or the queue, in all files
+    uint64_t       flush_count {0};
+    std::atomic<uint64_t> async_elements {0}; // in fragments committed without the lock
+    std::atomic<uint64_t> async_bytes {0};    // likewise, if pushed; folded into file_bytes by stop_async_locked()
+    std::atomic<uint64_t> async_fileobjects {0}; // likewise; folded into fileobject_count
+    std::string    creator_block {};      // repeated at the top of each shard
+    size_t         creator_depth {0};
+    bool           capturing {false};     // obuf is kept whole while the creator block is written
+    bool           well_formed {false};   // each flush ends the file with a trailer of closing tags
+    std::string    trailer {};
+
+    /* Checkpoints */
+    std::filesystem::path checkpoint_filename {};
+    unsigned int   checkpoint_sec {0};        // checkpoint_due() intervals; 0 for none
+    uint64_t       checkpoint_every {0};
+    uint64_t       checkpoint_fileobjects {0}; // fileobject_count at the last checkpoint
+    std::chrono::steady_clock::time_point t_last_checkpoint {std::chrono::steady_clock::now()};
+
+    /* Index sidecar */
+    typedef std::vector<std::pair<size_t,size_t>> span_list_t; // [begin,end) of top-level fileobjects
+    bool           indexing {false};
+    std::unique_ptr<dfxml::index_writer> index {};
+    uint64_t       index_ordinal {0};
+    int64_t        index_adjust {0};      // set if the DTD moved the body
+    size_t         index_depth {0};       // tag_stack size outside the fileobject being indexed
+    size_t         index_begin {0};       // its offset in obuf; from there obuf is held until pop()
+    bool           index_open {false};
+
+    /* Reorder buffer for commit(f, seq); guarded by M */
+    struct reorder_entry {
+        std::string buf {};
+        bool        flush {false};      // holds the FLUSH_ON_POP tag
+        size_t      fileobjects {0};
+        span_list_t spans {};
+    };
+    typedef std::map<uint64_t, reorder_entry> reorder_map_t;
+    static inline const size_t reorder_spare_max = 64;
+    uint64_t       reorder_next {0};      // next sequence number to write
+    reorder_map_t  reorder_pending {};
+    size_t         reorder_bytes {0};
+    std::vector<std::string> reorder_spare {}; // emptied buffers, handed back to fragments
+    reorder_policy_t reorder_policy {};
+    reorder_stats_t  reorder_stats {};
+    std::condition_variable_any reorder_cv {};
+
+    bool  reorder_full(size_t len) const {
+        if (reorder_pending.empty()) return false;      // one fragment is always accepted
+        return reorder_pending.size() >= reorder_policy.max_fragments
+            || reorder_bytes + len > reorder_policy.max_bytes;
+    }
+    // append a buffered fragment to obuf and recycle its buffer; returns whether to flush
+    bool  reorder_write(reorder_map_t::iterator it) {
+        const bool flush = it->second.flush;
+        if (it->second.fileobjects) shard_check();
+        if (index) index_spans(it->second.buf, it->second.spans);
+        obuf.append(it->second.buf);
+        count_fileobjects(it->second.fileobjects);
+        drain_if_full();
+        reorder_bytes -= it->second.buf.size();
+        if (reorder_spare.size() < reorder_spare_max) {
+            it->second.buf.clear();
+            reorder_spare.push_back(std::move(it->second.buf));
+        }
+        reorder_pending.erase(it);
+        return flush;
+    }
+    /* Wait, throw or give up on a gap until seq fits in the reorder buffer.
+     * Returns true if seq is late: its gap was already given up under
+     * REORDER_WRITE, so it is written at once.
+     */
+    bool  reorder_admit(std::unique_lock<dfxml::stat_mutex> &lock, uint64_t seq, size_t len) {
+        const bool late = seq < reorder_next;
+        if (reorder_pending.count(seq) || (late && reorder_policy.stall!=REORDER_WRITE)) {
+            throw std::runtime_error("dfxml_writer: sequence " + std::to_string(seq) + " already committed");
+        }
+        if (late) {
+            reorder_stats.out_of_order++;
+            return true;
+        }
+        while (seq!=reorder_next && reorder_full(len)) {
+            switch (reorder_policy.stall) {
+            case REORDER_THROW:
+                throw std::runtime_error("dfxml_writer: reorder buffer full waiting for sequence "
+                                         + std::to_string(reorder_next));
+            case REORDER_WRITE: {
+                auto it = reorder_pending.begin();
+                reorder_stats.out_of_order++;
+                if (it->first > seq) {  // seq is the lowest; write it now
+                    reorder_next = seq;
+                    break;
+                }
+                reorder_next = it->first + 1;
+                reorder_release(reorder_write(it));
+                break;
+            }
+            case REORDER_BLOCK: {
+                const auto t = std::chrono::steady_clock::now();
+                reorder_stats.stalls++;
+                reorder_cv.wait(lock, [&]{ return seq==reorder_next || !reorder_full(len); });
+                reorder_stats.stall_usec += std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - t).count();
+                break;
+            }
+            }
+        }
+        return false;
+    }
+    // called after seq is added to the reorder buffer
+    void  reorder_insert_done(uint64_t seq) {
+        if (seq==reorder_next) {
+            reorder_release(false);
+            return;
+        }
+        reorder_stats.max_pending       = std::max(reorder_stats.max_pending, reorder_pending.size());
+        reorder_stats.max_pending_bytes = std::max(reorder_stats.max_pending_bytes, reorder_bytes);
+    }
+    // write the fragments that are now in sequence, then apply the flush policy
+    void  reorder_release(bool flush) {
+        for (auto it = reorder_pending.begin(); it!=reorder_pending.end() && it->first==reorder_next;
+             it = reorder_pending.begin()) {
+            flush |= reorder_write(it);
+            reorder_next++;
+        }
+        if (flush) {
+            flush_output();
+        } else {
+            flush_point();
+        }
+        reorder_cv.notify_all();
+    }
+
+    /* The fileobject being indexed is held in obuf until pop() so that its keys
+     * can be read; everything before it can be written.
+     */
+    size_t drainable() const { return index_open ? index_begin : obuf.size(); }
+    void  drained(size_t n) {
+        file_bytes    += n;
+        bytes_written += n;
+        obuf.erase(0, n);
+        if (index_open) index_begin -= n;
+    }
+    void  drain() {                     // hand the buffer to the stream
+        const size_t n = drainable();
+        if (n==0 || capturing) return;
+        if (aq) {
+            aq->push(std::string_view(obuf.data(), n), false, false);
+        } else {
+            out->write(obuf.data(), n);
+            bytes_unflushed += n;
+        }
+        drained(n);
+    }
+    /* In async mode every call hands its output to the queue, so that fragments
+     * committed by other threads are ordered after it.
+     */
+    void  drain_if_full() {
+        if (obuf.size() >= obuf_max || aq) drain();
+    }
+    void  flush_output() {
+        if (capturing) return;
+        flush_count++;
+        if (aq) {                       // the writer thread flushes
+            const size_t n = drainable();
+            aq->push(std::string_view(obuf.data(), n), true, false);
+            drained(n);
+            return;
+        }
+        drain();
+        sync_output(index_open ? index_depth : tag_stack.size()); // a held fileobject is not in the file yet
+    }
+    /* Flush the sink. In well-formed mode the outermost open tags of the stack
+     * are closed in a trailer that the next write overwrites.
+     */
+    void  sync_output(size_t open) {
+        if (well_formed) {
+            trailer.clear();
+            append_closing_tags(trailer, open);
+            out->write_trailer(trailer);
+        } else {
+            out->flush();
+        }
+        bytes_unflushed = 0;
+        t_last_flush = std::chrono::steady_clock::now();
+    }
+    void  append_closing_tags(std::string &buf, size_t open) const {
+        for (size_t i=open; i>0; i--) {
+            if (!oneline) append_spaces(buf, i-1);
+            append_close(buf, tag_stack[i-1].ref());
+            if (!oneline) buf.push_back('\n');
+        }
+    }
+    /* Called at the end of every threadsafe element; applies the flush policy */
+    void  flush_point() {
+        if (aq && flush_policy.mode!=FLUSH_ALWAYS) { // the writer thread applies the others
+            drain();
+            return;
+        }
+        switch (flush_policy.mode) {
+        case FLUSH_ALWAYS:
+            flush_output();
+            return;
+        case FLUSH_BYTES:
+            if (bytes_unflushed + obuf.size() >= flush_policy.bytes) {
+                flush_output();
+                return;
+            }
+            break;
+        case FLUSH_MSEC:
+            if (std::chrono::steady_clock::now() - t_last_flush >= std::chrono::milliseconds(flush_policy.msec)) {
+                flush_output();
+                return;
+            }
+            break;
+        case FLUSH_NEVER:
+        case FLUSH_ON_POP:
+            break;
+        }
+        drain_if_full();
+    }
+
+    bool  sharding() const { return shard_policy.fileobjects>0 || shard_policy.bytes>0; }
+    void  count_fileobjects(size_t n) {
+        shard_fileobjects += n;
+        fileobject_count  += n;
+    }
+    static bool is_fileobject(const tagref &tag) { return tag.name==dfxml::tags::fileobject.name(); }
+    // sharding and the index deal only in top-level fileobjects
+    static bool in_fileobject(const tag_stack_t &stack) {
+        for (const auto &it : stack) {
+            if (is_fileobject(it.ref())) return true;
+        }
+        return false;
+    }
+    std::filesystem::path shard_filename(size_t n) const {
+        char num[32];
+        snprintf(num, sizeof(num), ".%05zu", n);
+        return shard_base.string() + num + shard_ext;
+    }
+    // with those committed lock-free since async mode started
+    uint64_t get_fileobject_count_locked() const { return fileobject_count + async_fileobjects.load(); }
+    void  stop_async_locked() {
+        if (!aq) return;
+        aq_live.store(nullptr);
+        while (aq_inflight.load()>0) std::this_thread::yield(); // commits already pushing
+        const uint64_t n = async_bytes.exchange(0);
+        file_bytes    += n;
+        bytes_written += n;
+        count_fileobjects(async_fileobjects.exchange(0));
+        flush_output();
+        aq->stop();
+        async_dropped += aq->get_dropped();
+        aq.reset();
+    }
+    void  start_queue(size_t capacity, backpressure_t backpressure) {
+        async_capacity     = capacity;
+        async_backpressure = backpressure;
+        aq = std::make_unique<async_queue>(out.get(), capacity, backpressure, flush_policy);
+        aq_live.store(aq.get());
+    }
+    /* Called before a fileobject is written; rolls over to a new shard if this one is full */
+    void  shard_check() {
+        if (!sharding() || shard_fileobjects==0) return;
+        if ((shard_policy.fileobjects>0 && shard_fileobjects >= shard_policy.fileobjects) ||
+            (shard_policy.bytes>0 && file_bytes + obuf.size() >= shard_policy.bytes)) {
+            shard_rollover();
+        }
+    }
+    void  finish_file() {
+        out->close();
+        switch (dtd_mode) {
+        case DTD_NONE:
+            break;
+        case DTD_INTERNAL:
+            write_internal_dtd();
+            break;
+        case DTD_EXTERNAL:
+            write_external_dtd();
+            break;
+        }
+        if (index) {
+            index->close(index_adjust);
+            index.reset();
+        }
+    }
+    void  finish_shard() {              // the queue must be stopped and the tags closed
+        drain();
+        sync_output(0);
+        finish_file();
+        shards.push_back(shard_t());
+        shards.back().filename    = outfilename;
+        shards.back().fileobjects = shard_fileobjects;
+        shards.back().bytes       = std::filesystem::file_size(outfilename);
+        shard_fileobjects = 0;
+        file_bytes       = 0;
+    }
+    void  open_shard(size_t n) {
+        outfilename       = shard_filename(n);
+        out               = shard_factory(outfilename);
+        tempfile_template = outfilename.string() + "_tmp_XXXXXXXX";
+        obuf.append(xml_header);
+        if (dtd_reserve>0) {
+            obuf.append(dtd_reserve-1, ' ');
+            obuf.push_back('\n');
+        }
+        if (indexing) open_index();
+    }
+    void  shard_rollover() {
+        append_closing_tags(obuf, tag_stack.size());
+        const bool async = (aq!=nullptr);
+        stop_async_locked();
+        finish_shard();
+        open_shard(shards.size());
+        for (size_t i=0; i<=tag_stack.size(); i++) {
+            if (i==creator_depth) obuf.append(creator_block);
+            if (i==tag_stack.size()) break;
+            if (i==0 && dtd_mode==DTD_EXTERNAL) append_doctype();
+            if (!oneline) append_spaces(obuf, i);
+            append_open(obuf, tag_stack[i].ref(), tag_attributes[i]);
+            if (!oneline) obuf.push_back('\n');
+        }
+        if (async) start_queue(async_capacity, async_backpressure);
+    }
+    void  write_manifest() {
+        dfxml_writer m(get_manifest_filename(), false);
+        m.set_flush_policy(flush_policy_t::never());
+        uint64_t fileobjects = 0, bytes = 0;
+        m.push("dfxml_manifest", "version='1.0'");
+        for (const auto &it : shards) {
+            m.push("shard");
+            m.xmlout("filename",    it.filename.filename());
+            m.xmlout("fileobjects", it.fileobjects);
+            m.xmlout("bytes",       it.bytes);
+            m.pop();
+            fileobjects += it.fileobjects;
+            bytes       += it.bytes;
+        }
+        m.xmlout("fileobjects", fileobjects);
+        m.xmlout("bytes",       bytes);
+        m.pop();
+        m.close();
+    }
+    /* The key fields of one <fileobject>: its own <inode>, and the img_offset
+     * of the first <byte_run> in its first <byte_runs> (or of a <byte_run>
+     * child, as older DFXML writes them). Only the fileobject's
+     * children are looked at, so a <parent_object>, a nested fileobject or
+     * text that looks like a key cannot supply them.
+     */
+    static uint64_t parse_index_number(std::string_view text, size_t pos) {
+        uint64_t v = 0;
+        const char *end = text.data() + text.size();
+        if (std::from_chars(text.data()+pos, end, v).ec != std::errc()) return dfxml::index_none;
+        return v;
+    }
+    // the value of attribute name in the inside of a start tag
+    static uint64_t parse_index_attribute(std::string_view tag, std::string_view name) {
+        for (size_t pos = tag.find(name); pos!=std::string_view::npos; pos = tag.find(name, pos+1)) {
+            const size_t q = pos + name.size() + 1;
+            if (!isspace((unsigned char)tag[pos-1]) || q >= tag.size() || tag[q-1]!='=') continue;
+            if (tag[q]!='\'' && tag[q]!='"') continue;
+            return parse_index_number(tag, q+1);
+        }
+        return dfxml::index_none;
+    }
+    static void index_keys(std::string_view text, dfxml::index_record &r) {
+        r.inode = r.img_offset = dfxml::index_none;
+        size_t depth = 0;               // elements open; the fileobject's children start at 1
+        bool   in_byte_runs = false, seen_byte_runs = false;
+        for (size_t pos = text.find('<'); pos!=std::string_view::npos; pos = text.find('<', pos)) {
+            const size_t end = text.find('>', pos);
+            if (end==std::string_view::npos) break;
+            const std::string_view tag = text.substr(pos+1, end-pos-1);
+            pos = end+1;
+            if (tag.empty() || tag[0]=='!' || tag[0]=='?') continue;
+            if (tag[0]=='/') {
+                if (depth>0 && --depth==1) in_byte_runs = false;
+                continue;
+            }
+            const bool empty = tag.back()=='/';
+            const std::string_view name = tag.substr(0, tag.find_first_of(" \t\r\n/"));
+            if (depth==1 && name=="inode" && !empty && r.inode==dfxml::index_none) {
+                r.inode = parse_index_number(text, pos);
+            } else if (depth==1 && name=="byte_runs" && !seen_byte_runs) {
+                seen_byte_runs = true;
+                in_byte_runs   = !empty;
+            } else if (name=="byte_run" && ((depth==2 && in_byte_runs) || (depth==1 && !seen_byte_runs))) {
+                r.img_offset = parse_index_attribute(tag, "img_offset");
+                in_byte_runs = false;   // only the first byte_run
+                seen_byte_runs = true;
+            }
+            if (!empty) depth++;
+        }
+    }
+    // [begin,end) of the element appended to buf at start, without the whitespace around it
+    static std::pair<size_t,size_t> element_span(const std::string &buf, size_t start) {
+        return {buf.find('<', start), buf.rfind('>')+1};
+    }
+    // record one fileobject that starts at offset in the output
+    void  index_add(std::string_view text, uint64_t offset) {
+        dfxml::index_record r;
+        r.ordinal = index_ordinal++;
+        r.offset  = offset;
+        r.length  = text.size();
+        index_keys(text, r);
+        index->add(r);
+    }
+    // record the fileobjects of buf, which is about to be appended to obuf
+    void  index_spans(const std::string &buf, const span_list_t &spans) {
+        const uint64_t base = file_bytes + obuf.size();
+        for (const auto &it : spans) {
+            index_add(std::string_view(buf).substr(it.first, it.second-it.first), base+it.first);
+        }
+    }
+    void  open_index() {
+        index = std::make_unique<dfxml::index_writer>(get_index_filename(),
+                                                      out->compresses() ? dfxml::INDEX_COMPRESSED : 0);
+        index_adjust = 0;
+    }
+    /* A checkpoint file is a list of records, each "name length\nvalue\n" */
+    typedef std::vector<std::pair<std::string,std::string>> record_list_t;
+    static void put_record(std::string &buf, std::string_view name, std::string_view value) {
+        buf.append(name).append(" ").append(std::to_string(value.size())).append("\n");
+        buf.append(value).append("\n");
+    }
+    static void put_record(std::string &buf, std::string_view name, uint64_t value) {
+        put_record(buf, name, std::to_string(value));
+    }
+    static record_list_t read_records(const std::filesystem::path &fname) {
+        std::ifstream is(fname, std::ios::binary);
+        if (!is.is_open()) throw std::runtime_error(fname.string() + ": cannot open checkpoint");
+        record_list_t ret;
+        std::string name;
+        size_t len = 0;
+        while (is >> name >> len) {
+            std::string value(len, '\0');
+            if (is.get()!='\n' || !is.read(&value[0], len) || is.get()!='\n') {
+                throw std::runtime_error(fname.string() + ": checkpoint is corrupt");
+            }
+            ret.emplace_back(name, value);
+        }
+        if (ret.empty() || ret[0].first!="dfxml_checkpoint" || ret[0].second!="1") {
+            throw std::runtime_error(fname.string() + ": not a version 1 checkpoint");
+        }
+        return ret;
+    }
+    static const std::string &get_record(const record_list_t &records, std::string_view name) {
+        for (const auto &it : records) {
+            if (it.first==name) return it.second;
+        }
+        throw std::runtime_error(std::string("dfxml_writer: checkpoint has no ") + std::string(name));
+    }
+    /* Replace a freshly constructed writer's state with a checkpoint's */
+    void  restore(const record_list_t &records) {
+        const auto num = [](const std::string &v) { return (uint64_t)std::stoull(v); };
+        uint64_t index_count = 0;
+        obuf.clear();
+        file_bytes = num(get_record(records, "length"));
+        for (const auto &it : records) {
+            const std::string &name = it.first;
+            const std::string &value = it.second;
+            if      (name=="root_tag")      root_tag = value;
+            else if (name=="dtd_mode")      dtd_mode = (dtd_mode_t)num(value);
+            else if (name=="dtd_reserve")   dtd_reserve = num(value);
+            else if (name=="oneline")       oneline = num(value);
+            else if (name=="compact")       compact = num(value);
+            else if (name=="well_formed")   well_formed = num(value);
+            else if (name=="tag")           tag_stack.emplace_back(tagref(value));
+            else if (name=="attribute")     tag_attributes.push_back(value);
+            else if (name=="used")          tags.note(tagref(value));
+            else if (name=="creator")       creator_block = value;
+            else if (name=="creator_depth") creator_depth = num(value);
+            else if (name=="fileobjects")   fileobject_count = checkpoint_fileobjects = num(value);
+            else if (name=="reorder_next")  reorder_next = num(value);
+            else if (name=="index_ordinal") { indexing = true; index_ordinal = num(value); }
+            else if (name=="index_count")   index_count = num(value);
+            else if (name=="shard_policy_fileobjects") shard_policy.fileobjects = num(value);
+            else if (name=="shard_policy_bytes")       shard_policy.bytes = num(value);
+            else if (name=="shard_base")    shard_base = value;
+            else if (name=="shard_ext")     shard_ext = value;
+            else if (name=="shard_fileobjects") shard_fileobjects = num(value);
+            else if (name=="shard")         { shards.push_back(shard_t()); shards.back().filename = value; }
+            else if (name=="shard_done_fileobjects") shards.back().fileobjects = num(value);
+            else if (name=="shard_done_bytes")       shards.back().bytes = num(value);
+        }
+        if (indexing) index = dfxml::index_writer::reopen(get_index_filename(), index_count);
+        if (sharding()) shard_factory = [](const std::filesystem::path &p) { return dfxml::make_file_sink(p); };
+    }
+
+    void  append_doctype() {
+        obuf.append("<!DOCTYPE ").append(root_tag).append(" SYSTEM \"");
+        obuf.append(get_dtd_filename().filename().string()).append("\">\n");
+    }
 
     void  write_doctype(std::fstream &out);
-    void  write_dtd() {
-        *out << "<!DOCTYPE fiwalk\n";
-        *out << "[\n";
-        for (auto const &it:tags) {
-            *out << "<!ELEMENT " << it << "ANY >\n";
+    std::string dtd_declarations() const {
+        std::string ret;
+        for (auto const &it:tags.names()) {
+            ret.append("<!ELEMENT ").append(it).append(" ANY >\n");
+        }
+        ret.append("<!ATTLIST volume startsector CDATA #IMPLIED>\n");
+        ret.append("<!ATTLIST run start CDATA #IMPLIED>\n");
+        ret.append("<!ATTLIST run len CDATA #IMPLIED>\n");
+        return ret;
+    }
+    std::string doctype_name() const { return root_tag.empty() ? "fiwalk" : root_tag; }
+
+    /* Copies len bytes at offset off of the file in to the end of out, in the kernel if possible */
+    static void copy_body(const std::filesystem::path &in, off_t off, const std::filesystem::path &out, off_t len) {
+#if defined(HAVE_COPY_FILE_RANGE) && defined(HAVE_FCNTL_H)
+        int fd_in  = ::open(in.c_str(), O_RDONLY);
+        int fd_out = ::open(out.c_str(), O_WRONLY);
+        if (fd_in>=0 && fd_out>=0) {
+            off_t off_out = lseek(fd_out, 0, SEEK_END);
+            while (len > 0) {
+                const ssize_t n = copy_file_range(fd_in, &off, fd_out, &off_out, len, 0);
+                if (n <= 0) break;      // not supported for these files; copy the rest below
+                len -= n;
+            }
+        }
+        if (fd_in>=0) ::close(fd_in);
+        if (fd_out>=0 && ::close(fd_out)!=0) {
+            throw std::runtime_error(out.string() + ": " + strerror(errno));
+        }
+        if (len == 0) return;
+#endif
+        std::ifstream is(in, std::ios::binary);
+        std::ofstream os(out, std::ios::binary | std::ios::app);
+        is.seekg(off);
+        std::vector<char> buf(1024*1024);
+        while (len > 0 && is.good()) {
+            is.read(buf.data(), std::min((off_t)buf.size(), len));
+            os.write(buf.data(), is.gcount());
+            len -= is.gcount();
+        }
+        if (len > 0 || !os.good()) {
+            throw std::runtime_error(out.string() + ": cannot copy DTD body");
+        }
+    }
+    /* Called from close() */
+    void write_internal_dtd() {
+        std::string doctype = "<!DOCTYPE " + doctype_name() + "\n[\n" + dtd_declarations() + "]>\n";
+        if (doctype.size() <= dtd_reserve) {
+            // patch the blank region in place
+            doctype.pop_back();
+            doctype.append(dtd_reserve - 1 - doctype.size(), ' ');
+            doctype.push_back('\n');
+            std::fstream f(outfilename, std::ios::in | std::ios::out | std::ios::binary);
+            f.seekp(xml_header.size());
+            f.write(doctype.data(), doctype.size());
+            f.close();
+            if (f.fail()) {
+                throw std::runtime_error(outfilename.string() + ": cannot write DTD");
+            }
+            return;
+        }
+        // write the header and DTD to a new file, copy the body after it, and rename it over the output
+        tempfilename = tempfile_template;
+        int fd = mkstemp(&tempfilename[0]);
+        if (fd<0) {
+            throw std::runtime_error(tempfilename + ": " + strerror(errno));
+        }
+        ::close(fd);
+        {
+            std::ofstream os(tempfilename, std::ios::binary);
+            os << xml_header << doctype;
+            if (!os.good()) {
+                throw std::runtime_error(tempfilename + ": cannot write DTD");
+            }
+        }
+        const off_t body = xml_header.size() + dtd_reserve;
+        index_adjust = (int64_t)(xml_header.size() + doctype.size()) - body;
+        copy_body(outfilename, body, tempfilename, (off_t)std::filesystem::file_size(outfilename) - body);
+        std::filesystem::permissions(tempfilename, std::filesystem::status(outfilename).permissions());
+        std::filesystem::rename(tempfilename, outfilename);
+    }
+    void write_external_dtd() {
+        std::ofstream os(get_dtd_filename());
+        os << dtd_declarations();
+        if (!os.good()) {
+            throw std::runtime_error(get_dtd_filename().string() + ": cannot write DTD");
         }
-        *out << "<!ATTLIST volume startsector CDATA #IMPLIED>\n";
-        *out << "<!ATTLIST run start CDATA #IMPLIED>\n";
-        *out << "<!ATTLIST run len CDATA #IMPLIED>\n";
-        *out << "]>\n";
     }
     /**
-     * make sure that a tag is valid and, if so, add it to the list of tags we use
+     * make sure that a tag is valid
      */
-    void  verify_tag(std::string tag) {
-        if (tag[0]=='/') tag = tag.substr(1);
-        if (tag.find(" ") != std::string::npos){
+    static void check_tag(std::string_view tag) {
+        if (tag.find(' ') != std::string_view::npos){
             std::cerr << "tag '" << tag << "' contains space. Cannot continue.\n";
             exit(1);
         }
-        tags.insert(tag);
     }
     void  spaces(int delta=0){   // print spaces corresponding to tag stack
-        for(unsigned int i=0;i<tag_stack.size()+delta && !oneline;i++){
-            *out << "  ";
+        if (!oneline) append_spaces(obuf, tag_stack.size()+delta);
+    }
+
+    /* Formatting primitives shared by the writer and by fragments */
+    static inline const std::string indent_spaces = std::string(128, ' '); // two per level
+    static void append_spaces(std::string &buf, size_t depth) {
+        for (size_t n=2*depth; n>0; ) {  // one slice unless nested over 64 deep
+            const size_t len = std::min(n, indent_spaces.size());
+            buf.append(indent_spaces, 0, len);
+            n -= len;
         }
     }
+    // <tag attribute>, or <tag attribute/> for an empty element
+    static void append_open(std::string &buf, const tagref &tag, std::string_view attribute, bool empty_element=false) {
+        if (tag.interned && attribute.empty() && !empty_element) {
+            buf.append(tag.interned->open());
+            return;
+        }
+        buf.push_back('<');
+        buf.append(tag.name);
+        if (attribute.size()>0 || empty_element) {
+            buf.push_back(' ');
+            buf.append(attribute);
+        }
+        if (empty_element) buf.push_back('/');
+        buf.push_back('>');
+    }
+    static void append_close(std::string &buf, const tagref &tag) {
+        if (tag.interned) {
+            buf.append(tag.interned->close());
+            return;
+        }
+        buf.append("</");
+        buf.append(tag.name);
+        buf.push_back('>');
+    }
 
 
 public:
@@ -252,31 +1425,261 @@ public:
 #undef BFIX
 #endif
     }
+    /* An on_pop() tag is looked up among the interned tags once, here, so
+     * declare interned tags before setting the policy that names them.
+     * In async mode the writer thread is restarted, since it applies the
+     * policy itself.
+     */
+    void   set_flush_policy(const flush_policy_t &policy) {
+        const std::lock_guard<dfxml::stat_mutex> lock(M);
+        const bool async = (aq!=nullptr);
+        stop_async_locked();
+        flush_policy = policy;
+        flush_tag_id = policy.mode==FLUSH_ON_POP ? tag_t::find(policy.tag) : tag_t::none;
+        if (async) start_queue(async_capacity, async_backpressure);
+    }
+    const flush_policy_t &get_flush_policy() const { return flush_policy; }
+
+    /* Async mode: output is handed to a bounded lock-free queue and written by a
+     * dedicated thread, so producers do not wait for the stream. commit() does not
+     * take the writer's lock in this mode. Only fragments are dropped under
+     * BACKPRESSURE_DROP; the writer's own output always waits for space, because
+     * losing a push() or pop() would break the document.
+     */
+    void   start_async(size_t capacity=4096, backpressure_t backpressure=BACKPRESSURE_BLOCK) {
+        const std::lock_guard<dfxml::stat_mutex> lock(M);
+        if (aq) throw std::runtime_error("dfxml_writer::start_async: already started");
+        if (well_formed) throw std::runtime_error("dfxml_writer::start_async: not in well-formed mode");
+        drain();
+        start_queue(capacity, backpressure);
+    }
+    /* Well-formed mode: every flush also writes the closing tags of the elements
+     * still open, and the next write overwrites them, so the file on disk is
+     * always a complete document that can be parsed or tailed while it grows.
+     * The output must be an uncompressed file written synchronously; use the
+     * flush policy to choose how often the trailer is rewritten.
+     */
+    void   set_well_formed(bool on=true) {
+        const std::lock_guard<dfxml::stat_mutex> lock(M);
+        if (on && (aq || !out->patchable())) {
+            throw std::runtime_error("dfxml_writer::set_well_formed: output must be an uncompressed file written synchronously");
+        }
+        well_formed = on;
+    }
+    bool   get_well_formed() const { return well_formed; }
+    // drain the queue and return to synchronous writing
+    void   stop_async() {
+        const std::lock_guard<dfxml::stat_mutex> lock(M);
+        stop_async_locked();
+    }
+    // number of fragments dropped because the queue was full
+    uint64_t get_dropped() const { return async_dropped + (aq ? aq->get_dropped() : 0); }
     void   set_tempfile_template(const std::string &temp) {
         tempfile_template = temp;
     }
-    static std::string xmlescape(const std::string &xml) {
-        std::stringstream ret;
-        for(char ch: xml){
-            switch(ch){
+
+    /* Escape scanning.
+     * find_escape() returns the offset of the first character that xmlescape() must
+     * replace, or len if there is none. Nearly all filenames and values are clean,
+     * so they are found with a vector scan and copied straight through.
+     */
+    typedef size_t (*find_escape_t)(const char *s, size_t len);
+    static bool needs_escape(char ch) {
+        switch(ch){
+        case '>': case '<': case '&': case '\'': case '"':
+        case '\000': case '\r': case '\n': case '\t':
+            return true;
+        default:
+            return false;
+        }
+    }
+    static size_t find_escape_scalar(const char *s, size_t len) {
+        for(size_t i=0;i<len;i++){
+            if (needs_escape(s[i])) return i;
+        }
+        return len;
+    }
+#ifdef DFXML_ESCAPE_SSE2
+    /* bit i is set if s[i] needs escaping */
+    static unsigned int escape_mask_sse2(const char *s) {
+        const __m128i v = _mm_loadu_si128((const __m128i *)s);
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v,_mm_set1_epi8('<')), _mm_cmpeq_epi8(v,_mm_set1_epi8('>')));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v,_mm_set1_epi8('&')), _mm_cmpeq_epi8(v,_mm_set1_epi8('\''))));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v,_mm_set1_epi8('"')), _mm_cmpeq_epi8(v,_mm_setzero_si128())));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v,_mm_set1_epi8('\r')), _mm_cmpeq_epi8(v,_mm_set1_epi8('\n'))));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v,_mm_set1_epi8('\t')));
+        return (unsigned int)_mm_movemask_epi8(m);
+    }
+    static size_t find_escape_sse2(const char *s, size_t len) {
+        if (len < 16) return find_escape_scalar(s, len);
+        size_t i = 0;
+        for(; i+16 <= len; i+=16){
+            const unsigned int mask = escape_mask_sse2(s+i);
+            if (mask) return i + __builtin_ctz(mask);
+        }
+        if (i==len) return len;
+        /* The tail: rescan the last 16 bytes, ignoring the ones already checked */
+        const unsigned int mask = escape_mask_sse2(s+len-16) & (0xffffu << (i-(len-16)));
+        return mask ? len-16 + __builtin_ctz(mask) : len;
+    }
+#endif
+#ifdef DFXML_ESCAPE_AVX2
+    __attribute__((target("avx2")))
+    static unsigned int escape_mask_avx2(const char *s) {
+        const __m256i v = _mm256_loadu_si256((const __m256i *)s);
+        __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v,_mm256_set1_epi8('<')), _mm256_cmpeq_epi8(v,_mm256_set1_epi8('>')));
+        m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(v,_mm256_set1_epi8('&')), _mm256_cmpeq_epi8(v,_mm256_set1_epi8('\''))));
+        m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(v,_mm256_set1_epi8('"')), _mm256_cmpeq_epi8(v,_mm256_setzero_si256())));
+        m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(v,_mm256_set1_epi8('\r')), _mm256_cmpeq_epi8(v,_mm256_set1_epi8('\n'))));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v,_mm256_set1_epi8('\t')));
+        return (unsigned int)_mm256_movemask_epi8(m);
+    }
+    __attribute__((target("avx2")))
+    static size_t find_escape_avx2(const char *s, size_t len) {
+        if (len < 32) return find_escape_sse2(s, len);
+        size_t i = 0;
+        for(; i+32 <= len; i+=32){
+            const unsigned int mask = escape_mask_avx2(s+i);
+            if (mask) return i + __builtin_ctz(mask);
+        }
+        if (i==len) return len;
+        const unsigned int mask = escape_mask_avx2(s+len-32) & (0xffffffffu << (i-(len-32)));
+        return mask ? len-32 + __builtin_ctz(mask) : len;
+    }
+#endif
+    static const char *escape_scanner_name() {
+#ifdef DFXML_ESCAPE_AVX2
+        if (CPUID::has_avx2()) return "avx2";
+#endif
+#ifdef DFXML_ESCAPE_SSE2
+        return "sse2";
+#else
+        return "scalar";
+#endif
+    }
+    static size_t find_escape(const char *s, size_t len) {
+        static const find_escape_t scanner = []() -> find_escape_t {
+#ifdef DFXML_ESCAPE_AVX2
+            if (CPUID::has_avx2()) return find_escape_avx2;
+#endif
+#ifdef DFXML_ESCAPE_SSE2
+            return find_escape_sse2;
+#else
+            return find_escape_scalar;
+#endif
+        }();
+        return scanner(s, len);
+    }
+
+    /* Append xml to buf, escaped */
+    static void append_escaped(std::string &buf, const char *xml, size_t len) {
+        size_t start = 0;
+        for(;;){
+            const size_t i = start + find_escape(xml+start, len-start);
+            buf.append(xml+start, i-start);
+            if (i==len) return;
+            switch(xml[i]){
                 // XML escapes
-            case '>':  ret << xml_gt; break;
-            case '<':  ret << xml_lt; break;
-            case '&':  ret << xml_am; break;
-            case '\'': ret << xml_ap; break;
-            case '"':  ret << xml_qu; break;
+            case '>':  buf.append(xml_gt); break;
+            case '<':  buf.append(xml_lt); break;
+            case '&':  buf.append(xml_am); break;
+            case '\'': buf.append(xml_ap); break;
+            case '"':  buf.append(xml_qu); break;
 
                 // % encodings
-            case '\000':  ret << encoding_null; break;      // retain encoded nulls
-            case '\r':  ret << encoding_r; break;
-            case '\n':  ret << encoding_n; break;
-            case '\t':  ret << encoding_t; break;
-            default:
-                ret << ch;
+            case '\000':  buf.append(encoding_null); break;      // retain encoded nulls
+            case '\r':  buf.append(encoding_r); break;
+            case '\n':  buf.append(encoding_n); break;
+            case '\t':  buf.append(encoding_t); break;
             }
+            start = i+1;
         }
-        return ret.str();
     }
+    static void append_escaped(std::string &buf, std::string_view xml) {
+        append_escaped(buf, xml.data(), xml.size());
+    }
+    static std::string xmlescape(const std::string &xml) {
+        if (find_escape(xml.data(), xml.size())==xml.size()) return xml; // nothing to escape
+        std::string ret;
+        ret.reserve(xml.size()+16);
+        append_escaped(ret, xml);
+        return ret;
+    }
+
+    /* Numbers are formatted into a caller's stack buffer, exactly as printf's %d and
+     * %f would format them, without allocating. Returns the length.
+     */
+    template<typename T>
+    static size_t format_number(char *buf, size_t buflen, const T value) {
+        if constexpr (std::is_floating_point_v<T>) {
+#if defined(__cpp_lib_to_chars)
+            return std::to_chars(buf, buf+buflen, (double)value, std::chars_format::fixed, 6).ptr - buf;
+#else
+            const int len = snprintf(buf, buflen, "%f", (double)value);
+            return len < 0 ? 0 : std::min((size_t)len, buflen-1);
+#endif
+        } else {
+            return std::to_chars(buf, buf+buflen, value).ptr - buf;
+        }
+    }
+    // buffer size needed by format_number; %f of a large double has over 300 digits
+    template<typename T>
+    static constexpr size_t number_bufsize() { return std::is_floating_point_v<T> ? 512 : 32; }
+
+    /* timevals are formatted as "%d.%06d" */
+    static size_t format_timeval(char *buf, size_t buflen, const struct timeval &ts) {
+        int usec = (int)ts.tv_usec;
+        if (usec < 0 || usec > 999999) {
+            const int len = snprintf(buf, buflen, "%d.%06d", (int)ts.tv_sec, usec);
+            return len < 0 ? 0 : std::min((size_t)len, buflen-1);
+        }
+        char *p = std::to_chars(buf, buf+buflen, (int)ts.tv_sec).ptr;
+        *p++ = '.';
+        for (int i=5; i>=0; i--, usec/=10) {
+            p[i] = (char)('0' + usec%10);
+        }
+        return p+6 - buf;
+    }
+
+    /* Append a value as it would appear in an element or attribute: strings
+     * escaped, numbers as format_number() writes them, timevals as "%d.%06d".
+     */
+    static void append_value(std::string &buf, std::string_view value) { append_escaped(buf, value); }
+    static void append_value(std::string &buf, const struct timeval &ts) {
+        char tbuf[32];
+        buf.append(tbuf, format_timeval(tbuf, sizeof(tbuf), ts));
+    }
+    template<typename T, typename = std::enable_if_t<std::is_arithmetic_v<T> && !std::is_same_v<T, bool>>>
+    static void append_value(std::string &buf, const T value) {
+        char nbuf[number_bufsize<T>()];
+        buf.append(nbuf, format_number(nbuf, sizeof(nbuf), value));
+    }
+
+    /* Builds an element's attributes from typed name/value pairs:
+     *     attribute_list a;
+     *     dw.push("run", a.add("offset", off).add("len", len));
+     * Values are formatted by append_value(), so strings are escaped. It
+     * converts to the string_view that push(), xmlout() and fragments take;
+     * clear() it to reuse its buffer for the next element.
+     */
+    class attribute_list {
+        std::string buf {};
+    public:
+        template<typename T>
+        attribute_list &add(std::string_view name, const T &value) {
+            if (!buf.empty()) buf.push_back(' ');
+            buf.append(name).append("='");
+            append_value(buf, value);
+            buf.push_back('\'');
+            return *this;
+        }
+        void clear() { buf.clear(); }
+        bool empty() const { return buf.empty(); }
+        std::string_view view() const { return buf; }
+        const std::string &str() const { return buf; }
+        operator std::string_view() const { return buf; }
+    };
+
     static std::string xmlstrip(const std::string &xml) {
         std::stringstream ret;
         for( char ch : xml){
@@ -287,82 +1690,184 @@ public:
         return ret.str();
     }
 
-    /** xmlmap turns a map into an XML block */
-    static std::string xmlmap(const strstrmap_t &m,const std::string &outer,const std::string &attrs) {
-        std::stringstream ss;
-        ss << "<" << outer;
-        if (attrs.size()>0) ss << " " << attrs;
-        ss << ">";
-        for(std::map<std::string,std::string>::const_iterator it=m.begin();it!=m.end();it++){
-            ss << "<" << (*it).first  << ">" << xmlescape((*it).second) << "</" << (*it).first << ">";
+    /** xmlmap turns a map into an XML block. Any map or sequence of pairs
+     * will do whose keys are tag names and whose values append_value() takes.
+     */
+    template<typename Map>
+    static void append_xmlmap(std::string &buf, const Map &m, std::string_view outer, std::string_view attrs) {
+        append_open(buf, outer, attrs);
+        for(const auto &it : m){
+            append_open(buf, it.first, "");
+            append_value(buf, it.second);
+            append_close(buf, it.first);
         }
-        ss << "</" << outer << ">";
-        return ss.str();
+        append_close(buf, outer);
+    }
+    /* A dfxml::file_object, as fiwalk writes it: filename, the other _tags, hashdigests
+     * and byte_runs. _tags entries named for the byte_run elements are skipped, because
+     * file_object_reader records those as tags too. The byte_runs' own _tags are not written.
+     */
+    template<typename T>
+    static void append_file_object(std::string &buf, tag_usage &used, const T &fo, size_t depth, bool oneline_) {
+        namespace tags = dfxml::tags;
+        std::string attr;               // reused for each element's attributes
+        auto element = [&](const tagref &tag, std::string_view value, size_t d) {
+            if (!oneline_) append_spaces(buf, d);
+            used.note(tag);
+            if (value.empty()) {
+                append_open(buf, tag, attr, true);
+            } else {
+                append_open(buf, tag, attr);
+                append_escaped(buf, value);
+                append_close(buf, tag);
+            }
+            if (!oneline_) buf.push_back('\n');
+        };
+        auto start = [&](const tagref &tag, size_t d) {
+            if (!oneline_) append_spaces(buf, d);
+            used.note(tag);
+            append_open(buf, tag, attr);
+            if (!oneline_) buf.push_back('\n');
+        };
+        auto end = [&](const tagref &tag, size_t d) {
+            if (!oneline_) append_spaces(buf, d);
+            append_close(buf, tag);
+            if (!oneline_) buf.push_back('\n');
+        };
+        auto hashdigests = [&](const strstrmap_t &h, size_t d) {
+            for (const auto &it : h) {
+                attr.assign("type='");
+                append_escaped(attr, it.first);
+                attr.push_back('\'');
+                element(tags::hashdigest, it.second, d);
+            }
+        };
+        auto number_attr = [&](std::string_view name, int64_t value) {
+            char nbuf[number_bufsize<int64_t>()];
+            if (!attr.empty()) attr.push_back(' ');
+            attr.append(name).append("='").append(nbuf, format_number(nbuf, sizeof(nbuf), value)).push_back('\'');
+        };
+
+        attr.clear();
+        start(tags::fileobject, depth);
+        auto fn = fo._tags.find("filename");
+        if (fn != fo._tags.end()) element(tags::filename, fn->second, depth+1);
+        for (const auto &it : fo._tags) {
+            const std::string &name = it.first;
+            if (name=="filename" || name=="byte_runs" || name=="byte_run" || name=="run" || name=="hashdigest") continue;
+            element(name, it.second, depth+1);
+        }
+        hashdigests(fo.hashdigest, depth+1);
+        attr.clear();
+        if (!fo.byte_runs.empty()) {
+            start(tags::byte_runs, depth+1);
+            for (const auto &run : fo.byte_runs) {
+                attr.clear();
+                number_attr("file_offset", run.file_offset);
+                number_attr("img_offset", run.img_offset);
+                number_attr("len", run.len);
+                if (run.sector_size) number_attr("sector_size", run.sector_size);
+                if (run.hashdigest.empty()) {
+                    element(tags::byte_run, "", depth+2);
+                    continue;
+                }
+                start(tags::byte_run, depth+2);
+                hashdigests(run.hashdigest, depth+3);
+                end(tags::byte_run, depth+2);
+            }
+            end(tags::byte_runs, depth+1);
+        }
+        end(tags::fileobject, depth);
+    }
+
+    static std::string xmlmap(const strstrmap_t &m, std::string_view outer, std::string_view attrs) {
+        std::string ret;
+        append_xmlmap(ret, m, outer, attrs);
+        return ret;
+    }
+    /* Writes xmlmap(m,outer,attrs) at the current position, without building it first */
+    void xmlout( const tagref &outer, const strstrmap_t &m, std::string_view attrs={}) { xmlout_map(outer, m, attrs); }
+    template<typename Map>
+    void xmlout_map( const tagref &outer, const Map &m, std::string_view attrs={}) {
+        const std::lock_guard<dfxml::stat_mutex> lock(M);
+        spaces();
+        tags.note(outer);
+        append_open(obuf, outer, attrs);
+        for(const auto &it : m){
+            tags.note(it.first);
+            append_open(obuf, it.first, "");
+            append_value(obuf, it.second);
+            append_close(obuf, it.first);
+        }
+        append_close(obuf, outer);
+        if (!oneline) obuf.push_back('\n');
+        flush_point();
     }
 
     void close() {                       // writes the output to the file
-        const std::lock_guard<std::mutex> lock(M);
+        const std::lock_guard<dfxml::stat_mutex> lock(M);
+        stop_async_locked();
+        flush_output();
+        if (!reorder_pending.empty()) {
+            throw std::runtime_error("dfxml: reorder buffer waiting for sequence " + std::to_string(reorder_next));
+        }
         if (!tag_stack.empty()) {
             std::cerr << "dfxml::close(): tag stack not empty!\n";
             while (!tag_stack.empty()){
-                auto it = tag_stack.top();
-                std::cerr << "   " << it << "\n";
-                tag_stack.pop();
+                std::cerr << "   " << tag_stack.back().get_name() << "\n";
+                tag_stack.pop_back();
             }
             throw std::runtime_error("dfxml: tag stack not empty.");
         }
-        outf.close();
-        if (make_dtd){
-            /* If we are making the DTD, then we should close the file,
-             * scan the output file for the tags, write to a temp file, and then
-             * close the temp file and have it overwrite the outfile.
-             */
-
-            std::ifstream in( tempfilename.c_str());
-            if (!in.is_open()){
-                std::cerr << tempfilename << strerror(errno) << ":Cannot re-open for input\n";
-                exit(1);
-            }
-            outf.open( outfilename.c_str(),std::ios_base::out);
-            if (!outf.is_open()){
-                std::cerr << outfilename << " " << strerror(errno)
-                          << ": Cannot open for output; will not delete " << tempfilename << "\n";
-                exit(1);
-            }
-            // copy over first line --- the XML header
-            std::string line;
-            getline(in,line);
-            outf << line;
-
-            write_dtd();                    // write the DTD
-            while(!in.eof()){
-                getline(in,line);
-                outf << line << std::endl;
-            }
-            in.close();
-            unlink( tempfilename.c_str());
-            outf.close();
+        if (sharding()) {
+            finish_shard();
+            write_manifest();
+            shard_policy = shard_policy_t();
+        } else {
+            finish_file();
         }
+        dtd_mode = DTD_NONE;            // close() may be called twice
+        if (!checkpoint_filename.empty()) std::filesystem::remove(checkpoint_filename); // the run is complete
     }
 
-    void flush(){ outf.flush(); }
-    void tagout( const std::string &tag, const std::string &attribute) {
-        verify_tag(tag);
-        *out << "<" << tag;
-        if (attribute.size()>0) *out << " " << attribute;
-        *out << ">";
+    /* Write everything so far and flush the sink. In async mode this waits
+     * for the writer thread to do so.
+     */
+    void flush(){
+        const std::lock_guard<dfxml::stat_mutex> lock(M);
+        flush_output();
+        if (aq) aq->wait_idle();
     }
-    void push( const std::string &tag, const std::string &attribute) {
+    void tagout( const tagref &tag, std::string_view attribute) {
+        tags.note(tag);
+        append_open(obuf, tag, attribute);
+    }
+    void push( const tagref &tag, std::string_view attribute) {
+        if (root_tag.empty() && tag_stack.empty()) {
+            root_tag = tag.name;
+            if (dtd_mode==DTD_EXTERNAL) append_doctype();
+        }
+        if (sharding()) {
+            if (is_fileobject(tag) && !in_fileobject(tag_stack)) shard_check();
+            tag_attributes.emplace_back(attribute);
+        }
         spaces();
-        tag_stack.push(tag);
+        if (index && !index_open && is_fileobject(tag)) { // hold obuf until pop()
+            index_open  = true;
+            index_depth = tag_stack.size();
+            index_begin = obuf.size();
+        }
+        tag_stack.emplace_back(tag);
         tagout(tag, attribute);
-        if (!oneline) *out << '\n';
+        if (!oneline) obuf.push_back('\n');
+        drain_if_full();
     }
-    void push( const std::string &tag) {push(tag,"");}
+    void push( const tagref &tag) {push(tag,"");}
 
     // writes a std::string as parsed data
-    void puts( const std::string &pdata) {
-        *out << pdata;
+    void puts( std::string_view pdata) {
+        obuf.append(pdata);
+        drain_if_full();
     }
 
     // writes a std::string as parsed data
@@ -376,14 +1881,14 @@ public:
         if (vasprintf(&ret,fmt,ap) < 0){
             throw std::runtime_error("dfxml_writer::xmlprintf");
         }
-        *out << ret;
+        obuf.append(ret);
         free(ret);
 #else
         char buf[65536];                // hope this is big enough
         if (vsnprintf(buf, sizeof(buf), fmt, ap) < 0 ){
             throw std::runtime_error("dfxml_writer::xmlprintf");
         }
-        *out << buf;
+        obuf.append(buf);
 #endif
 
         /** end printf to stream **/
@@ -395,57 +1900,73 @@ public:
     //
     // If an optional tag is provided, validate that it is at the top
     // of the stack
-    void pop(std::string close_tag="") {
+    void pop(std::string_view close_tag={}) {
         if (tag_stack.size()==0){
             std::cerr << "dfxml_writer::pop(" << close_tag << "): stack empty\n";
             throw std::runtime_error("dfxml: stack empty.");
         }
-        std::string tag = tag_stack.top();
-        if (close_tag!="" && tag!=close_tag) {
+        if (!close_tag.empty() && tag_stack.back().get_name()!=close_tag) {
             std::cerr << "dfxml_writer::pop: provided tag '" << close_tag
-                      << "' does not match top of stack '" << tag << "'\n";
+                      << "' does not match top of stack '" << tag_stack.back().get_name() << "'\n";
             throw std::runtime_error("dfxml: stack inconsistent.");
         }
+        if (tag_stack.size()==1 && final_reports) {
+            add_final_reports();        // before top is taken; they grow the stack
+        }
+        const open_tag &top = tag_stack.back();
+        const std::string &tag = top.get_name();
 
         spaces(-1);
-        tagout("/"+tag,"");
-        tag_stack.pop();
-        if (!oneline) *out << '\n';
-    }
-
-    void add_timestamp(const std::string &name) {
-        struct timeval t1, t;
-
-        // timestamp delta against t_last_timestamp
-        gettimeofday(&t1,0);
-        t.tv_sec = t1.tv_sec - t_last_timestamp.tv_sec;
-        if (t1.tv_usec > t_last_timestamp.tv_usec){
-            t.tv_usec = t1.tv_usec - t_last_timestamp.tv_usec;
-        } else {
-            t.tv_sec--;
-            t.tv_usec = (t1.tv_usec+1000000) - t_last_timestamp.tv_usec;
+        append_close(obuf, top.ref());
+        const bool indexed = (index_open && tag_stack.size()==index_depth+1);
+        if (indexed) {
+            index_add(std::string_view(obuf).substr(index_begin), file_bytes + index_begin);
+            index_open = false;
         }
-        char delta[16];
-        snprintf(delta, 16, "%d.%06d", (int)t.tv_sec, (int)t.tv_usec);
-
-        // reset t_last_timestamp for the next invocation
-        gettimeofday(&t_last_timestamp,0);
-
-        // timestamp total
-        t.tv_sec = t1.tv_sec - t0.tv_sec;
-        if (t1.tv_usec > t0.tv_usec){
-            t.tv_usec = t1.tv_usec - t0.tv_usec;
+        const bool flush_now = (flush_policy.mode==FLUSH_ON_POP && tag==flush_policy.tag);
+        const bool fileobject_done = (tag==dfxml::tags::fileobject.name());
+        if (sharding()) tag_attributes.pop_back();
+        tag_stack.pop_back();
+        if (fileobject_done && !in_fileobject(tag_stack)) count_fileobjects(1);
+        if (!oneline) obuf.push_back('\n');
+        if (flush_now) {
+            flush_output();
+        } else if (indexed) {
+            flush_point();              // the policy was held off while the fileobject was
         } else {
-            t.tv_sec--;
-            t.tv_usec = (t1.tv_usec+1000000) - t0.tv_usec;
+            drain_if_full();
         }
-        char total[16];
-        snprintf(total, 16, "%d.%06d", (int)t.tv_sec, (int)t.tv_usec);
+    }
 
-        // prepare attributes and add the timestamp
-        std::stringstream ss;
-        ss << "name='" << name << "' delta='" << delta << "' total='" << total << "'";
-        xmlout("timestamp", "",ss.str(), true);
+    static struct timeval to_timeval(std::chrono::steady_clock::duration d) {
+        const auto usec = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+        struct timeval t;
+        t.tv_sec  = usec / 1000000;
+        t.tv_usec = usec % 1000000;
+        return t;
+    }
+    /* Writes the time since the last timestamp and since the writer was made,
+     * on the steady clock. Spans give nested timings; see add_profile().
+     */
+    void add_timestamp(const std::string &name) {
+        const steady_time_t t1 = std::chrono::steady_clock::now();
+        char delta[32];
+        const size_t delta_len = format_timeval(delta, sizeof(delta), to_timeval(t1 - t_last_timestamp));
+        char total[32];
+        const size_t total_len = format_timeval(total, sizeof(total), to_timeval(t1 - t0));
+        t_last_timestamp = t1;
+
+        // write <timestamp name='...' delta='...' total='...'/>
+        const std::lock_guard<dfxml::stat_mutex> lock(M);
+        spaces();
+        tags.note("timestamp");
+        obuf.append("<timestamp name='");
+        append_escaped(obuf, name);
+        obuf.append("' delta='").append(delta, delta_len);
+        obuf.append("' total='").append(total, total_len);
+        obuf.append("'/>");
+        if (!oneline) obuf.push_back('\n');
+        flush_point();
     }
     void add_DFXML_build_environment() {
         /* __DATE__ formats as: Apr 30 2011 */
@@ -554,17 +2075,233 @@ public:
         pop();                      // <execution_environment>
     }
     void set_oneline(bool v) {
-        const std::lock_guard<std::mutex> lock(M);
-        if(v==oneline) return;          // nothing to do
+        const std::lock_guard<dfxml::stat_mutex> lock(M);
+        if(v==oneline || compact) return; // nothing to do
         if (v){
             spaces();
         } else {
-            *out << "\n";
+            obuf.push_back('\n');
         }
         oneline = v;
     }
+    /* Compact output has no indentation, line breaks or other whitespace
+     * between elements, except the line break after the XML declaration,
+     * and ignores set_oneline() until it is turned off.
+     */
+    void set_compact(bool v=true) {
+        const std::lock_guard<dfxml::stat_mutex> lock(M);
+        if (v==compact) return;
+        if (!v) obuf.push_back('\n');
+        compact = v;
+        oneline = v;
+    }
+    bool get_compact() const { return compact; }
 
     const std::filesystem::path &get_outfilename() const {return outfilename; } ;
+    std::filesystem::path get_dtd_filename() const {
+        return std::filesystem::path(outfilename).replace_extension(".dtd");
+    }
+
+    /* Shard n of out.xml is out.nnnnn.xml; the manifest is out.manifest.xml.
+     * Call before the first push(). The factory opens each shard; by default
+     * make_file_sink(), which compresses shards named .gz or .zst.
+     */
+    void set_sharding(const shard_policy_t &policy, sink_factory_t factory={}) {
+        const std::lock_guard<dfxml::stat_mutex> lock(M);
+        if (outfilename.empty()) {
+            throw std::runtime_error("dfxml_writer::set_sharding: output is not a file");
+        }
+        if (!root_tag.empty() || !tag_stack.empty()) {
+            throw std::runtime_error("dfxml_writer::set_sharding: output already started");
+        }
+        if (policy.fileobjects==0 && policy.bytes==0) {
+            throw std::runtime_error("dfxml_writer::set_sharding: no limit given");
+        }
+        shard_policy  = policy;
+        shard_factory = factory ? factory : [](const std::filesystem::path &p) { return dfxml::make_file_sink(p); };
+        // out.xml.gz has shards out.nnnnn.xml.gz
+        std::filesystem::path fname = outfilename.filename();
+        shard_ext = fname.extension().string();
+        fname.replace_extension();
+        if ((shard_ext==".gz" || shard_ext==".zst") && fname.has_extension()) {
+            shard_ext = fname.extension().string() + shard_ext;
+            fname.replace_extension();
+        }
+        shard_base = outfilename.parent_path() / fname;
+
+        // nothing has been written to outfilename yet; start over in the first shard
+        const bool async = (aq!=nullptr);
+        stop_async_locked();
+        out->close();
+        std::filesystem::remove(outfilename);
+        if (index) {
+            index->close(0);
+            std::filesystem::remove(index->path());
+            index.reset();
+        }
+        obuf.clear();
+        file_bytes = 0;
+        open_shard(0);
+        if (async) start_queue(async_capacity, async_backpressure);
+    }
+    std::filesystem::path get_manifest_filename() const {
+        return shard_base.string() + ".manifest.xml";
+    }
+    const std::vector<shard_t> &get_shards() const { return shards; }
+
+    /* Write get_index_filename(), a dfxml::index_writer record for each top-level
+     * <fileobject>. Call before the first push(); with sharding, each shard
+     * gets its own index. Fragments created afterwards record their fileobjects.
+     */
+    void set_index() {
+        const std::lock_guard<dfxml::stat_mutex> lock(M);
+        if (outfilename.empty()) {
+            throw std::runtime_error("dfxml_writer::set_index: output is not a file");
+        }
+        if (!root_tag.empty() || !tag_stack.empty()) {
+            throw std::runtime_error("dfxml_writer::set_index: output already started");
+        }
+        indexing = true;
+        open_index();
+    }
+    std::filesystem::path get_index_filename() const {
+        return outfilename.string() + ".idx";
+    }
+
+    /* Checkpoints.
+     * checkpoint() makes the output durable up to this point and saves what is
+     * needed to carry on from it in get_checkpoint_filename(): the length of the
+     * output, the open elements, the index and shard state, and the caller's
+     * resume token. After a crash, resume() truncates the output to that length
+     * and returns a writer that continues from the checkpoint; it returns the
+     * token so the producer knows where to restart. Fragments still waiting in
+     * the reorder buffer are not part of a checkpoint; ordered commits resume
+     * at the first sequence number that was not written. Compressed output
+     * cannot be truncated and extended, so it cannot be checkpointed.
+     * close() removes the checkpoint file.
+     */
+    void checkpoint(std::string_view token) {
+        const std::lock_guard<dfxml::stat_mutex> lock(M);
+        if (checkpoint_filename.empty()) {
+            throw std::runtime_error("dfxml_writer::checkpoint: output is not a file");
+        }
+        if (index_open) {
+            throw std::runtime_error("dfxml_writer::checkpoint: inside an indexed fileobject");
+        }
+        if (capturing) {
+            throw std::runtime_error("dfxml_writer::checkpoint: inside the creator block");
+        }
+        const bool async = (aq!=nullptr);
+        stop_async_locked();
+        flush_output();
+        out->sync();
+        const uint64_t file_size = std::filesystem::file_size(outfilename);
+        if (well_formed ? file_size < file_bytes : file_size!=file_bytes) { // the trailer follows file_bytes
+            throw std::runtime_error(outfilename.string() + ": length does not match the bytes written");
+        }
+        if (index) {
+            index->flush();
+            dfxml::sync_file(index->path());
+        }
+
+        std::string cp;
+        put_record(cp, "dfxml_checkpoint", "1");
+        put_record(cp, "file", outfilename.string());
+        put_record(cp, "length", file_bytes);
+        put_record(cp, "root_tag", root_tag);
+        put_record(cp, "dtd_mode", (uint64_t)dtd_mode);
+        put_record(cp, "dtd_reserve", dtd_reserve);
+        put_record(cp, "oneline", oneline);
+        put_record(cp, "compact", compact);
+        put_record(cp, "well_formed", well_formed);
+        for (size_t i=0; i<tag_stack.size(); i++) {
+            put_record(cp, "tag", tag_stack[i].get_name());
+            if (sharding()) put_record(cp, "attribute", tag_attributes[i]);
+        }
+        for (const auto &it : tags.names()) put_record(cp, "used", it);
+        put_record(cp, "creator", creator_block);
+        put_record(cp, "creator_depth", creator_depth);
+        put_record(cp, "fileobjects", fileobject_count);
+        put_record(cp, "reorder_next", reorder_next);
+        if (index) {
+            put_record(cp, "index_ordinal", index_ordinal);
+            put_record(cp, "index_count", index->count());
+        }
+        if (sharding()) {
+            put_record(cp, "shard_policy_fileobjects", shard_policy.fileobjects);
+            put_record(cp, "shard_policy_bytes", shard_policy.bytes);
+            put_record(cp, "shard_base", shard_base.string());
+            put_record(cp, "shard_ext", shard_ext);
+            put_record(cp, "shard_fileobjects", shard_fileobjects);
+            for (const auto &it : shards) {
+                put_record(cp, "shard", it.filename.string());
+                put_record(cp, "shard_done_fileobjects", it.fileobjects);
+                put_record(cp, "shard_done_bytes", it.bytes);
+            }
+        }
+        put_record(cp, "token", token);
+
+        // replace the previous checkpoint atomically
+        const std::filesystem::path tmp = checkpoint_filename.string() + ".tmp";
+        {
+            std::ofstream os(tmp, std::ios::binary);
+            os << cp;
+            os.close();
+            if (os.fail()) throw std::runtime_error(tmp.string() + ": cannot write checkpoint");
+        }
+        dfxml::sync_file(tmp);
+        std::filesystem::rename(tmp, checkpoint_filename);
+        dfxml::sync_file(std::filesystem::absolute(checkpoint_filename).parent_path());
+
+        checkpoint_fileobjects = fileobject_count;
+        t_last_checkpoint = std::chrono::steady_clock::now();
+        if (async) start_queue(async_capacity, async_backpressure);
+    }
+    /* Continue the output fname from its last checkpoint. The flush policy and
+     * async mode are not part of a checkpoint; set them again. Later shards are
+     * opened with make_file_sink().
+     */
+    static std::unique_ptr<dfxml_writer> resume(const std::filesystem::path &fname, std::string *token=nullptr) {
+        const std::filesystem::path cpname = fname.string() + ".checkpoint";
+        const record_list_t records = read_records(cpname);
+        const std::filesystem::path file = get_record(records, "file");
+        const uint64_t length = std::stoull(get_record(records, "length"));
+        if (!std::filesystem::exists(file) || std::filesystem::file_size(file) < length) {
+            throw std::runtime_error(file.string() + ": shorter than its checkpoint");
+        }
+        std::filesystem::resize_file(file, length);
+        auto w = std::make_unique<dfxml_writer>(std::make_unique<dfxml::file_sink>(file, true), DTD_NONE, 0);
+        w->restore(records);
+        w->checkpoint_filename = cpname;
+        if (w->well_formed) w->flush_output(); // the file was cut before its trailer
+        if (token) *token = get_record(records, "token");
+        return w;
+    }
+    std::filesystem::path get_checkpoint_filename() const { return checkpoint_filename; }
+
+    /* checkpoint_due() is true once sec seconds or fileobjects fileobjects
+     * have passed since the last checkpoint; 0 turns either test off.
+     */
+    void set_checkpoint_interval(unsigned int sec, uint64_t fileobjects=0) {
+        const std::lock_guard<dfxml::stat_mutex> lock(M);
+        checkpoint_sec   = sec;
+        checkpoint_every = fileobjects;
+    }
+    bool checkpoint_due() {
+        const std::lock_guard<dfxml::stat_mutex> lock(M);
+        return (checkpoint_every>0 && get_fileobject_count_locked() - checkpoint_fileobjects >= checkpoint_every)
+            || (checkpoint_sec>0 && std::chrono::steady_clock::now() - t_last_checkpoint >= std::chrono::seconds(checkpoint_sec));
+    }
+    uint64_t get_fileobject_count() {
+        const std::lock_guard<dfxml::stat_mutex> lock(M);
+        return get_fileobject_count_locked();
+    }
+
+    // current nesting depth of the tag stack
+    size_t depth() {
+        const std::lock_guard<dfxml::stat_mutex> lock(M);
+        return tag_stack.size();
+    }
 
     /********************************
      *** THESE ARE ALL THREADSAFE ***
@@ -601,35 +2338,26 @@ public:
             xmlout("inblock",(long)ru.ru_inblock);
             xmlout("oublock",(long)ru.ru_oublock);
 
-            struct timeval t1;
-            gettimeofday(&t1,0);
-            struct timeval t;
-
-            t.tv_sec = t1.tv_sec - t0.tv_sec;
-            if (t1.tv_usec > t0.tv_usec){
-                t.tv_usec = t1.tv_usec - t0.tv_usec;
-            } else {
-                t.tv_sec--;
-                t.tv_usec = (t1.tv_usec+1000000) - t0.tv_usec;
-            }
-            xmlout("clocktime",t);
+            xmlout("clocktime",to_timeval(std::chrono::steady_clock::now() - t0));
             pop();
         }
 #endif
+        if (perf) add_perf_counters(*perf, perf->read(), "scope='process'");
     }
 
     /***************************************
      *** ALL THAT FOLLOWS ARE THREADSAFE ***
      ***************************************/
-    /* Ignores oneline */
-    void comment(const std::string &comment) {
-        const std::lock_guard<std::mutex> lock(M);
-        *out << "<!-- " << comment << " -->\n";
-        out->flush();
+    /* Ignores oneline, but not compact */
+    void comment(std::string_view comment) {
+        const std::lock_guard<dfxml::stat_mutex> lock(M);
+        obuf.append("<!-- ").append(comment).append(" -->");
+        if (!compact) obuf.push_back('\n');
+        flush_point();
     }
-    void xmlprintf(const std::string &tag,const std::string &attribute,const char *fmt,...) __attribute__((format(printf, 4, 5))) {
+    void xmlprintf(const tagref &tag,std::string_view attribute,const char *fmt,...) __attribute__((format(printf, 4, 5))) {
         // "4" because this is "1";
-        const std::lock_guard<std::mutex> lock(M);
+        const std::lock_guard<dfxml::stat_mutex> lock(M);
         spaces();
         tagout(tag, attribute);
         va_list ap;
@@ -641,88 +2369,671 @@ public:
         if (vasprintf(&ret,fmt,ap) < 0){
             throw std::runtime_error("dfxml_writer::xmlprintf ");
         }
-        *out << ret;
+        obuf.append(ret);
         free(ret);
 #else
         char buf[65536];
         if (vsnprintf(buf, sizeof(buf), fmt, ap) < 0){
             throw std::runtime_error("dfxml_writer::xmlprintf");
         }
-        *out << buf;
+        obuf.append(buf);
 #endif
         /** end printf to stream **/
 
         va_end(ap);
-        tagout("/"+tag,"");
-        if (!oneline) *out << '\n';
-        out->flush();
+        append_close(obuf, tag);
+        if (!oneline) obuf.push_back('\n');
+        flush_point();
     }
     /* All of the xmlout( calls eventually end up here. */
-    void xmlout( const std::string &tag,const std::string &value, const std::string &attribute, const bool escape_value) {
-        const std::lock_guard<std::mutex> lock(M);
+    void xmlout( const tagref &tag,std::string_view value, std::string_view attribute, const bool escape_value) {
+        const std::lock_guard<dfxml::stat_mutex> lock(M);
         spaces();
         if (value.size()==0){
-            if (tag.size()) tagout(tag,attribute+"/");
+            if (tag.name.size()) {
+                tags.note(tag);
+                append_open(obuf, tag, attribute, true);
+            }
         } else {
-            if (tag.size()) tagout(tag,attribute);
-            *out << (escape_value ? xmlescape(value) : value);
-            if (tag.size()) tagout("/"+tag,"");
+            if (tag.name.size()) tagout(tag,attribute);
+            if (escape_value) {
+                append_escaped(obuf, value);
+            } else {
+                obuf.append(value);
+            }
+            if (tag.name.size()) append_close(obuf, tag);
         }
-        if (!oneline) *out << "\n";
-        out->flush();
+        if (!oneline) obuf.push_back('\n');
+        flush_point();
     }
 
-    /* These all call xmlout or xmlprintf which already has locking, so these are all threadsafe! */
-    void xmlout( const std::string &tag,const std::string &value )       { xmlout(tag,value,"",true); }
-    void xmlout( const std::string &tag,const char *value )              { xmlout(tag,std::string(value),"",true); }
-    void xmlout( const std::string &tag,const std::filesystem::path &value) { xmlout(tag, value.string(), "", true); }
-#ifndef __MINGW32__
-    void xmlout( const std::string &tag,const signed char value )        { xmlprintf(tag,"","%hhd",value); }
-#endif
-    void xmlout( const std::string &tag,const short value )              { xmlprintf(tag,"","%hd", value); }
-    void xmlout( const std::string &tag,const int value )                { xmlprintf(tag,"","%d",  value); }
-    void xmlout( const std::string &tag,const long value )               { xmlprintf(tag,"","%ld", value); }
-#ifndef __MINGW32__
-    void xmlout( const std::string &tag,const long long value )          { xmlprintf(tag,"","%lld",value); }
-#else
-    void xmlout( const std::string &tag,const long long value )          { xmlprintf(tag,"","%I64d",value); }
-#endif
-#ifndef __MINGW32__
-    void xmlout( const std::string &tag,const unsigned char value )      { xmlprintf(tag,"","%hhu",value); }
-#else
-    void xmlout( const std::string &tag,const unsigned char value )      { xmlprintf(tag,"","%hu",value); }
-#endif
-    void xmlout( const std::string &tag,const unsigned short value )     { xmlprintf(tag,"","%hu", value); }
-    void xmlout( const std::string &tag,const unsigned int value )       { xmlprintf(tag,"","%u",  value); }
-    void xmlout( const std::string &tag,const unsigned long value )      { xmlprintf(tag,"","%lu", value); }
+    /* Numbers and timevals are formatted on the stack and written with one lock */
+    void xmlout_formatted( const tagref &tag, const char *value, size_t len) {
+        const std::lock_guard<dfxml::stat_mutex> lock(M);
+        spaces();
+        tagout(tag,"");
+        obuf.append(value,len);
+        append_close(obuf, tag);
+        if (!oneline) obuf.push_back('\n');
+        flush_point();
+    }
+    template<typename T>
+    void xmlout_number( const tagref &tag, const T value) {
+        char buf[number_bufsize<T>()];
+        xmlout_formatted(tag, buf, format_number(buf, sizeof(buf), value));
+    }
+
+    /* These all call xmlout or xmlout_formatted which already has locking, so these are all threadsafe! */
+    void xmlout( const tagref &tag,const std::string &value )       { xmlout(tag,std::string_view(value),"",true); }
+    void xmlout( const tagref &tag,const char *value )              { xmlout(tag,std::string_view(value),"",true); }
+    void xmlout( const tagref &tag,std::string_view value )         { xmlout(tag,value,"",true); }
+    void xmlout( const tagref &tag,const std::filesystem::path &value) { xmlout(tag, value.string(), "", true); }
 #ifndef __MINGW32__
-    void xmlout( const std::string &tag,const unsigned long long value ) { xmlprintf(tag,"","%llu",value); }
-#else
-    void xmlout( const std::string &tag,const unsigned long long value ) { xmlprintf(tag,"","%I64u",value); }
+    void xmlout( const tagref &tag,const signed char value )        { xmlout_number(tag,value); }
 #endif
-    void xmlout( const std::string &tag,const double value )             { xmlprintf(tag,"","%f",value); }
-    void xmlout( const std::string &tag,const struct timeval &ts) {
-        xmlprintf(tag,"","%d.%06d",(int)ts.tv_sec, (int)ts.tv_usec);
+    void xmlout( const tagref &tag,const short value )              { xmlout_number(tag,value); }
+    void xmlout( const tagref &tag,const int value )                { xmlout_number(tag,value); }
+    void xmlout( const tagref &tag,const long value )               { xmlout_number(tag,value); }
+    void xmlout( const tagref &tag,const long long value )          { xmlout_number(tag,value); }
+    void xmlout( const tagref &tag,const unsigned char value )      { xmlout_number(tag,value); }
+    void xmlout( const tagref &tag,const unsigned short value )     { xmlout_number(tag,value); }
+    void xmlout( const tagref &tag,const unsigned int value )       { xmlout_number(tag,value); }
+    void xmlout( const tagref &tag,const unsigned long value )      { xmlout_number(tag,value); }
+    void xmlout( const tagref &tag,const unsigned long long value ) { xmlout_number(tag,value); }
+    void xmlout( const tagref &tag,const double value )             { xmlout_number(tag,value); }
+    void xmlout( const tagref &tag,const struct timeval &ts) {
+        char buf[32];
+        xmlout_formatted(tag, buf, format_timeval(buf, sizeof(buf), ts));
     }
-    static std::string to8601(const struct timeval &ts) {
+
+    /* A fragment is a complete subtree, such as a <fileobject>, that one thread
+     * builds without locking and then hands to the writer with commit(), which
+     * takes the lock once. Indentation is taken from the writer's depth when the
+     * fragment is created. A fragment can be reused after it is committed:
+     *
+     *   dfxml_writer::fragment f(dw);
+     *   f.push("fileobject");
+     *   f.xmlout("filename",name);
+     *   f.xmlout("filesize",size);
+     *   f.pop();
+     *   dw.commit(f);
+     */
+    class fragment {
+        friend class dfxml_writer;
+        std::string    buf {};
+        tag_stack_t    tag_stack {};
+        tag_usage      tags {};         // merged into the writer's tags on commit
+        size_t         depth0 {0};      // writer depth at creation
+        size_t         fileobjects {0}; // for sharding
+        span_list_t    spans {};        // for the index
+        bool           indexed {false};
+        bool           oneline {false};
+
+        void spaces() {
+            if (!oneline) append_spaces(buf, depth0+tag_stack.size());
+        }
+        void tagout(const tagref &tag, std::string_view attribute, bool empty_element=false) {
+            tags.note(tag);
+            append_open(buf, tag, attribute, empty_element);
+        }
+        void formatted(const tagref &tag, const char *value, size_t len) {
+            spaces();
+            tagout(tag,"");
+            buf.append(value,len);
+            append_close(buf, tag);
+            if (!oneline) buf.push_back('\n');
+        }
+    public:
+        explicit fragment(dfxml_writer &w) {
+            const std::lock_guard<dfxml::stat_mutex> lock(w.M);
+            depth0  = w.tag_stack.size();
+            oneline = w.oneline;
+            indexed = w.indexing;
+        }
+        void push(const tagref &tag, std::string_view attribute={}) {
+            const bool top_fileobject = is_fileobject(tag) && !in_fileobject(tag_stack);
+            if (top_fileobject) fileobjects++;
+            spaces();
+            if (indexed && top_fileobject) spans.emplace_back(buf.size(), 0);
+            tag_stack.emplace_back(tag);
+            tagout(tag, attribute);
+            if (!oneline) buf.push_back('\n');
+        }
+        void pop(std::string_view close_tag={}) {
+            if (tag_stack.empty()) {
+                throw std::runtime_error("dfxml: fragment stack empty.");
+            }
+            if (!close_tag.empty() && tag_stack.back().get_name()!=close_tag) {
+                throw std::runtime_error("dfxml: fragment stack inconsistent.");
+            }
+            const open_tag top = tag_stack.back();
+            tag_stack.pop_back();
+            spaces();
+            append_close(buf, top.ref());
+            if (indexed && is_fileobject(top.ref()) && !in_fileobject(tag_stack)) spans.back().second = buf.size();
+            if (!oneline) buf.push_back('\n');
+        }
+        void puts(std::string_view pdata) { buf.append(pdata); }
+        void xmlout(const tagref &tag, std::string_view value, std::string_view attribute, const bool escape_value) {
+            spaces();
+            if (value.size()==0){
+                if (tag.name.size()) tagout(tag,attribute,true);
+            } else {
+                if (tag.name.size()) tagout(tag,attribute);
+                if (escape_value) {
+                    append_escaped(buf, value);
+                } else {
+                    buf.append(value);
+                }
+                if (tag.name.size()) append_close(buf, tag);
+            }
+            if (!oneline) buf.push_back('\n');
+        }
+        void xmlout(const tagref &tag, const std::string &value) { xmlout(tag,std::string_view(value),"",true); }
+        void xmlout(const tagref &tag, const char *value)        { xmlout(tag,std::string_view(value),"",true); }
+        void xmlout(const tagref &tag, std::string_view value)   { xmlout(tag,value,"",true); }
+        void xmlout(const tagref &tag, const std::filesystem::path &value) { xmlout(tag,value.string(),"",true); }
+        void xmlout(const tagref &tag, const struct timeval &ts) {
+            char tbuf[32];
+            formatted(tag, tbuf, format_timeval(tbuf, sizeof(tbuf), ts));
+        }
+        /* integers and doubles; formatted as the writer's xmlout overloads do */
+        template<typename T, typename = std::enable_if_t<std::is_arithmetic_v<T>>>
+        void xmlout(const tagref &tag, const T value) {
+            char nbuf[number_bufsize<T>()];
+            formatted(tag, nbuf, format_number(nbuf, sizeof(nbuf), value));
+        }
+
+        template<typename T, typename = std::enable_if_t<std::is_same_v<T, dfxml::file_object>>>
+        void write(const T &fo) {
+            const size_t start = buf.size();
+            append_file_object(buf, tags, fo, depth0+tag_stack.size(), oneline);
+            if (in_fileobject(tag_stack)) return; // only top-level fileobjects are counted and indexed
+            fileobjects++;
+            if (indexed) spans.push_back(element_span(buf, start));
+        }
+
+        const std::string &str() const { return buf; }
+        bool   empty() const { return buf.empty(); }
+        void   clear() {                // keeps the buffer's capacity for reuse
+            buf.clear();
+            tags.clear();
+            tag_stack.clear();
+            fileobjects = 0;
+            spans.clear();
+        }
+    };
+
+    /* Write a whole <fileobject> under one lock. This is a template so that
+     * dfxml_reader.h is needed only by callers that use it.
+     */
+    template<typename T, typename = std::enable_if_t<std::is_same_v<T, dfxml::file_object>>>
+    void write(const T &fo) {
+        const std::lock_guard<dfxml::stat_mutex> lock(M);
+        shard_check();
+        const size_t start = obuf.size();
+        append_file_object(obuf, tags, fo, tag_stack.size(), oneline);
+        if (index) {
+            const std::pair<size_t,size_t> span = element_span(obuf, start);
+            index_add(std::string_view(obuf).substr(span.first, span.second-span.first), file_bytes + span.first);
+        }
+        count_fileobjects(1);
+        if (flush_policy.mode==FLUSH_ON_POP && flush_policy.tag==dfxml::tags::fileobject.name()) {
+            flush_output();
+        } else {
+            flush_point();
+        }
+    }
+
+    /* Write a completed fragment and clear it for reuse */
+    void commit(fragment &f) {
+        if (!f.tag_stack.empty()) {
+            throw std::runtime_error("dfxml_writer::commit: fragment has unclosed tag " + f.tag_stack.back().get_name());
+        }
+        bool merged = false;
+        if (aq_live.load() && !sharding() && !index) { // a shard rollover or the index needs the lock
+            if (dtd_mode!=DTD_NONE) {   // tags are only needed for the DTD
+                const std::lock_guard<dfxml::stat_mutex> lock(M);
+                tags.merge(f.tags);
+                merged = true;
+            }
+            aq_inflight.fetch_add(1);   // not holding M: stop_async_locked() waits for this with M held
+            if (async_queue *q = aq_live.load()) {
+                bool flush = (flush_policy.mode==FLUSH_ALWAYS) ||
+                    (flush_policy.mode==FLUSH_ON_POP && f.tags.contains(flush_policy.tag, flush_tag_id));
+                if (q->push(f.buf, flush, true)) {
+                    if (!merged) async_elements.fetch_add(f.tags.elements(), std::memory_order_relaxed);
+                    async_bytes.fetch_add(f.buf.size(), std::memory_order_relaxed);
+                    async_fileobjects.fetch_add(f.fileobjects, std::memory_order_relaxed);
+                } else if (merged) {    // dropped; its tags stay for the DTD but its elements don't count
+                    async_elements.fetch_sub(f.tags.elements(), std::memory_order_relaxed);
+                }
+                aq_inflight.fetch_sub(1);
+                f.clear();
+                return;
+            }
+            aq_inflight.fetch_sub(1);   // stopped meanwhile; write it synchronously
+        }
+        const std::lock_guard<dfxml::stat_mutex> lock(M);
+        if (!merged) tags.merge(f.tags);
+        if (f.fileobjects) shard_check();
+        if (index) index_spans(f.buf, f.spans);
+        obuf.append(f.buf);
+        count_fileobjects(f.fileobjects);
+        if (flush_policy.mode==FLUSH_ON_POP && f.tags.contains(flush_policy.tag, flush_tag_id)) {
+            flush_output();
+        } else {
+            flush_point();
+        }
+        f.clear();
+    }
+
+    /* Set the first sequence number and the reorder buffer's bounds.
+     * BLOCK cannot deadlock as long as each producer commits its own sequence
+     * numbers in increasing order: the fragment that fills the gap never waits.
+     * Every sequence number must be committed or skipped before the enclosing
+     * element is popped.
+     */
+    void   set_reorder(uint64_t first_seq) { set_reorder(first_seq, reorder_policy_t()); }
+    void   set_reorder(uint64_t first_seq, const reorder_policy_t &policy) {
+        const std::lock_guard<dfxml::stat_mutex> lock(M);
+        if (!reorder_pending.empty()) {
+            throw std::runtime_error("dfxml_writer::set_reorder: reorder buffer not empty");
+        }
+        reorder_next   = first_seq;
+        reorder_policy = policy;
+    }
+    reorder_stats_t get_reorder_stats() {
+        const std::lock_guard<dfxml::stat_mutex> lock(M);
+        return reorder_stats;
+    }
+
+    /* Write a completed fragment in sequence order and clear it for reuse */
+    void commit(fragment &f, uint64_t seq) {
+        if (!f.tag_stack.empty()) {
+            throw std::runtime_error("dfxml_writer::commit: fragment has unclosed tag " + f.tag_stack.back().get_name());
+        }
+        std::unique_lock<dfxml::stat_mutex> lock(M);
+        const bool late = reorder_admit(lock, seq, f.buf.size());
+        tags.merge(f.tags);
+        const bool flush = flush_policy.mode==FLUSH_ON_POP && f.tags.contains(flush_policy.tag, flush_tag_id);
+        reorder_stats.committed++;
+        if (late) {
+            if (f.fileobjects) shard_check();
+            if (index) index_spans(f.buf, f.spans);
+            obuf.append(f.buf);
+            count_fileobjects(f.fileobjects);
+            if (flush) flush_output(); else flush_point();
+            f.clear();
+            return;
+        }
+        reorder_entry &e = reorder_pending[seq];
+        e.buf.swap(f.buf);
+        e.flush = flush;
+        e.fileobjects = f.fileobjects;
+        e.spans.swap(f.spans);
+        if (!reorder_spare.empty()) {   // give the fragment a buffer that has capacity
+            f.buf.swap(reorder_spare.back());
+            reorder_spare.pop_back();
+        }
+        f.clear();
+        reorder_bytes += e.buf.size();
+        reorder_insert_done(seq);
+    }
+    /* A sequence number that will never be committed, such as a file that was skipped */
+    void skip_sequence(uint64_t seq) {
+        std::unique_lock<dfxml::stat_mutex> lock(M);
+        reorder_stats.skipped++;
+        if (reorder_admit(lock, seq, 0)) return;
+        reorder_pending[seq];
+        reorder_insert_done(seq);
+    }
+    // writes the non-empty buckets of st's histogram
+    void add_histogram(const dfxml::phase_stats &st) {
+        push("histogram");
+        attribute_list attrs;
+        for (size_t i=0; i<st.buckets; i++) {
+            if (st.histogram[i]==0) continue;
+            attrs.clear();
+            xmlout("bucket", "", attrs.add("ns", i ? 1ULL<<i : 0ULL).add("count", st.histogram[i]), false);
+        }
+        pop();
+    }
+
+    /* Throughput and lock statistics. The counts of elements, bytes and
+     * flushes are always kept. After set_writer_stats(true) the writer's lock
+     * also counts its acquisitions, times each one that had to wait and times
+     * one hold in dfxml::stat_mutex::hold_sample.
+     */
+    void set_writer_stats(bool on=true) { M.set_stats(on); }
+    writer_stats_t get_writer_stats() {
+        writer_stats_t st;
+        const dfxml::stat_mutex::stats_t ls = M.get_stats();
+        st.lock_acquisitions = ls.acquisitions;
+        st.lock_wait         = ls.wait;
+        st.lock_hold         = ls.hold;
+        const std::lock_guard<dfxml::stat_mutex> lock(M);
+        st.elements    = tags.elements() + async_elements.load(std::memory_order_relaxed);
+        st.bytes       = bytes_written + async_bytes.load() + obuf.size();
+        st.flushes     = flush_count;
+        st.fileobjects = get_fileobject_count_locked();
+        st.elapsed     = std::chrono::steady_clock::now() - t0;
+        return st;
+    }
+    void add_writer_stats() {
+        const writer_stats_t st = get_writer_stats();
+        const double sec = std::chrono::duration<double>(st.elapsed).count();
+        push("writer_stats");
+        xmlout("elements",    st.elements);
+        xmlout("bytes",       st.bytes);
+        xmlout("flushes",     st.flushes);
+        xmlout("fileobjects", st.fileobjects);
+        xmlout("clocktime",   to_timeval(st.elapsed));
+        if (sec>0) {
+            xmlout("elements_per_sec", (uint64_t)(st.elements / sec));
+            xmlout("bytes_per_sec",    (uint64_t)(st.bytes / sec));
+        }
+        if (st.lock_acquisitions>0) {
+            push("lock", attribute_list().add("acquisitions", st.lock_acquisitions)
+                 .add("contended", st.lock_wait.count).add("wait_ns", st.lock_wait.total_ns));
+            const std::pair<const char *, const dfxml::phase_stats *> timings[] = {
+                {"wait", &st.lock_wait}, {"hold", &st.lock_hold}};
+            for (const auto &it : timings) {
+                const dfxml::phase_stats &t = *it.second;
+                attribute_list attrs;
+                attrs.add("count", t.count);
+                if (it.second==&st.lock_hold) attrs.add("sampled", dfxml::stat_mutex::hold_sample);
+                if (t.count==0) {
+                    xmlout(it.first, "", attrs, false);
+                    continue;
+                }
+                push(it.first, attrs.add("total_ns", t.total_ns).add("min_ns", t.min_ns).add("max_ns", t.max_ns));
+                add_histogram(t);
+                pop();
+            }
+            pop();
+        }
+        pop();
+    }
+
+    /* Timing spans. A span times its scope and nests inside the spans open on
+     * its thread:
+     *     auto s = dw.span("hash");
+     * add_profile() writes what they recorded.
+     */
+    dfxml::profiler &get_profiler() { return prof; }
+    dfxml::profiler::span span(std::string_view name) { return dfxml::profiler::span(prof, name); }
+    // writes <profile>, with a <span> per phase nested as the spans were
+    void add_profile() {
+        const dfxml::profiler::phase_map_t phases = prof.phases();
+        push("profile", attribute_list().add("clock", "steady_clock").add("threads", prof.thread_count()));
+        std::vector<std::string_view> open;        // names of the <span>s open
+        for (const auto &it : phases) {
+            std::vector<std::string_view> names;
+            for (size_t b=0, e; b<=it.first.size(); b=e+1) {
+                e = std::min(it.first.find('/', b), it.first.size());
+                names.emplace_back(it.first.data()+b, e-b);
+            }
+            size_t common = 0;
+            while (common<open.size() && common+1<names.size() && open[common]==names[common]) common++;
+            for (; open.size()>common; open.pop_back()) pop();
+            attribute_list attrs;
+            for (; open.size()+1<names.size(); open.push_back(names[open.size()])) { // a parent still running
+                attrs.clear();
+                push("span", attrs.add("name", names[open.size()]));
+            }
+            const dfxml::phase_stats &st = it.second;
+            attrs.clear();
+            attrs.add("name", names.back()).add("count", st.count).add("total_ns", st.total_ns)
+                .add("min_ns", st.min_ns).add("max_ns", st.max_ns).add("threads", st.threads);
+            if (st.perf_count>0) {      // summed over the spans on registered threads
+                attrs.add("perf_spans", st.perf_count);
+                for (size_t i=0; i<dfxml::PERF_EVENTS; i++) {
+                    if (st.perf_mask & (1U<<i)) attrs.add(dfxml::perf_event_name(i), st.perf[i]);
+                }
+            }
+            push("span", attrs);
+            open.push_back(names.back());
+            add_histogram(st);
+        }
+        for (; !open.empty(); open.pop_back()) pop();
+        pop();
+    }
+    /* Hardware performance counters. start_perf_counters() opens them for the
+     * process, counting the threads started after it; register_thread() opens
+     * them for the calling thread, whose spans then count them too, and
+     * adds the thread to add_thread_resources(). Both return false if no
+     * counter could be opened. add_rusage() is followed by the process
+     * counters once they are open.
+     */
+    bool start_perf_counters() {
+        if (!perf) perf = std::make_unique<dfxml::perf_counters>(dfxml::perf_counters::PROCESS);
+        return perf->any();
+    }
+    bool register_thread(std::string_view name={}) { return prof.register_thread(name); }
+    void add_perf_counters(const dfxml::perf_counters &counters, const dfxml::perf_values_t &values,
+                           std::string_view attrs) {
+        push("perf_counters", attrs);
+        for (size_t i=0; i<dfxml::PERF_EVENTS; i++) {
+            if (counters.available(i)) {
+                xmlout(dfxml::perf_event_name(i), values[i]);
+            } else {
+                xmlout(dfxml::perf_event_name(i), "", attribute_list().add("error", strerror(counters.error(i))), false);
+            }
+        }
+        pop();
+    }
+    // writes the process counters and those of each registered thread
+    void add_perf_counters() {
+        if (perf) add_perf_counters(*perf, perf->read(), "scope='process'");
+        for (const auto &it : prof.registered_threads()) {
+            add_perf_counters(*it.counters, it.values, attribute_list().add("scope", "thread").add("thread", it.index));
+        }
+    }
+
+    /* Writes a <thread> for each registered thread with its CPU time, faults,
+     * context switches and I/O bytes. A thread that has exited is reported as
+     * it was when it exited.
+     */
+    void add_thread_resources() {
+        const std::vector<dfxml::thread_resources> threads = prof.registered_resources();
+        push("threads");
+        for (const auto &it : threads) {
+            attribute_list attrs;
+            attrs.add("index", it.index).add("tid", it.tid);
+            if (!it.name.empty()) attrs.add("name", it.name);
+            if (it.exited) attrs.add("exited", 1);
+            if (!it.valid) {
+                xmlout("thread", "", attrs, false);
+                continue;
+            }
+            push("thread", attrs);
+            xmlout("utime", to_timeval(std::chrono::microseconds(it.utime_usec)));
+            xmlout("stime", to_timeval(std::chrono::microseconds(it.stime_usec)));
+            xmlout("minflt", it.minflt);
+            xmlout("majflt", it.majflt);
+            xmlout("nvcsw", it.nvcsw);
+            xmlout("nivcsw", it.nivcsw);
+            if (it.has_io) {
+                xmlout("rchar", it.rchar);
+                xmlout("wchar", it.wchar);
+                xmlout("read_bytes", it.read_bytes);
+                xmlout("write_bytes", it.write_bytes);
+            }
+            pop();
+        }
+        pop();
+    }
+
+    /* The resource sampler records add_rusage()'s counters, the resident set
+     * and /proc/self/io every interval on its own thread, keeping the last
+     * capacity samples. add_resource_timeline() stops it and writes them.
+     */
+    void start_sampler(std::chrono::milliseconds interval, size_t capacity=3600) {
+        if (sampler) throw std::runtime_error("dfxml_writer::start_sampler: already started");
+        sampler = std::make_unique<dfxml::resource_sampler>(interval, capacity);
+    }
+    void stop_sampler() {
+        if (sampler) sampler->stop();
+    }
+    std::vector<dfxml::resource_sample> get_resource_samples() const {
+        return sampler ? sampler->samples() : std::vector<dfxml::resource_sample>();
+    }
+    void add_resource_timeline() {
+        if (!sampler) return;
+        sampler->stop();
+        const std::vector<dfxml::resource_sample> samples = sampler->samples();
+        push("resource_timeline", attribute_list().add("interval_ms", sampler->get_interval().count())
+             .add("samples", samples.size()).add("dropped", sampler->dropped()));
+        attribute_list attrs;
+        for (const auto &it : samples) {
+            attrs.clear();
+            attrs.add("usec", it.usec).add("utime_usec", it.utime_usec).add("stime_usec", it.stime_usec)
+                .add("maxrss_kb", it.maxrss_kb);
+            if (it.has_rss) attrs.add("rss_kb", it.rss_kb);
+            attrs.add("minflt", it.minflt).add("majflt", it.majflt).add("inblock", it.inblock)
+                .add("oublock", it.oublock).add("nvcsw", it.nvcsw).add("nivcsw", it.nivcsw);
+            if (it.has_io) {
+                attrs.add("rchar", it.rchar).add("wchar", it.wchar)
+                    .add("read_bytes", it.read_bytes).add("write_bytes", it.write_bytes);
+            }
+            xmlout("sample", "", attrs, false);
+        }
+        pop();
+    }
+
+    /* Write the reports in mask, a set of report_t, when the root element is
+     * popped, so that a tool gets them without arranging the calls itself.
+     */
+    void set_final_reports(unsigned int mask) { final_reports = mask; }
+    void add_final_reports() {
+        const unsigned int mask = final_reports;
+        final_reports = 0;              // they push and pop
+        if (mask & REPORT_PROFILE)           add_profile();
+        if (mask & REPORT_RESOURCE_TIMELINE) add_resource_timeline();
+        if (mask & REPORT_PERF_COUNTERS)     add_perf_counters();
+        if (mask & REPORT_THREADS)           add_thread_resources();
+        if (mask & REPORT_WRITER_STATS)      add_writer_stats();
+    }
+    void add_reorder_stats() {
+        const reorder_stats_t st = get_reorder_stats();
+        push("reorder_stats");
+        xmlout("committed",         st.committed);
+        xmlout("skipped",           st.skipped);
+        xmlout("out_of_order",      st.out_of_order);
+        xmlout("stalls",            st.stalls);
+        xmlout("stall_usec",        st.stall_usec);
+        xmlout("max_pending",       (uint64_t)st.max_pending);
+        xmlout("max_pending_bytes", (uint64_t)st.max_pending_bytes);
+        pop();
+    }
+    /* ISO-8601 in UTC, with microseconds if there are any: 2021-03-04T05:06:07.000008Z.
+     * The date is computed with integer arithmetic and cached per thread, since
+     * consecutive timestamps are usually on the same day. Years outside
+     * 1000-9999, which strftime() does not pad, and unnormalized microseconds
+     * are passed to format_8601_strftime(), so the output is the same.
+     */
+    static inline const size_t iso8601_max = 64; // buffer size for format_8601()
+    static void civil_from_days(int64_t z, int64_t &y, unsigned &m, unsigned &d) { // days since 1970-01-01
+        z += 719468;
+        const int64_t  era = (z >= 0 ? z : z - 146096) / 146097;
+        const unsigned doe = (unsigned)(z - era * 146097);
+        const unsigned yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+        const unsigned doy = doe - (365*yoe + yoe/4 - yoe/100);
+        const unsigned mp  = (5*doy + 2)/153;
+        d = doy - (153*mp+2)/5 + 1;
+        m = mp < 10 ? mp+3 : mp-9;
+        y = (int64_t)yoe + era*400 + (m <= 2);
+    }
+    static void put_digits(char *buf, uint64_t v, size_t n) {
+        while (n-- > 0) {
+            buf[n] = '0' + v % 10;
+            v /= 10;
+        }
+    }
+    static size_t format_8601(char *buf, int64_t sec, int64_t usec) {
+        struct date_cache {
+            int64_t day {INT64_MIN};
+            bool    fast {false};
+            char    date[11] {};        // YYYY-MM-DDT
+        };
+        thread_local date_cache cache;
+        const int64_t day = sec>=0 ? sec/86400 : -((86399 - sec)/86400);
+        if (day!=cache.day) {
+            int64_t y;
+            unsigned m, d;
+            civil_from_days(day, y, m, d);
+            cache.day  = day;
+            cache.fast = y>=1000 && y<=9999;
+            if (cache.fast) {
+                put_digits(cache.date, y, 4);
+                cache.date[4] = '-';
+                put_digits(cache.date+5, m, 2);
+                cache.date[7] = '-';
+                put_digits(cache.date+8, d, 2);
+                cache.date[10] = 'T';
+            }
+        }
+        if (!cache.fast || usec >= 1000000) return format_8601_strftime(buf, sec, usec);
+        const unsigned sod = sec - day*86400;
+        memcpy(buf, cache.date, 11);
+        put_digits(buf+11, sod/3600, 2);
+        buf[13] = ':';
+        put_digits(buf+14, sod/60%60, 2);
+        buf[16] = ':';
+        put_digits(buf+17, sod%60, 2);
+        size_t len = 19;
+        if (usec>0) {
+            buf[len++] = '.';
+            put_digits(buf+len, usec, 6);
+            len += 6;
+        }
+        buf[len++] = 'Z';
+        buf[len] = '\0';
+        return len;
+    }
+    // the original formatter
+    static size_t format_8601_strftime(char *buf, int64_t sec, int64_t usec) {
         struct tm tm;
-        char buf[64];
+        const time_t t = sec;
 #ifdef HAVE_GMTIME_R
-        gmtime_r(&ts.tv_sec,&tm);
+        if (!gmtime_r(&t,&tm)) return strlen(strcpy(buf, "INVALID"));
 #else
-        time_t t = ts.tv_sec;
         struct tm *tmp;
         tmp = gmtime(&t);
-        if (!tmp) return std::string("INVALID");
+        if (!tmp) return strlen(strcpy(buf, "INVALID"));
         tm = *tmp;
 #endif
-        strftime(buf,sizeof(buf),"%Y-%m-%dT%H:%M:%S",&tm);
-        if (ts.tv_usec>0){
-            int len = strlen(buf);
-            snprintf(buf+len,sizeof(buf)-len,".%06d",(int)ts.tv_usec);
+        size_t len = strftime(buf,iso8601_max,"%Y-%m-%dT%H:%M:%S",&tm);
+        if (usec>0){
+            len += snprintf(buf+len,iso8601_max-len,".%06d",(int)usec);
         }
-        strcat(buf,"Z");
-        return std::string(buf);
+        buf[len++] = 'Z';
+        buf[len] = '\0';
+        return len;
+    }
+    static void append_8601(std::string &buf, int64_t sec, int64_t usec) {
+        char tmp[iso8601_max];
+        buf.append(tmp, format_8601(tmp, sec, usec));
+    }
+    static std::string to8601(const struct timeval &ts) {
+        char buf[iso8601_max];
+        return std::string(buf, format_8601(buf, ts.tv_sec, ts.tv_usec));
+    }
+    // nanoseconds are truncated to microseconds
+    static std::string to8601(const struct timespec &ts) {
+        char buf[iso8601_max];
+        return std::string(buf, format_8601(buf, ts.tv_sec, ts.tv_nsec / 1000));
+    }
+    static std::string to8601(std::chrono::system_clock::time_point tp) {
+        const auto us  = std::chrono::floor<std::chrono::microseconds>(tp.time_since_epoch());
+        const auto sec = std::chrono::floor<std::chrono::seconds>(us);
+        char buf[iso8601_max];
+        return std::string(buf, format_8601(buf, sec.count(), (us - sec).count()));
+    }
+    static std::string to8601_strftime(const struct timeval &ts) {
+        char buf[iso8601_max];
+        return std::string(buf, format_8601_strftime(buf, ts.tv_sec, ts.tv_usec));
     }
 };
 #endif
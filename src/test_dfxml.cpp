@@ -9,12 +9,28 @@
 
 #include "tests/catch.hpp"
 
+#include <cstdarg>
+#include <limits>
+#include <thread>
+
 #include "hash_t.h"
 #include "dfxml_writer.h"
+#include "dfxml_reader.h"
 #include "cpuid.h"
 
 const uint8_t nulls[512] = {0};
 
+/* Count heap allocations, to check that the writer's emit path does not allocate */
+static std::atomic<size_t> allocations {0};
+void *operator new(size_t size) {
+    allocations++;
+    void *p = malloc(size ? size : 1);
+    if (p==nullptr) throw std::bad_alloc();
+    return p;
+}
+__attribute__((noinline)) void operator delete(void *p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept { free(p); }
+
 int count_wrongs(void) {
     /* First test the operation of the digest function */
     uint8_t buf20[20] = {0,1,2,3,4,5,6,7,8,9,
@@ -52,6 +68,1789 @@ TEST_CASE("dfxml_writer", "[vector]" ) {
     REQUIRE( test_dfxml_writer() == true );
 }
 
+std::string read_file(const std::string &fname) {
+    std::ifstream in(fname, std::ios::binary);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+/* Write a small fiwalk-like document with a given flush policy and return it */
+std::string write_with_policy(const dfxml_writer::flush_policy_t &policy) {
+    dfxml_writer dw("/tmp/output_flush.xml", false);
+    dw.set_flush_policy(policy);
+    dw.push("dfxml","version='1.0'");
+    for(int i=0;i<100;i++){
+        dw.push("fileobject");
+        dw.xmlout("filename", "file<" + std::to_string(i) + ">");
+        dw.xmlout("filesize", (int64_t)i*512);
+        dw.comment("comment");
+        dw.pop("fileobject");
+    }
+    dw.pop();
+    dw.close();
+    return read_file("/tmp/output_flush.xml");
+}
+
+TEST_CASE("flush_policy", "[dfxml_writer]") {
+    std::string ref = write_with_policy(dfxml_writer::flush_policy_t::always());
+    REQUIRE( ref.find("<filename>file&lt;42&gt;</filename>") != std::string::npos );
+    REQUIRE( write_with_policy(dfxml_writer::flush_policy_t::never()) == ref );
+    REQUIRE( write_with_policy(dfxml_writer::flush_policy_t::every_bytes(100)) == ref );
+    REQUIRE( write_with_policy(dfxml_writer::flush_policy_t::every_msec(1)) == ref );
+    REQUIRE( write_with_policy(dfxml_writer::flush_policy_t::on_pop("fileobject")) == ref );
+}
+
+TEST_CASE("fragment", "[dfxml_writer]") {
+    /* A fragment produces the same bytes as the writer itself */
+    {
+        dfxml_writer dw("/tmp/output_direct.xml", false);
+        dw.push("dfxml");
+        dw.push("fileobject");
+        dw.xmlout("filename", "a&b");
+        dw.xmlout("filesize", (uint64_t)12345);
+        dw.xmlout("size", 1.5);
+        dw.xmlout("byte_run", "", "img_offset='512'", false);
+        dw.pop();
+        dw.pop();
+        dw.close();
+    }
+    {
+        dfxml_writer dw("/tmp/output_fragment.xml", false);
+        dw.push("dfxml");
+        dfxml_writer::fragment f(dw);
+        f.push("fileobject");
+        f.xmlout("filename", "a&b");
+        f.xmlout("filesize", (uint64_t)12345);
+        f.xmlout("size", 1.5);
+        f.xmlout("byte_run", "", "img_offset='512'", false);
+        f.pop();
+        dw.commit(f);
+        REQUIRE( f.empty() );
+        dw.pop();
+        dw.close();
+    }
+    REQUIRE( read_file("/tmp/output_direct.xml") == read_file("/tmp/output_fragment.xml") );
+
+    /* Unclosed fragments cannot be committed */
+    {
+        dfxml_writer dw("/tmp/output_fragment.xml", false);
+        dfxml_writer::fragment f(dw);
+        f.push("fileobject");
+        REQUIRE_THROWS( dw.commit(f) );
+    }
+
+    /* Many threads committing fragments produce well-formed output */
+    const int nthreads = 8;
+    const int per_thread = 500;
+    {
+        dfxml_writer dw("/tmp/output_threads.xml", false);
+        dw.set_flush_policy(dfxml_writer::flush_policy_t::never());
+        dw.push("dfxml");
+        std::vector<std::thread> threads;
+        for (int t=0; t<nthreads; t++) {
+            threads.emplace_back([&dw, t]() {
+                dfxml_writer::fragment f(dw);
+                for (int i=0; i<per_thread; i++) {
+                    f.push("fileobject");
+                    f.xmlout("filename", "t" + std::to_string(t) + "/" + std::to_string(i));
+                    f.xmlout("filesize", i);
+                    f.pop();
+                    dw.commit(f);
+                }
+            });
+        }
+        for (auto &th : threads) th.join();
+        dw.pop();
+        dw.close();
+    }
+    std::set<std::string> names;
+    dfxml::file_object_reader::read_dfxml("/tmp/output_threads.xml",
+                                          [&names](dfxml::file_object &fi) { names.insert(fi.filename()); });
+    REQUIRE( names.size() == nthreads * per_thread );
+    REQUIRE( names.count("t7/499") == 1 );
+}
+
+/* Commit fragments from several threads in async mode; return the number of fileobjects read back */
+size_t write_async(size_t capacity, dfxml_writer::backpressure_t backpressure, uint64_t &dropped) {
+    const int nthreads = 4;
+    dfxml_writer dw("/tmp/output_async.xml", false);
+    dw.set_flush_policy(dfxml_writer::flush_policy_t::on_pop("fileobject"));
+    dw.start_async(capacity, backpressure);
+    dw.push("dfxml");
+    std::vector<std::thread> threads;
+    for (int t=0; t<nthreads; t++) {
+        threads.emplace_back([&dw, t]() {
+            dfxml_writer::fragment f(dw);
+            for (int i=0; i<1000; i++) {
+                f.push("fileobject");
+                f.xmlout("filename", "t" + std::to_string(t) + "/" + std::to_string(i));
+                f.pop();
+                dw.commit(f);
+            }
+        });
+    }
+    for (auto &th : threads) th.join();
+    dw.xmlout("after", "threads");
+    dw.pop();
+    dw.close();
+    dropped = dw.get_dropped();
+    size_t count = 0;
+    dfxml::file_object_reader::read_dfxml("/tmp/output_async.xml", [&count](dfxml::file_object &) { count++; });
+    return count;
+}
+
+TEST_CASE("async", "[dfxml_writer]") {
+    uint64_t dropped = 0;
+    REQUIRE( write_async(64, dfxml_writer::BACKPRESSURE_BLOCK, dropped) == 4000 );
+    REQUIRE( dropped == 0 );
+    REQUIRE( read_file("/tmp/output_async.xml").find("<after>threads</after>\n</dfxml>\n") != std::string::npos );
+
+    /* With a tiny queue some fragments may be dropped, but the output stays well-formed */
+    size_t count = write_async(2, dfxml_writer::BACKPRESSURE_DROP, dropped);
+    REQUIRE( count + dropped == 4000 );
+
+    /* flush() returns once the writer thread has written and flushed everything */
+    {
+        dfxml_writer dw("/tmp/output_async.xml", false);
+        dw.set_flush_policy(dfxml_writer::flush_policy_t::never());
+        dw.start_async();
+        dw.push("dfxml");
+        dfxml_writer::fragment f(dw);
+        for (int i=0; i<200; i++) {
+            f.xmlout("filename", "f" + std::to_string(i));
+            dw.commit(f);
+            dw.xmlout("n", i);
+            dw.flush();
+            const std::string xml = read_file("/tmp/output_async.xml");
+            const std::string last = "<n>" + std::to_string(i) + "</n>\n";
+            REQUIRE( xml.size() > last.size() );
+            REQUIRE( xml.compare(xml.size()-last.size(), last.size(), last) == 0 );
+            REQUIRE( xml.find("<filename>f" + std::to_string(i) + "</filename>") != std::string::npos );
+        }
+        dw.pop();
+        dw.close();
+    }
+
+    /* With FLUSH_MSEC the writer thread flushes after the interval, even if nothing more is written */
+    {
+        dfxml_writer dw("/tmp/output_async.xml", false);
+        dw.set_flush_policy(dfxml_writer::flush_policy_t::every_msec(20));
+        dw.start_async();
+        dw.push("dfxml");
+        dw.xmlout("n", 1);
+        dw.xmlout("quiet", "producer");
+        bool seen = false;
+        for (int i=0; i<500 && !seen; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            seen = read_file("/tmp/output_async.xml").find("<quiet>producer</quiet>") != std::string::npos;
+        }
+        REQUIRE( seen );
+        dw.pop();
+        dw.close();
+    }
+
+    /* Async mode can be stopped and restarted while other threads commit */
+    {
+        dfxml_writer dw("/tmp/output_async.xml", false);
+        dw.start_async(8);
+        dw.push("dfxml");
+        std::atomic<bool> done {false};
+        std::vector<std::thread> threads;
+        for (int t=0; t<4; t++) {
+            threads.emplace_back([&dw, t]() {
+                dfxml_writer::fragment f(dw);
+                for (int i=0; i<2000; i++) {
+                    f.push("fileobject");
+                    f.xmlout("filename", "t" + std::to_string(t) + "/" + std::to_string(i));
+                    f.pop();
+                    dw.commit(f);
+                }
+            });
+        }
+        std::thread toggler([&dw, &done]() {
+            while (!done) {
+                dw.stop_async();
+                dw.start_async(8);
+            }
+        });
+        for (auto &th : threads) th.join();
+        done = true;
+        toggler.join();
+        dw.pop();
+        dw.close();
+        count = 0;
+        dfxml::file_object_reader::read_dfxml("/tmp/output_async.xml", [&count](dfxml::file_object &) { count++; });
+        REQUIRE( count == 8000 );
+    }
+}
+
+/* The original stringstream implementation of xmlescape, used as a reference */
+std::string xmlescape_reference(const std::string &xml) {
+    std::stringstream ret;
+    for(char ch: xml){
+        switch(ch){
+        case '>':  ret << "&gt;"; break;
+        case '<':  ret << "&lt;"; break;
+        case '&':  ret << "&amp;"; break;
+        case '\'': ret << "&apos;"; break;
+        case '"':  ret << "&quot;"; break;
+        case '\000':  ret << "%00"; break;
+        case '\r':  ret << "%0D"; break;
+        case '\n':  ret << "%0A"; break;
+        case '\t':  ret << "%09"; break;
+        default:
+            ret << ch;
+        }
+    }
+    return ret.str();
+}
+
+TEST_CASE("xmlescape", "[dfxml_writer]") {
+    std::cout << "escape scanner: " << dfxml_writer::escape_scanner_name() << std::endl;
+    REQUIRE( dfxml_writer::xmlescape("") == "" );
+    REQUIRE( dfxml_writer::xmlescape("clean/path/file.txt") == "clean/path/file.txt" );
+    REQUIRE( dfxml_writer::xmlescape(std::string("<a\0b>",5)) == "&lt;a%00b&gt;" );
+
+    /* Every scanner finds the first special character at every position and length */
+    const std::string specials = std::string("<>&'\"\r\n\t") + '\0';
+    for (size_t len=0; len<80; len++) {
+        for (size_t pos=0; pos<=len; pos++) {
+            std::string str(len, 'x');
+            str[len/2] = (char)0xe9;    // high-bit bytes are never escaped
+            if (pos<len) str[pos] = specials[(len+pos) % specials.size()];
+            size_t expected = (pos<len) ? pos : len;
+            REQUIRE( dfxml_writer::find_escape_scalar(str.data(), len) == expected );
+#ifdef DFXML_ESCAPE_SSE2
+            REQUIRE( dfxml_writer::find_escape_sse2(str.data(), len) == expected );
+#endif
+#ifdef DFXML_ESCAPE_AVX2
+            if (CPUID::has_avx2()) {
+                REQUIRE( dfxml_writer::find_escape_avx2(str.data(), len) == expected );
+            }
+#endif
+            REQUIRE( dfxml_writer::xmlescape(str) == xmlescape_reference(str) );
+        }
+    }
+
+    /* Random strings match the reference implementation */
+    srandom(1);
+    for (int i=0; i<2000; i++) {
+        std::string str;
+        size_t len = random() % 200;
+        for (size_t j=0; j<len; j++) {
+            str.push_back( (random() % 8)==0 ? specials[random() % specials.size()] : (char)(random() % 256) );
+        }
+        REQUIRE( dfxml_writer::xmlescape(str) == xmlescape_reference(str) );
+    }
+}
+
+template<typename T>
+std::string format_number(T value) {
+    char buf[dfxml_writer::number_bufsize<T>()];
+    return std::string(buf, dfxml_writer::format_number(buf, sizeof(buf), value));
+}
+
+std::string format_timeval(time_t sec, suseconds_t usec) {
+    struct timeval tv;
+    tv.tv_sec = sec;
+    tv.tv_usec = usec;
+    char buf[32];
+    return std::string(buf, dfxml_writer::format_timeval(buf, sizeof(buf), tv));
+}
+
+std::string printf_string(const char *fmt, ...) {
+    char buf[1024];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    return std::string(buf);
+}
+
+TEST_CASE("format_number", "[dfxml_writer]") {
+    REQUIRE( format_number((signed char)-128) == "-128" );
+    REQUIRE( format_number((unsigned char)255) == "255" );
+    REQUIRE( format_number((short)-32768) == "-32768" );
+    REQUIRE( format_number(INT64_MIN) == printf_string("%" PRId64, INT64_MIN) );
+    REQUIRE( format_number(UINT64_MAX) == printf_string("%" PRIu64, UINT64_MAX) );
+
+    const double doubles[] = {0.0, -0.0, 1.5, -2.25, 0.0078125, 1e-7, 123456789.123456789, 1e300, -1e308,
+                              std::numeric_limits<double>::infinity(), std::numeric_limits<double>::quiet_NaN()};
+    for (double d : doubles) {
+        REQUIRE( format_number(d) == printf_string("%f", d) );
+    }
+    srandom(2);
+    for (int i=0; i<10000; i++) {
+        int64_t v = ((int64_t)random() << 32) ^ random();
+        REQUIRE( format_number(v) == printf_string("%" PRId64, v) );
+        double d = (double)v / (1 + random() % 1000000);
+        REQUIRE( format_number(d) == printf_string("%f", d) );
+    }
+
+    REQUIRE( format_timeval(0, 0) == "0.000000" );
+    REQUIRE( format_timeval(12, 3456) == "12.003456" );
+    REQUIRE( format_timeval(-1, 999999) == "-1.999999" );
+    REQUIRE( format_timeval(5, -3) == printf_string("%d.%06d", 5, -3) );
+    REQUIRE( format_timeval(1634000000, 123456) == "1634000000.123456" );
+}
+
+TEST_CASE("tags", "[dfxml_writer]") {
+    /* Interned tags and string tags produce the same bytes */
+    auto write = [](const std::string &fname, bool interned) {
+        dfxml_writer dw(fname, false);
+        if (interned) {
+            namespace tags = dfxml::tags;
+            dw.push(tags::dfxml, "version='1.0'");
+            dw.push(tags::fileobject);
+            dw.xmlout(tags::filename, "a&b");
+            dw.xmlout(tags::filesize, (uint64_t)12345);
+            dw.xmlout(tags::byte_run, "", "img_offset='512'", false);
+            dw.xmlout(tags::libmagic, "");
+            dw.pop();
+            dfxml_writer::fragment f(dw);
+            f.push(tags::fileobject);
+            f.xmlout(tags::filename, "c");
+            f.xmlout(tags::byte_run, "", "img_offset='0'", false);
+            f.pop();
+            dw.commit(f);
+        } else {
+            dw.push("dfxml", "version='1.0'");
+            dw.push("fileobject");
+            dw.xmlout("filename", "a&b");
+            dw.xmlout("filesize", (uint64_t)12345);
+            dw.xmlout("byte_run", "", "img_offset='512'", false);
+            dw.xmlout("libmagic", "");
+            dw.pop();
+            dfxml_writer::fragment f(dw);
+            f.push("fileobject");
+            f.xmlout("filename", "c");
+            f.xmlout("byte_run", "", "img_offset='0'", false);
+            f.pop();
+            dw.commit(f);
+        }
+        dw.pop("dfxml");
+        dw.close();
+    };
+    write("/tmp/output_string_tags.xml", false);
+    write("/tmp/output_interned_tags.xml", true);
+    REQUIRE( read_file("/tmp/output_string_tags.xml") == read_file("/tmp/output_interned_tags.xml") );
+
+    /* Interning is by name */
+    dfxml::tag t1("tags_test_element");
+    dfxml::tag t2("tags_test_element");
+    REQUIRE( t1.id() == t2.id() );
+    REQUIRE( t1.id() != dfxml::tags::fileobject.id() );
+    REQUIRE( t1.open() == "<tags_test_element>" );
+    REQUIRE( t1.close() == "</tags_test_element>" );
+    REQUIRE( dfxml::tag::name_of(t1.id()) == "tags_test_element" );
+    REQUIRE_THROWS( dfxml::tag("bad tag") );
+    REQUIRE_THROWS( dfxml::tag("") );
+
+    /* on_pop() flushing works with interned tags */
+    {
+        dfxml_writer dw("/tmp/output_interned_tags.xml", false);
+        dw.set_flush_policy(dfxml_writer::flush_policy_t::on_pop("fileobject"));
+        dw.push(dfxml::tags::dfxml);
+        dw.push(dfxml::tags::fileobject);
+        dw.xmlout(dfxml::tags::filename, "x");
+        dw.pop();
+        REQUIRE( read_file("/tmp/output_interned_tags.xml").find("</fileobject>") != std::string::npos );
+        dw.pop();
+        dw.close();
+    }
+    REQUIRE( dfxml::tag::find("fileobject") == dfxml::tags::fileobject.id() );
+    REQUIRE( dfxml::tag::find("tags_test_not_interned") == dfxml::tag::none );
+
+    /* Under on_pop(), a commit tests the interned tag's bit without taking
+     * the registry's lock or allocating; string tags are found by name
+     */
+    for (const char *tag : {"fileobject", "tags_test_not_interned"}) {
+        const bool interned = (tag==std::string("fileobject"));
+        dfxml_writer dw("/tmp/output_interned_tags.xml", false);
+        dw.set_flush_policy(dfxml_writer::flush_policy_t::on_pop(tag));
+        dw.push(dfxml::tags::dfxml);
+        dfxml_writer::fragment f(dw);
+        auto write_one = [&]() {
+            if (interned) f.push(dfxml::tags::fileobject); else f.push(tag);
+            f.xmlout(dfxml::tags::filename, "x");
+            f.pop();
+            dw.commit(f);
+        };
+        write_one();
+        REQUIRE( read_file("/tmp/output_interned_tags.xml").find("<filename>x</filename>") != std::string::npos );
+        if (interned) {
+            const size_t before = allocations;
+            for (int i=0; i<100; i++) write_one();
+            REQUIRE( allocations == before );
+        }
+        dw.pop();
+        dw.close();
+    }
+}
+
+TEST_CASE("string_view", "[dfxml_writer]") {
+    /* string_view arguments produce the same bytes as strings */
+    const dfxml_writer::strstrmap_t m = {{"a","1&2"}, {"b","x"}};
+    {
+        dfxml_writer dw("/tmp/output_strings.xml", false);
+        dw.push(std::string("dfxml"), std::string("version='1.0'"));
+        dw.xmlout(std::string("filename"), std::string("a<b"));
+        dw.xmlout(std::string("byte_run"), std::string(""), std::string("len='1'"), false);
+        dw.xmlout(std::string(""), dfxml_writer::xmlmap(m, std::string("map"), std::string("k='v'")), std::string(""), false);
+        dw.pop(std::string("dfxml"));
+        dw.close();
+    }
+    {
+        using namespace std::literals;
+        dfxml_writer dw("/tmp/output_views.xml", false);
+        dw.push("dfxml"sv, "version='1.0'"sv);
+        dw.xmlout("filename"sv, "a<b"sv);
+        dw.xmlout("byte_run"sv, ""sv, "len='1'"sv, false);
+        dw.xmlout("map"sv, m, "k='v'"sv);
+        dw.pop("dfxml"sv);
+        dw.close();
+    }
+    REQUIRE( read_file("/tmp/output_strings.xml") == read_file("/tmp/output_views.xml") );
+
+    /* Once the buffers have grown, writing values that need no escaping does not allocate */
+    {
+        dfxml_writer dw("/tmp/output_views.xml", false);
+        const char *filename = "dir/subdir/file.txt";
+        std::string_view attrs = "img_offset='512' len='4096'";
+        auto write = [&]() {
+            dw.push(dfxml::tags::fileobject);
+            dw.xmlout(dfxml::tags::filename, filename);
+            dw.xmlout("filesize", (uint64_t)12345);
+            dw.xmlout("crtime", 1.5);
+            dw.xmlout(dfxml::tags::byte_run, "", attrs, false);
+            dw.xmlout("hashdigest", std::string_view("d41d8cd98f00b204e9800998ecf8427e"), "type='md5'", false);
+            dw.xmlout("map", m);
+            dw.pop("fileobject");
+        };
+        dw.push("dfxml");
+        write();
+        const size_t before = allocations;
+        for (int i=0; i<100; i++) write();
+        const size_t after = allocations;
+        REQUIRE( after == before );
+        dw.pop();
+        dw.close();
+    }
+}
+
+TEST_CASE("attribute_list", "[dfxml_writer]") {
+    dfxml_writer::attribute_list a;
+    REQUIRE( a.empty() );
+    struct timeval tv {5, 42};
+    a.add("name", "a<'b'").add("len", (uint64_t)4096).add("delta", -3).add("t", tv).add("x", 1.5);
+    REQUIRE( a.view() == "name='a&lt;&apos;b&apos;' len='4096' delta='-3' t='5.000042' x='1.500000'" );
+    a.clear();
+    REQUIRE( a.empty() );
+
+    /* xmlout_map takes any map whose values append_value formats, and the
+     * strstrmap_t overload writes what xmlmap() returns
+     */
+    const std::map<std::string, uint64_t> counts = {{"files", 12}, {"bytes", 1ULL<<40}};
+    const std::vector<std::pair<std::string_view, std::string>> pairs = {{"b", "2&"}, {"a", "1"}};
+    const dfxml_writer::strstrmap_t m = {{"a","1&2"}, {"b","x"}};
+    {
+        dfxml_writer dw("/tmp/output_attrs.xml", false);
+        dw.set_oneline(true);
+        dw.push("dfxml");
+        dw.push("run", a.add("offset", 512).add("len", 4096));
+        dw.pop();
+        dw.xmlout_map("counts", counts, dfxml_writer::attribute_list().add("n", counts.size()));
+        dw.xmlout_map("pairs", pairs);
+        dw.xmlout("map", m, "k='v'");
+        dw.pop();
+        dw.close();
+    }
+    const std::string xml = read_file("/tmp/output_attrs.xml");
+    REQUIRE( xml.find("<run offset='512' len='4096'></run>") != std::string::npos );
+    REQUIRE( xml.find("<counts n='2'><bytes>1099511627776</bytes><files>12</files></counts>") != std::string::npos );
+    REQUIRE( xml.find("<pairs><b>2&amp;</b><a>1</a></pairs>") != std::string::npos );
+    REQUIRE( xml.find(dfxml_writer::xmlmap(m, "map", "k='v'")) != std::string::npos );
+
+    /* Reusing a list does not allocate once its buffer has grown */
+    a.clear();
+    a.add("img_offset", (uint64_t)1<<40).add("len", 4096).add("name", "file.txt");
+    const size_t before = allocations;
+    for (int i=0; i<100; i++) {
+        a.clear();
+        a.add("img_offset", (uint64_t)i<<40).add("len", 4096).add("name", "file.txt");
+    }
+    REQUIRE( allocations == before );
+}
+
+TEST_CASE("dtd", "[dfxml_writer]") {
+    auto write = [](dfxml_writer &dw) {
+        dw.push("dfxml", "version='1.0'");
+        for (int i=0; i<100; i++) {
+            dw.push("fileobject");
+            dw.xmlout("filename", "file" + std::to_string(i));
+            dw.xmlout("filesize", i);
+            dw.pop();
+        }
+        dw.pop();
+        dw.close();
+    };
+    /* the document after the DOCTYPE and any blank space following it */
+    auto body = [](const std::string &xml) {
+        size_t pos = xml.find("]>");
+        REQUIRE( pos != std::string::npos );
+        return xml.substr(xml.find_first_not_of(" \n", pos+2));
+    };
+    {
+        dfxml_writer dw("/tmp/output_dtd_none.xml", false);
+        write(dw);
+    }
+    const std::string plain = read_file("/tmp/output_dtd_none.xml");
+    const std::string plain_body = plain.substr(dfxml_writer::xml_header.size());
+    const std::string elements =
+        "<!ELEMENT dfxml ANY >\n<!ELEMENT filename ANY >\n<!ELEMENT fileobject ANY >\n<!ELEMENT filesize ANY >\n";
+    const std::string doctype = "<!DOCTYPE dfxml\n[\n" + elements;
+
+    /* The DTD fits in the reserved space and is written in place */
+    {
+        dfxml_writer dw("/tmp/output_dtd_internal.xml", true);
+        write(dw);
+    }
+    std::string xml = read_file("/tmp/output_dtd_internal.xml");
+    REQUIRE( xml.size() == plain.size() + dfxml_writer::dtd_reserve_default );
+    REQUIRE( xml.substr(0, dfxml_writer::xml_header.size() + doctype.size()) == dfxml_writer::xml_header + doctype );
+    REQUIRE( body(xml) == plain_body );
+    int count = 0;
+    dfxml::file_object_reader::read_dfxml("/tmp/output_dtd_internal.xml", [&count](dfxml::file_object &) { count++; });
+    REQUIRE( count == 100 );
+
+    /* The DTD does not fit, so the body is copied after it */
+    {
+        dfxml_writer dw("/tmp/output_dtd_internal.xml", dfxml_writer::DTD_INTERNAL, 16);
+        write(dw);
+    }
+    xml = read_file("/tmp/output_dtd_internal.xml");
+    REQUIRE( xml.substr(0, dfxml_writer::xml_header.size() + doctype.size()) == dfxml_writer::xml_header + doctype );
+    REQUIRE( xml.substr(xml.find("]>\n")+3) == plain_body );
+
+    /* External subset */
+    {
+        dfxml_writer dw("/tmp/output_dtd_external.xml", dfxml_writer::DTD_EXTERNAL);
+        REQUIRE( dw.get_dtd_filename() == "/tmp/output_dtd_external.dtd" );
+        write(dw);
+    }
+    xml = read_file("/tmp/output_dtd_external.xml");
+    REQUIRE( xml == dfxml_writer::xml_header + "<!DOCTYPE dfxml SYSTEM \"output_dtd_external.dtd\">\n" + plain_body );
+    REQUIRE( read_file("/tmp/output_dtd_external.dtd").substr(0, elements.size()) == elements );
+}
+
+#ifdef HAVE_ZLIB_H
+static std::string read_gzip(const std::string &fname)
+{
+    std::string ret;
+    gzFile f = gzopen(fname.c_str(), "rb");
+    char buf[65536];
+    int n;
+    while ((n = gzread(f, buf, sizeof(buf))) > 0) ret.append(buf, n);
+    gzclose(f);
+    return ret;
+}
+#endif
+
+TEST_CASE("sink", "[dfxml_writer]") {
+    auto write = [](dfxml_writer &dw) {
+        dw.push("dfxml", "version='1.0'");
+        for (int i=0; i<1000; i++) {
+            dw.push("fileobject");
+            dw.xmlout("filename", "file" + std::to_string(i));
+            dw.xmlout("filesize", i);
+            dw.pop();
+        }
+        dw.pop();
+        dw.close();
+    };
+    {
+        dfxml_writer dw("/tmp/output_sink.xml", false);
+        write(dw);
+    }
+    const std::string plain = read_file("/tmp/output_sink.xml");
+
+    /* A caller's stream */
+    std::stringstream ss;
+    {
+        dfxml_writer dw(std::make_unique<dfxml::ostream_sink>(ss));
+        write(dw);
+    }
+    REQUIRE( ss.str() == plain );
+
+    /* A caller's buffer, reused for the next document without reallocating */
+    std::string buffer;
+    for (int round=0; round<2; round++) {
+        const char *data = buffer.data();
+        const size_t capacity = buffer.capacity();
+        buffer.clear();
+        {
+            dfxml_writer dw(dfxml::buffer_target(buffer));
+            write(dw);
+        }
+        REQUIRE( buffer == plain );
+        if (round) {
+            REQUIRE( buffer.data() == data );
+            REQUIRE( buffer.capacity() == capacity );
+        }
+    }
+    std::vector<char> bytes;
+    {
+        dfxml_writer dw(dfxml::buffer_target(bytes));
+        write(dw);
+    }
+    REQUIRE( std::string(bytes.begin(), bytes.end()) == plain );
+
+    /* A std::string holding a file name is never taken for a buffer */
+    static_assert( !std::is_constructible_v<dfxml_writer, std::string &> );
+    static_assert( std::is_constructible_v<dfxml_writer, dfxml::buffer_target_t<std::string>> );
+
+#ifdef DFXML_SINK_PMR
+    /* A buffer allocated from an arena */
+    {
+        std::pmr::monotonic_buffer_resource arena(1<<20);
+        std::pmr::string pbuffer(&arena);
+        {
+            dfxml_writer dw(dfxml::buffer_target(pbuffer));
+            write(dw);
+        }
+        REQUIRE( pbuffer.get_allocator().resource() == &arena );
+        REQUIRE( std::string_view(pbuffer) == plain );
+    }
+#endif
+
+    /* A callback gets the output as it is drained, and each flush */
+    {
+        std::string got;
+        size_t chunks = 0, flushes = 0;
+        dfxml_writer dw(std::make_unique<dfxml::callback_sink>(
+                            [&](std::string_view s) { got.append(s); chunks++; },
+                            [&]() { flushes++; }));
+        dw.set_flush_policy(dfxml_writer::flush_policy_t::on_pop("fileobject"));
+        write(dw);
+        REQUIRE( got == plain );
+        REQUIRE( chunks >= 1000 );
+        REQUIRE( flushes >= 1000 );
+    }
+    {
+        std::string got;
+        dfxml_writer dw([&got](std::string_view s) { got.append(s); });
+        write(dw);
+        REQUIRE( got == plain );
+    }
+    REQUIRE_THROWS_AS( dfxml::callback_sink(nullptr), std::runtime_error );
+
+    REQUIRE( dfxml::compression_for("a.xml.gz") == dfxml::COMPRESS_GZIP );
+    REQUIRE( dfxml::compression_for("a.xml.zst") == dfxml::COMPRESS_ZSTD );
+    REQUIRE( dfxml::compression_for("a.xml") == dfxml::COMPRESS_NONE );
+
+    /* File backends; small buffers so that many writes are made */
+    std::vector<std::pair<std::string, std::function<std::unique_ptr<dfxml::output_sink>()>>> backends = {
+        {"ostream", []() { return dfxml::make_file_sink("/tmp/output_sink.xml", dfxml::IO_OSTREAM); }},
+#ifdef DFXML_SINK_FD
+        {"write",   []() { return dfxml::make_file_sink("/tmp/output_sink.xml", dfxml::IO_WRITE); }},
+        {"write, small buffer",  []() { return std::make_unique<dfxml::fd_sink>("/tmp/output_sink.xml", 4096); }},
+        {"direct",  []() { return dfxml::make_file_sink("/tmp/output_sink.xml", dfxml::IO_DIRECT); }},
+        {"direct, small buffer", []() { return std::make_unique<dfxml::direct_sink>("/tmp/output_sink.xml", 4096); }},
+#endif
+#ifdef DFXML_SINK_IO_URING
+        {"io_uring", []() { return dfxml::make_file_sink("/tmp/output_sink.xml", dfxml::IO_URING); }},
+        {"io_uring, small buffers", []() { return std::make_unique<dfxml::uring_sink>("/tmp/output_sink.xml", 4096, 3); }},
+#endif
+    };
+    for (auto &it : backends) {
+        INFO( it.first );
+        {
+            dfxml_writer dw(it.second());
+            write(dw);
+        }
+        REQUIRE( read_file("/tmp/output_sink.xml") == plain );
+        /* The internal DTD is patched in place */
+        {
+            dfxml_writer dw(it.second(), dfxml_writer::DTD_INTERNAL);
+            write(dw);
+        }
+        REQUIRE( read_file("/tmp/output_sink.xml").find("<!ELEMENT fileobject ANY >") != std::string::npos );
+        /* flush() makes everything so far readable, except a partial O_DIRECT block */
+        if (it.first.find("direct")==std::string::npos) {
+            dfxml_writer dw(it.second());
+            dw.push("dfxml");
+            dw.xmlout("filename", "flushed");
+            dw.flush();
+            REQUIRE( read_file("/tmp/output_sink.xml").find("<filename>flushed</filename>") != std::string::npos );
+            dw.pop();
+            dw.close();
+        }
+    }
+
+#ifdef HAVE_ZLIB_H
+    /* Compressed by extension, or explicitly */
+    {
+        dfxml_writer dw("/tmp/output_sink.xml.gz", false);
+        write(dw);
+    }
+    REQUIRE( read_gzip("/tmp/output_sink.xml.gz") == plain );
+    {
+        dfxml_writer dw(dfxml::make_file_sink("/tmp/output_sink.dat", dfxml::COMPRESS_GZIP));
+        write(dw);
+    }
+    REQUIRE( read_gzip("/tmp/output_sink.dat") == plain );
+
+    /* flush() makes everything so far readable */
+    {
+        dfxml_writer dw("/tmp/output_sink.xml.gz", false);
+        dw.push("dfxml");
+        dw.xmlout("filename", "flushed");
+        dw.flush();
+        REQUIRE( read_gzip("/tmp/output_sink.xml.gz").find("<filename>flushed</filename>") != std::string::npos );
+        dw.pop();
+        dw.close();
+    }
+
+    /* A policy set after the writer thread started reaches it */
+    {
+        dfxml_writer dw("/tmp/output_sink.xml.gz", false);
+        dw.set_flush_policy(dfxml_writer::flush_policy_t::every_bytes(1));
+        REQUIRE( dw.get_flush_policy().mode == dfxml_writer::FLUSH_BYTES );
+        dw.push("dfxml");
+        dw.xmlout("filename", "by policy");
+        bool seen = false;
+        for (int i=0; i<500 && !seen; i++) { // without waiting for flush()
+            seen = read_gzip("/tmp/output_sink.xml.gz").find("<filename>by policy</filename>") != std::string::npos;
+            if (!seen) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        REQUIRE( seen );
+        dw.pop();
+        dw.close();
+    }
+
+    /* The DTD cannot be patched into compressed output, so it is external */
+    {
+        dfxml_writer dw("/tmp/output_sink.xml.gz", true);
+        write(dw);
+    }
+    const std::string xml = read_gzip("/tmp/output_sink.xml.gz");
+    REQUIRE( xml.find("<!DOCTYPE dfxml SYSTEM \"output_sink.xml.dtd\">") != std::string::npos );
+    REQUIRE( read_file("/tmp/output_sink.xml.dtd").find("<!ELEMENT fileobject ANY >") != std::string::npos );
+#endif
+}
+
+TEST_CASE("write_file_object", "[dfxml_writer]") {
+    dfxml::file_object fo;
+    fo._tags["filename"] = "dir/Tom & Jerry's <1>.txt";
+    fo._tags["filesize"] = "8192";
+    fo._tags["inode"]    = "42";
+    fo._tags["libmagic"] = "";
+    fo.hashdigest["md5"]  = "d41d8cd98f00b204e9800998ecf8427e";
+    fo.hashdigest["sha1"] = "da39a3ee5e6b4b0d3255bfef95601890afd80709";
+    fo.hashdigest["x'<&y"] = "0";      // a type read from untrusted input
+    dfxml::byte_run run;
+    run.img_offset = 1048576;
+    run.len = 4096;
+    fo.byte_runs.push_back(run);
+    run.file_offset = 4096;
+    run.img_offset  = 2097152;
+    run.sector_size = 512;
+    run.hashdigest["md5"] = "0cc175b9c0f1b6a831c399e269772661";
+    fo.byte_runs.push_back(run);
+
+    auto write = [](const std::string &fname, const std::vector<dfxml::file_object> &fos, bool use_fragment,
+                    bool compact=false) {
+        dfxml_writer dw(fname, false);
+        dw.set_compact(compact);
+        dw.push("dfxml", "version='1.0'");
+        dw.push("volume");
+        for (const auto &it : fos) {
+            if (use_fragment) {
+                dfxml_writer::fragment f(dw);
+                f.write(it);
+                dw.commit(f);
+            } else {
+                dw.write(it);
+            }
+        }
+        dw.pop();
+        dw.pop();
+        dw.close();
+    };
+    write("/tmp/output_write.xml", {fo, fo}, false);
+
+    /* Round trip through file_object_reader */
+    std::vector<dfxml::file_object> read;
+    dfxml::file_object_reader::read_dfxml("/tmp/output_write.xml",
+                                          [&read](dfxml::file_object &it) { read.push_back(it); });
+    REQUIRE( read.size() == 2 );
+    const dfxml::file_object &r = read[0];
+    for (const auto &it : fo._tags) {
+        REQUIRE( r._tags.at(it.first) == it.second );
+    }
+    REQUIRE( r.hashdigest == fo.hashdigest );
+    REQUIRE( r.byte_runs.size() == 2 );
+    for (size_t i=0; i<2; i++) {
+        REQUIRE( r.byte_runs[i].img_offset  == fo.byte_runs[i].img_offset );
+        REQUIRE( r.byte_runs[i].file_offset == fo.byte_runs[i].file_offset );
+        REQUIRE( r.byte_runs[i].len         == fo.byte_runs[i].len );
+        REQUIRE( r.byte_runs[i].sector_size == fo.byte_runs[i].sector_size );
+        REQUIRE( r.byte_runs[i].hashdigest  == fo.byte_runs[i].hashdigest );
+    }
+
+    /* What is read back writes the same bytes, from the writer or from a fragment */
+    write("/tmp/output_write2.xml", read, false);
+    REQUIRE( read_file("/tmp/output_write2.xml") == read_file("/tmp/output_write.xml") );
+    write("/tmp/output_write2.xml", read, true);
+    REQUIRE( read_file("/tmp/output_write2.xml") == read_file("/tmp/output_write.xml") );
+
+    /* Compact output has no whitespace between elements and reads back the same */
+    write("/tmp/output_compact.xml", {fo, fo}, false, true);
+    const std::string compact = read_file("/tmp/output_compact.xml");
+    REQUIRE( compact.size() < read_file("/tmp/output_write.xml").size() );
+    REQUIRE( compact.find('\n') == dfxml_writer::xml_header.size()-1 );
+    REQUIRE( compact.find("><") != std::string::npos );
+    REQUIRE( compact.find("> ") == std::string::npos );
+    std::vector<dfxml::file_object> read_compact;
+    dfxml::file_object_reader::read_dfxml("/tmp/output_compact.xml",
+                                          [&read_compact](dfxml::file_object &it) { read_compact.push_back(it); });
+    REQUIRE( read_compact.size() == 2 );
+    for (const auto &it : fo._tags) {
+        REQUIRE( read_compact[1]._tags.at(it.first) == it.second );
+    }
+    REQUIRE( read_compact[1]._tags.at("byte_runs") == "" ); // not the indentation
+    REQUIRE( read_compact[1].hashdigest == read[1].hashdigest );
+    REQUIRE( read_compact[1].byte_runs.size() == read[1].byte_runs.size() );
+    write("/tmp/output_write2.xml", read, true, true);
+    REQUIRE( read_file("/tmp/output_write2.xml") == compact );
+
+    /* A fileobject written inside another is not counted as a top-level one */
+    {
+        dfxml_writer dw("/tmp/output_write2.xml", false);
+        dw.push("dfxml", "version='1.0'");
+        dfxml_writer::fragment f(dw);
+        f.push("fileobject");
+        f.write(fo);
+        f.pop();
+        f.write(fo);
+        dw.commit(f);
+        REQUIRE( dw.get_fileobject_count() == 2 );
+        dw.pop();
+        dw.close();
+    }
+}
+
+TEST_CASE("indent", "[dfxml_writer]") {
+    /* Indentation is two spaces per level, however deep */
+    {
+        dfxml_writer dw("/tmp/output_indent.xml", false);
+        for (int i=0; i<100; i++) dw.push("d");
+        dw.xmlout("x", 1);
+        for (int i=0; i<100; i++) dw.pop();
+        dw.close();
+    }
+    const std::string xml = read_file("/tmp/output_indent.xml");
+    REQUIRE( xml.find("\n" + std::string(200, ' ') + "<x>1</x>\n") != std::string::npos );
+    REQUIRE( xml.find("\n" + std::string(198, ' ') + "</d>\n") != std::string::npos );
+
+    /* Compact mode overrides set_oneline() and drops the line break after comments */
+    {
+        dfxml_writer dw("/tmp/output_indent.xml", false);
+        dw.set_compact();
+        REQUIRE( dw.get_compact() );
+        dw.push("dfxml");
+        dw.set_oneline(false);
+        dw.comment("c");
+        dw.push("volume");
+        dw.xmlout("x", 1);
+        dw.pop();
+        dw.set_compact(false);
+        dw.xmlout("y", 2);
+        dw.pop();
+        dw.close();
+    }
+    REQUIRE( read_file("/tmp/output_indent.xml") ==
+             dfxml_writer::xml_header + "<dfxml><!-- c --><volume><x>1</x></volume>\n  <y>2</y>\n</dfxml>\n" );
+}
+
+/* Threads commit interleaved sequence numbers; the output must match a single producer's */
+std::string write_reordered(size_t nthreads, bool async, const dfxml_writer::reorder_policy_t &policy,
+                            dfxml_writer::reorder_stats_t &stats) {
+    const size_t count = 1000;
+    dfxml_writer dw("/tmp/output_reorder.xml", false);
+    dw.set_flush_policy(dfxml_writer::flush_policy_t::on_pop("fileobject"));
+    if (async) dw.start_async();
+    dw.push("dfxml");
+    dw.set_reorder(100, policy);
+    std::vector<std::thread> threads;
+    for (size_t t=0; t<nthreads; t++) {
+        threads.emplace_back([&dw, t, nthreads]() {
+            dfxml_writer::fragment f(dw);
+            for (size_t i=t; i<count; i+=nthreads) {
+                if (i % 7 == 3) {       // files with no output
+                    dw.skip_sequence(100+i);
+                    continue;
+                }
+                f.push("fileobject");
+                f.xmlout("inode", (uint64_t)i);
+                f.pop();
+                if ((i+t) % 5 == 0) std::this_thread::sleep_for(std::chrono::microseconds(50));
+                dw.commit(f, 100+i);
+            }
+        });
+    }
+    for (auto &it : threads) it.join();
+    dw.pop();
+    dw.close();
+    stats = dw.get_reorder_stats();
+    return read_file("/tmp/output_reorder.xml");
+}
+
+TEST_CASE("reorder", "[dfxml_writer]") {
+    dfxml_writer::reorder_policy_t policy;
+    dfxml_writer::reorder_stats_t stats;
+    const std::string expected = write_reordered(1, false, policy, stats);
+    REQUIRE( stats.committed == 857 );
+    REQUIRE( stats.skipped == 143 );
+    REQUIRE( stats.max_pending == 0 );   // nothing waited
+    REQUIRE( expected.find("<inode>3</inode>") == std::string::npos );
+    REQUIRE( expected.find("<inode>999</inode>") != std::string::npos );
+
+    REQUIRE( write_reordered(8, false, policy, stats) == expected );
+    REQUIRE( stats.out_of_order == 0 );
+    REQUIRE( write_reordered(8, true, policy, stats) == expected );
+
+    /* A buffer smaller than the number of producers stalls them, but cannot deadlock */
+    policy.max_fragments = 2;
+    REQUIRE( write_reordered(8, false, policy, stats) == expected );
+    REQUIRE( stats.max_pending <= 2 );
+
+    /* REORDER_THROW leaves the fragment with the caller */
+    {
+        dfxml_writer dw("/tmp/output_reorder.xml", false);
+        dw.push("dfxml");
+        policy.stall = dfxml_writer::REORDER_THROW;
+        dw.set_reorder(0, policy);
+        dfxml_writer::fragment f(dw);
+        for (uint64_t seq : {2, 3}) {
+            f.xmlout("seq", seq);
+            dw.commit(f, seq);
+        }
+        f.xmlout("seq", 4);
+        REQUIRE_THROWS_AS( dw.commit(f, 4), std::runtime_error );
+        REQUIRE( !f.empty() );
+        REQUIRE_THROWS_AS( dw.commit(f, 2), std::runtime_error ); // duplicate
+        REQUIRE_THROWS_AS( dw.close(), std::runtime_error );       // 0 and 1 are missing
+        f.clear();
+        f.xmlout("seq", 0);
+        dw.commit(f, 0);
+        dw.skip_sequence(1);
+        dw.pop();
+        dw.close();
+        REQUIRE( read_file("/tmp/output_reorder.xml").find("<seq>0</seq>\n  <seq>2</seq>\n  <seq>3</seq>\n</dfxml>") != std::string::npos );
+    }
+
+    /* REORDER_WRITE gives up on the gap and writes what it has */
+    {
+        dfxml_writer dw("/tmp/output_reorder.xml", false);
+        dw.push("dfxml");
+        policy.stall = dfxml_writer::REORDER_WRITE;
+        dw.set_reorder(0, policy);
+        dfxml_writer::fragment f(dw);
+        for (uint64_t seq : {3, 2, 4, 0}) {
+            f.xmlout("seq", seq);
+            dw.commit(f, seq);
+        }
+        dw.add_reorder_stats();
+        dw.pop();
+        dw.close();
+        const std::string out = read_file("/tmp/output_reorder.xml");
+        REQUIRE( out.find("<seq>2</seq>\n  <seq>3</seq>\n  <seq>4</seq>\n  <seq>0</seq>\n") != std::string::npos );
+        REQUIRE( out.find("<out_of_order>2</out_of_order>") != std::string::npos );
+    }
+}
+
+TEST_CASE("shard", "[dfxml_writer]") {
+    char *argv[] = {(char *)"test_dfxml", nullptr};
+    auto write = [&argv](const std::string &fname, const dfxml_writer::shard_policy_t &policy, bool async) {
+        dfxml_writer dw(fname, false);
+        if (async) dw.start_async();
+        dw.set_sharding(policy);
+        dw.push("dfxml", "version='1.0'");
+        dw.add_DFXML_creator("test_dfxml", "1.0", "", 1, argv);
+        dw.push("volume", "offset='1048576'");
+        dfxml_writer::fragment f(dw);
+        for (int i=0; i<25; i++) {
+            if (i % 2) {
+                f.push("fileobject");
+                f.xmlout("filename", "file" + std::to_string(i));
+                f.pop();
+                dw.commit(f);
+            } else {
+                dw.push("fileobject");
+                dw.xmlout("filename", "file" + std::to_string(i));
+                dw.pop();
+            }
+        }
+        dw.pop();
+        dw.pop();
+        dw.close();
+        REQUIRE( !std::filesystem::exists(fname) );
+        return dw.get_shards();
+    };
+    dfxml_writer::shard_policy_t policy;
+    policy.fileobjects = 10;
+    for (int async = 0; async < 2; async++) {
+        auto shards = write("/tmp/output_shard.xml", policy, async);
+        REQUIRE( shards.size() == 3 );
+        REQUIRE( shards[0].filename == "/tmp/output_shard.00000.xml" );
+        REQUIRE( shards[2].filename == "/tmp/output_shard.00002.xml" );
+        REQUIRE( shards[2].fileobjects == 5 );
+
+        /* Each shard is well-formed, starts with the creator and keeps the volume's attributes */
+        std::vector<std::string> names;
+        for (const auto &it : shards) {
+            const std::string contents = read_file(it.filename.string());
+            REQUIRE( it.bytes == contents.size() );
+            REQUIRE( contents.find("<dfxml version='1.0'>\n  <creator version='1.0'>\n    <program>test_dfxml</program>") != std::string::npos );
+            REQUIRE( contents.find("  </creator>\n  <volume offset='1048576'>\n    <fileobject>") != std::string::npos );
+            REQUIRE( contents.substr(contents.size()-21) == "  </volume>\n</dfxml>\n" );
+            size_t count = 0;
+            dfxml::file_object_reader::read_dfxml(it.filename, [&](dfxml::file_object &fo) {
+                names.push_back(fo.filename());
+                count++;
+            });
+            REQUIRE( count == it.fileobjects );
+        }
+        REQUIRE( names.size() == 25 );
+        REQUIRE( names[24] == "file24" );
+        const std::string manifest = read_file("/tmp/output_shard.manifest.xml");
+        REQUIRE( manifest.find("<filename>output_shard.00001.xml</filename>\n    <fileobjects>10</fileobjects>") != std::string::npos );
+        REQUIRE( manifest.find("  <fileobjects>25</fileobjects>\n") != std::string::npos );
+    }
+
+    /* Rolling over by size; no shard is empty */
+    policy.fileobjects = 0;
+    policy.bytes = 1;
+    auto shards = write("/tmp/output_shard.xml", policy, false);
+    REQUIRE( shards.size() == 25 );
+    for (const auto &it : shards) REQUIRE( it.fileobjects == 1 );
+    for (const auto &it : shards) std::filesystem::remove(it.filename);
+
+#ifdef HAVE_ZLIB_H
+    policy.bytes = 0;
+    policy.fileobjects = 20;
+    shards = write("/tmp/output_shard.xml.gz", policy, false);
+    REQUIRE( shards.size() == 2 );
+    REQUIRE( shards[1].filename == "/tmp/output_shard.00001.xml.gz" );
+    REQUIRE( read_gzip(shards[1].filename.string()).substr(0, 5) == "<?xml" );
+#endif
+}
+
+/* Every index record must point at exactly one <fileobject> of the output */
+static void check_index(const std::string &xml, const std::filesystem::path &idx, uint64_t first, uint64_t count) {
+    dfxml::index_reader ir(idx);
+    REQUIRE( ir.size() == count );
+    for (uint64_t i=0; i<ir.size(); i++) {
+        const dfxml::index_record &r = ir[i];
+        INFO( "record " << i );
+        REQUIRE( r.ordinal == first+i );
+        const std::string fo = xml.substr(r.offset, r.length);
+        REQUIRE( fo.substr(0, 12) == "<fileobject>" );
+        REQUIRE( fo.substr(fo.size()-13) == "</fileobject>" );
+        REQUIRE( r.inode == 100 + r.ordinal );
+        REQUIRE( r.img_offset == (r.ordinal % 3 ? 4096 * r.ordinal : dfxml::index_none) );
+    }
+}
+
+TEST_CASE("index", "[dfxml_writer]") {
+    /* Fileobjects from every path: push/pop, write(), fragments and ordered commits */
+    auto write = [](const std::string &fname, dfxml_writer::dtd_mode_t dtd, size_t reserve, bool async, int shard) {
+        dfxml_writer dw(fname, dtd, reserve);
+        if (async) dw.start_async();
+        dw.set_index();
+        if (shard) {
+            dfxml_writer::shard_policy_t policy;
+            policy.fileobjects = shard;
+            dw.set_sharding(policy);
+        }
+        dw.push("dfxml", "version='1.0'");
+        dw.push("volume");
+        dw.set_reorder(0);
+        dfxml_writer::fragment f(dw);
+        for (uint64_t i=0; i<40; i++) {
+            dfxml::file_object fo;
+            fo._tags["filename"] = "file" + std::to_string(i);
+            fo._tags["inode"]    = std::to_string(100+i);
+            if (i % 3) {
+                dfxml::byte_run run;
+                run.img_offset = 4096*i;
+                run.len = 512;
+                fo.byte_runs.push_back(run);
+            }
+            switch (i % 4) {
+            case 0:
+                dw.push("fileobject");
+                dw.push("parent_object");
+                dw.xmlout("inode", (uint64_t)2);
+                dw.pop();
+                dw.xmlout("inode", 100+i);
+                if (i % 3) dw.xmlout("byte_run", "", "img_offset='" + std::to_string(4096*i) + "' len='512'", false);
+                dw.push("fileobject");  // not top-level; not indexed
+                dw.xmlout("inode", (uint64_t)3);
+                dw.pop();
+                dw.pop();
+                break;
+            case 1:
+                dw.write(fo);
+                break;
+            case 2:
+                f.write(fo);
+                dw.commit(f);
+                break;
+            case 3:
+                f.write(fo);
+                dw.commit(f, 0);        // one ordered commit per loop; sequence numbers from 0
+                dw.set_reorder(0);
+                break;
+            }
+        }
+        dw.pop();
+        dw.pop();
+        dw.close();
+        return dw.get_shards();
+    };
+    write("/tmp/output_index.xml", dfxml_writer::DTD_NONE, 0, false, 0);
+    check_index(read_file("/tmp/output_index.xml"), "/tmp/output_index.xml.idx", 0, 40);
+    REQUIRE( dfxml::index_reader("/tmp/output_index.xml.idx").header().offset_adjust == 0 );
+
+    write("/tmp/output_index.xml", dfxml_writer::DTD_NONE, 0, true, 0);
+    check_index(read_file("/tmp/output_index.xml"), "/tmp/output_index.xml.idx", 0, 40);
+
+    /* The DTD does not fit and moves the body */
+    write("/tmp/output_index.xml", dfxml_writer::DTD_INTERNAL, 16, false, 0);
+    check_index(read_file("/tmp/output_index.xml"), "/tmp/output_index.xml.idx", 0, 40);
+    REQUIRE( dfxml::index_reader("/tmp/output_index.xml.idx").header().offset_adjust > 0 );
+
+    /* Each shard has its own index; ordinals continue across shards */
+    auto shards = write("/tmp/output_index.xml", dfxml_writer::DTD_NONE, 0, false, 15);
+    REQUIRE( shards.size() == 3 );
+    uint64_t first = 0;
+    for (const auto &it : shards) {
+        check_index(read_file(it.filename.string()), it.filename.string() + ".idx", first, it.fileobjects);
+        first += it.fileobjects;
+    }
+
+#ifdef HAVE_ZLIB_H
+    write("/tmp/output_index.xml.gz", dfxml_writer::DTD_NONE, 0, false, 0);
+    check_index(read_gzip("/tmp/output_index.xml.gz"), "/tmp/output_index.xml.gz.idx", 0, 40);
+    REQUIRE( dfxml::index_reader("/tmp/output_index.xml.gz.idx").header().flags == dfxml::INDEX_COMPRESSED );
+#endif
+    /* Keys come from the fileobject's own children, not from its text or its parent_object;
+     * the indexed fileobject is held until pop() and then flushed by the policy.
+     */
+    {
+        dfxml_writer dw("/tmp/output_index.xml", dfxml_writer::DTD_NONE);
+        dw.set_index();
+        dw.push("dfxml", "version='1.0'");
+        dw.push("fileobject");
+        dw.xmlout("filename", "a img_offset='7' <inode>8</inode>");
+        REQUIRE( read_file("/tmp/output_index.xml").find("<dfxml") != std::string::npos );
+        REQUIRE( read_file("/tmp/output_index.xml").find("<fileobject>") == std::string::npos );
+        dw.push("parent_object");
+        dw.xmlout("inode", (uint64_t)2);
+        dw.push("byte_runs");
+        dw.xmlout("byte_run", "", "img_offset='9' len='1'", false);
+        dw.pop();
+        dw.pop();
+        dw.xmlout("inode", (uint64_t)100);
+        dw.push("byte_runs");
+        dw.xmlout("byte_run", "", "len='512' img_offset=\"4096\"", false);
+        dw.xmlout("byte_run", "", "img_offset='8192' len='512'", false);
+        dw.pop();
+        dw.pop();
+        REQUIRE( read_file("/tmp/output_index.xml").find("</fileobject>") != std::string::npos );
+        dw.pop();
+        dw.close();
+        dfxml::index_reader ir("/tmp/output_index.xml.idx");
+        REQUIRE( ir.size() == 1 );
+        REQUIRE( ir[0].inode == 100 );
+        REQUIRE( ir[0].img_offset == 4096 );
+        const std::string xml = read_file("/tmp/output_index.xml");
+        REQUIRE( xml.substr(ir[0].offset, 12) == "<fileobject>" );
+        REQUIRE( xml.substr(ir[0].offset + ir[0].length - 13, 13) == "</fileobject>" );
+    }
+    REQUIRE_THROWS_AS( dfxml::index_reader("/tmp/output_index.xml"), std::runtime_error );
+}
+
+TEST_CASE("checkpoint", "[dfxml_writer]") {
+    /* Writes fileobjects [begin,end) and checkpoints after the first checkpoint_at */
+    auto fileobjects = [](dfxml_writer &dw, int begin, int end, int checkpoint_at) {
+        dfxml_writer::fragment f(dw);
+        for (int i=begin; i<end; i++) {
+            if (i % 2) {
+                dw.push("fileobject");
+                dw.xmlout("filename", "file" + std::to_string(i));
+                dw.xmlout("inode", (uint64_t)i);
+                dw.pop();
+            } else {
+                f.push("fileobject");
+                f.xmlout("filename", "file" + std::to_string(i));
+                f.xmlout("inode", (uint64_t)i);
+                f.pop();
+                dw.commit(f, i/2);
+            }
+            if (i+1==checkpoint_at) dw.checkpoint("next=" + std::to_string(i+1));
+        }
+    };
+    auto start = [](dfxml_writer &dw, int shard, bool index) {
+        if (index) dw.set_index();
+        if (shard) {
+            dfxml_writer::shard_policy_t policy;
+            policy.fileobjects = shard;
+            dw.set_sharding(policy);
+        }
+        dw.push("dfxml", "version='1.0'");
+        dw.push("volume", "offset='512'");
+        dw.set_reorder(0);
+    };
+    auto finish = [](dfxml_writer &dw) {
+        dw.pop();
+        dw.pop();
+        dw.close();
+    };
+    const std::string fname = "/tmp/output_checkpoint.xml";
+    for (int shard : {0, 7}) {
+        for (int dtd = 0; dtd < 2; dtd++) {
+            INFO( "shard " << shard << " dtd " << dtd );
+            const auto mode = dtd ? dfxml_writer::DTD_INTERNAL : dfxml_writer::DTD_NONE;
+            /* The reference run */
+            std::vector<std::string> expected;
+            std::vector<std::filesystem::path> files;
+            {
+                dfxml_writer dw(fname, mode);
+                start(dw, shard, true);
+                fileobjects(dw, 0, 30, 0);
+                finish(dw);
+                for (const auto &it : dw.get_shards()) files.push_back(it.filename);
+                if (files.empty()) files.push_back(fname);
+                for (const auto &it : files) {
+                    expected.push_back(read_file(it.string()));
+                    expected.push_back(read_file(it.string() + ".idx"));
+                }
+                if (shard) expected.push_back(read_file(dw.get_manifest_filename().string()));
+            }
+            REQUIRE( !std::filesystem::exists(fname + ".checkpoint") );
+
+            /* A run that dies after fileobject 20, with a checkpoint after 16 */
+            {
+                dfxml_writer dw(fname, mode);
+                start(dw, shard, true);
+                fileobjects(dw, 0, 20, 16);
+                dw.flush();
+            }                               // no close()
+            std::ofstream(files.back(), std::ios::app) << "<fileobject><filen";
+            std::string token;
+            auto dw = dfxml_writer::resume(fname, &token);
+            REQUIRE( token == "next=16" );
+            REQUIRE( dw->get_fileobject_count() == 16 );
+            fileobjects(*dw, 16, 30, 0);
+            finish(*dw);
+            std::vector<std::string> got;
+            for (const auto &it : files) {
+                got.push_back(read_file(it.string()));
+                got.push_back(read_file(it.string() + ".idx"));
+            }
+            if (shard) got.push_back(read_file(dw->get_manifest_filename().string()));
+            REQUIRE( got == expected );
+            REQUIRE( !std::filesystem::exists(fname + ".checkpoint") );
+        }
+    }
+
+    /* Compressed output cannot be checkpointed; a checkpoint is needed to resume */
+#ifdef HAVE_ZLIB_H
+    {
+        dfxml_writer dw("/tmp/output_checkpoint.xml.gz", false);
+        dw.push("dfxml");
+        REQUIRE_THROWS_AS( dw.checkpoint("x"), std::runtime_error );
+        dw.pop();
+        dw.close();
+    }
+#endif
+    REQUIRE_THROWS_AS( dfxml_writer::resume(fname), std::runtime_error );
+
+    /* checkpoint_due() */
+    dfxml_writer dw(fname, false);
+    dw.set_checkpoint_interval(0, 3);
+    dw.push("dfxml");
+    fileobjects(dw, 0, 2, 0);
+    REQUIRE( !dw.checkpoint_due() );
+    fileobjects(dw, 2, 3, 0);
+    REQUIRE( dw.checkpoint_due() );
+    dw.checkpoint("");
+    REQUIRE( !dw.checkpoint_due() );
+    dw.pop();
+    dw.close();
+
+    /* Fragments committed lock-free in async mode are counted and checkpointed */
+    auto commit = [](dfxml_writer &w, int begin, int end) {
+        dfxml_writer::fragment f(w);
+        for (int i=begin; i<end; i++) {
+            f.push("fileobject");
+            f.xmlout("filename", "file" + std::to_string(i));
+            f.pop();
+            w.commit(f);
+        }
+    };
+    {
+        dfxml_writer aw(fname, false);
+        aw.set_checkpoint_interval(0, 10);
+        aw.start_async();
+        aw.push("dfxml");
+        commit(aw, 0, 9);
+        REQUIRE( !aw.checkpoint_due() );
+        commit(aw, 9, 10);
+        REQUIRE( aw.get_fileobject_count() == 10 );
+        REQUIRE( aw.checkpoint_due() );
+        aw.checkpoint("next=10");
+        REQUIRE( !aw.checkpoint_due() );
+        commit(aw, 10, 15);
+        aw.flush();
+    }                                   // no close()
+    std::string token;
+    auto rw = dfxml_writer::resume(fname, &token);
+    REQUIRE( token == "next=10" );
+    REQUIRE( rw->get_fileobject_count() == 10 );
+    rw->start_async();
+    commit(*rw, 10, 20);
+    rw->pop();
+    rw->close();
+    std::vector<std::string> names;
+    dfxml::file_object_reader::read_dfxml(fname, [&names](dfxml::file_object &fo) { names.push_back(fo.filename()); });
+    REQUIRE( names.size() == 20 );
+    REQUIRE( names[19] == "file19" );
+}
+
+/* Whether an XML document is complete and well-formed */
+static bool parses(const std::string &xml) {
+    XML_Parser p = XML_ParserCreate(nullptr);
+    const bool ok = XML_Parse(p, xml.data(), xml.size(), 1)==XML_STATUS_OK;
+    XML_ParserFree(p);
+    return ok;
+}
+
+TEST_CASE("well_formed", "[dfxml_writer]") {
+    const std::string fname = "/tmp/output_well_formed.xml";
+    auto write = [&](dfxml_writer &dw, bool check) {
+        dw.push("dfxml", "version='1.0'");
+        dw.push("volume", "offset='512'");
+        for (int i=0; i<50; i++) {
+            dw.push("fileobject");
+            dw.xmlout("filename", "file" + std::to_string(i));
+            dw.xmlout("filesize", i);
+            dw.pop();
+            if (check) {
+                dw.flush();
+                const std::string xml = read_file(fname);
+                REQUIRE( parses(xml) );
+                REQUIRE( xml.find("<filename>file" + std::to_string(i) + "</filename>") != std::string::npos );
+                REQUIRE( xml.substr(xml.size()-19) == "</volume>\n</dfxml>\n" );
+            }
+        }
+        dw.pop();
+        dw.pop();
+        dw.close();
+    };
+    {
+        dfxml_writer dw(fname, false);
+        write(dw, false);
+    }
+    const std::string plain = read_file(fname);
+
+    std::vector<std::pair<std::string, std::function<std::unique_ptr<dfxml::output_sink>()>>> backends = {
+        {"ostream", [&]() { return dfxml::make_file_sink(fname, dfxml::IO_OSTREAM); }},
+#ifdef DFXML_SINK_FD
+        {"write",   [&]() { return dfxml::make_file_sink(fname, dfxml::IO_WRITE); }},
+#endif
+#ifdef DFXML_SINK_IO_URING
+        {"io_uring", [&]() { return std::make_unique<dfxml::uring_sink>(fname, 4096, 3); }},
+#endif
+    };
+    for (auto &it : backends) {
+        INFO( it.first );
+        for (auto mode : {dfxml_writer::DTD_NONE, dfxml_writer::DTD_INTERNAL}) {
+            {
+                dfxml_writer dw(it.second(), mode);
+                dw.set_well_formed();
+                REQUIRE_THROWS_AS( dw.start_async(), std::runtime_error );
+                write(dw, true);
+            }
+            if (mode==dfxml_writer::DTD_NONE) REQUIRE( read_file(fname) == plain );
+            REQUIRE( parses(read_file(fname)) );
+        }
+    }
+
+    /* A stream cannot be rewritten */
+    std::stringstream ss;
+    dfxml_writer dw(std::make_unique<dfxml::ostream_sink>(ss));
+    REQUIRE_THROWS_AS( dw.set_well_formed(), std::runtime_error );
+    dw.close();
+}
+
+TEST_CASE("profile", "[dfxml_writer]") {
+    const std::string fname = "/tmp/output_profile.xml";
+    dfxml_writer dw(fname, false);
+    dw.push("dfxml", "version='1.0'");
+    {
+        auto scan = dw.span("scan");
+        for (int i=0; i<10; i++) {
+            auto hash = dw.span("hash");
+        }
+    }
+    {
+        auto s = dw.span("scan-x");
+    }
+    std::vector<std::thread> workers;
+    for (int t=0; t<2; t++) {
+        workers.emplace_back([&dw]() {
+            for (int i=0; i<5; i++) {
+                auto w = dw.span("worker");
+                auto h = dw.span("hash");
+            }
+        });
+    }
+    for (auto &it : workers) it.join();
+
+    const auto phases = dw.get_profiler().phases();
+    REQUIRE( phases.size() == 5 );
+    REQUIRE( phases.at("scan").count == 1 );
+    REQUIRE( phases.at("scan/hash").count == 10 );
+    REQUIRE( phases.at("scan/hash").threads == 1 );
+    REQUIRE( phases.at("worker/hash").count == 10 );
+    REQUIRE( phases.at("worker/hash").threads == 2 );
+    REQUIRE( phases.at("scan").total_ns >= phases.at("scan/hash").total_ns );
+    REQUIRE( phases.at("scan/hash").min_ns <= phases.at("scan/hash").max_ns );
+    REQUIRE( dw.get_profiler().thread_count() == 3 );
+    uint64_t histogram = 0;
+    for (auto n : phases.at("worker").histogram) histogram += n;
+    REQUIRE( histogram == 10 );
+
+    dw.add_timestamp("done");
+    dw.add_profile();
+    dw.pop();
+    dw.close();
+    const std::string xml = read_file(fname);
+    REQUIRE( parses(xml) );
+    REQUIRE( xml.find("<timestamp name='done' delta='") != std::string::npos );
+    REQUIRE( xml.find("<profile clock='steady_clock' threads='3'>") != std::string::npos );
+    /* Children are inside their parents, and each phase appears once */
+    const size_t scan = xml.find("<span name='scan' count='1'");
+    const size_t hash = xml.find("<span name='hash' count='10'");
+    const size_t scan_x = xml.find("<span name='scan-x' count='1'");
+    REQUIRE( scan != std::string::npos );
+    REQUIRE( scan < hash );
+    REQUIRE( hash < scan_x );
+    REQUIRE( xml.find("<span name='scan'", scan+1) == std::string::npos );
+    REQUIRE( xml.find("<span name='hash' count='10' total_ns='", scan_x) != std::string::npos );
+}
+
+TEST_CASE("resource_timeline", "[dfxml_writer]") {
+    const std::string fname = "/tmp/output_resource_timeline.xml";
+    dfxml_writer dw(fname, false);
+    REQUIRE( dw.get_resource_samples().empty() );
+    dw.start_sampler(std::chrono::milliseconds(2), 8);
+    REQUIRE_THROWS_AS( dw.start_sampler(std::chrono::milliseconds(2)), std::runtime_error );
+    dw.set_final_reports(dfxml_writer::REPORT_PROFILE | dfxml_writer::REPORT_RESOURCE_TIMELINE);
+    dw.push("dfxml", "version='1.0'");
+    {
+        auto s = dw.span("work");
+        std::vector<char> grow(16*1024*1024, 1);
+        std::this_thread::sleep_for(std::chrono::milliseconds(60));
+        REQUIRE( grow[12345] == 1 );
+    }
+    dw.pop();
+    dw.close();
+
+    const auto samples = dw.get_resource_samples();
+    REQUIRE( samples.size() == 8 );
+    for (size_t i=1; i<samples.size(); i++) {
+        REQUIRE( samples[i].usec > samples[i-1].usec );
+        REQUIRE( samples[i].utime_usec + samples[i].stime_usec >= samples[i-1].utime_usec + samples[i-1].stime_usec );
+    }
+#ifdef __linux__
+    REQUIRE( samples.back().has_rss );
+    REQUIRE( samples.back().rss_kb > 0 );
+#endif
+    const std::string xml = read_file(fname);
+    REQUIRE( parses(xml) );
+    const size_t profile  = xml.find("<profile ");
+    const size_t timeline = xml.find("<resource_timeline interval_ms='2' samples='8' dropped='");
+    REQUIRE( profile != std::string::npos );
+    REQUIRE( timeline > profile );
+    REQUIRE( timeline < xml.find("</dfxml>") );
+    REQUIRE( xml.find("<sample usec='") > timeline );
+    REQUIRE( xml.find("<resource_timeline", timeline+1) == std::string::npos );
+}
+
+TEST_CASE("perf_counters", "[dfxml_writer]") {
+    /* Counters may be unavailable here; each must either count or say why not */
+    dfxml::perf_counters pc(dfxml::perf_counters::THREAD);
+    volatile uint64_t sum = 0;
+    for (int i=0; i<1000000; i++) sum = sum + i;
+    const dfxml::perf_values_t v = pc.read();
+    for (size_t i=0; i<dfxml::PERF_EVENTS; i++) {
+        INFO( dfxml::perf_event_name(i) );
+        REQUIRE( pc.available(i) == (pc.error(i)==0) );
+        if (!pc.available(i)) REQUIRE( v[i] == 0 );
+    }
+    if (pc.available(dfxml::PERF_INSTRUCTIONS)) REQUIRE( v[dfxml::PERF_INSTRUCTIONS] > 1000000 );
+
+    const std::string fname = "/tmp/output_perf.xml";
+    dfxml_writer dw(fname, false);
+    const bool process = dw.start_perf_counters();
+    dw.set_final_reports(dfxml_writer::REPORT_PROFILE | dfxml_writer::REPORT_PERF_COUNTERS);
+    dw.push("dfxml", "version='1.0'");
+    bool registered = false;
+    std::thread worker([&]() {
+        registered = dw.register_thread();
+        for (int i=0; i<3; i++) {
+            auto s = dw.span("sum");
+            for (int j=0; j<100000; j++) sum = sum + j;
+        }
+    });
+    worker.join();
+    dw.add_rusage();
+    dw.pop();
+    dw.close();
+
+    const std::string xml = read_file(fname);
+    REQUIRE( parses(xml) );
+    const size_t rusage = xml.find("</rusage>");
+    REQUIRE( xml.find("<perf_counters scope='process'>") == rusage + 10 + 2 );
+    REQUIRE( xml.find("<perf_counters scope='thread' thread='0'>") != std::string::npos );
+    if (process) {
+        REQUIRE( xml.find("<context_switches error=") == std::string::npos );
+    } else {
+        REQUIRE( xml.find("<cycles error='") != std::string::npos );
+    }
+    REQUIRE( (xml.find("<span name='sum' count='3' total_ns='") != std::string::npos) );
+    REQUIRE( (xml.find("perf_spans='3'") != std::string::npos) == registered );
+}
+
+TEST_CASE("thread_resources", "[dfxml_writer]") {
+    const std::string fname = "/tmp/output_threads.xml";
+    dfxml_writer dw(fname, false);
+    dw.set_final_reports(dfxml_writer::REPORT_THREADS);
+    dw.push("dfxml", "version='1.0'");
+    dw.register_thread("main");
+
+    std::thread cpu([&]() {             // exits before the report
+        dw.register_thread("cpu");
+        volatile uint64_t sum = 0;
+        const auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(50);
+        while (std::chrono::steady_clock::now() < end) sum = sum + 1;
+    });
+    cpu.join();
+
+    std::mutex m;
+    std::condition_variable cv;
+    bool wrote = false, done = false;
+    std::thread io([&]() {              // still running during the report
+        dw.register_thread("io <&>");
+        std::ofstream("/tmp/output_threads.bin") << std::string(1<<20, 'x');
+        std::unique_lock<std::mutex> lock(m);
+        wrote = true;
+        cv.notify_all();
+        cv.wait(lock, [&]() { return done; });
+    });
+    {
+        std::unique_lock<std::mutex> lock(m);
+        cv.wait(lock, [&]() { return wrote; });
+    }
+    const auto threads = dw.get_profiler().registered_resources();
+    REQUIRE( threads.size() == 3 );
+    REQUIRE( threads[0].name == "main" );
+    REQUIRE( threads[1].name == "cpu" );
+#ifdef __linux__
+    for (const auto &it : threads) {
+        INFO( it.name );
+        REQUIRE( it.valid );
+        REQUIRE( it.tid > 0 );
+    }
+    REQUIRE( threads[1].exited );
+    REQUIRE( !threads[2].exited );
+    REQUIRE( threads[1].utime_usec + threads[1].stime_usec >= 10000 );
+    if (threads[2].has_io) REQUIRE( threads[2].wchar >= (1<<20) );
+#endif
+    dw.pop();
+    {
+        const std::lock_guard<std::mutex> lock(m);
+        done = true;
+    }
+    cv.notify_all();
+    io.join();
+    dw.close();
+
+    const std::string xml = read_file(fname);
+    REQUIRE( parses(xml) );
+    REQUIRE( xml.find("<threads>") != std::string::npos );
+    REQUIRE( xml.find("name='main'") != std::string::npos );
+    REQUIRE( xml.find("name='io &lt;&amp;&gt;'") != std::string::npos );
+#ifdef __linux__
+    REQUIRE( xml.find("name='cpu' exited='1'>") != std::string::npos );
+    REQUIRE( xml.find("<nvcsw>") != std::string::npos );
+#endif
+    unlink("/tmp/output_threads.bin");
+}
+
+TEST_CASE("writer_stats", "[dfxml_writer]") {
+    const std::string fname = "/tmp/output_writer_stats.xml";
+    {
+        dfxml_writer dw(fname, false);
+        dw.push("dfxml", "version='1.0'");
+        for (int i=0; i<10; i++) {
+            dw.push("fileobject");
+            dw.xmlout("filename", "file" + std::to_string(i));
+            dw.pop();
+        }
+        dfxml_writer::fragment f(dw);
+        f.xmlout("comment", "from a fragment");
+        dw.commit(f);
+        auto st = dw.get_writer_stats();
+        REQUIRE( st.elements == 22 );
+        REQUIRE( st.fileobjects == 10 );
+        REQUIRE( st.lock_acquisitions == 0 );   // off by default
+        dw.pop();
+        dw.close();
+        st = dw.get_writer_stats();
+        REQUIRE( st.bytes == std::filesystem::file_size(fname) );
+        REQUIRE( st.flushes > 0 );
+    }
+
+    /* Fragments committed through the async queue do not take the lock */
+    {
+        dfxml_writer dw(fname, false);
+        dw.push("dfxml");
+        dw.start_async();
+        dfxml_writer::fragment f(dw);
+        for (int i=0; i<5; i++) {
+            f.push("fileobject");
+            f.xmlout("filename", "file" + std::to_string(i));
+            f.pop();
+            dw.commit(f);
+        }
+        REQUIRE( dw.get_writer_stats().fileobjects == 5 );
+        dw.stop_async();
+        REQUIRE( dw.get_writer_stats().elements == 11 );
+        dw.pop();
+        dw.close();
+        REQUIRE( dw.get_writer_stats().bytes == std::filesystem::file_size(fname) );
+    }
+
+    /* Fragments dropped by a full queue are not counted */
+    {
+        dfxml_writer dw(fname, false);
+        dw.push("dfxml");
+        dw.start_async(2, dfxml_writer::BACKPRESSURE_DROP);
+        std::vector<std::thread> workers;
+        for (int t=0; t<4; t++) {
+            workers.emplace_back([&dw, t]() {
+                dfxml_writer::fragment f(dw);
+                for (int i=0; i<500; i++) {
+                    f.push("fileobject");
+                    f.xmlout("filename", "t" + std::to_string(t) + "/" + std::to_string(i));
+                    f.pop();
+                    dw.commit(f);
+                }
+            });
+        }
+        for (auto &it : workers) it.join();
+        dw.pop();
+        dw.close();
+        uint64_t count = 0;
+        dfxml::file_object_reader::read_dfxml(fname, [&count](dfxml::file_object &) { count++; });
+        const auto st = dw.get_writer_stats();
+        REQUIRE( count + dw.get_dropped() == 2000 );
+        REQUIRE( st.fileobjects == count );
+        REQUIRE( st.elements == 1 + 2*count );
+        REQUIRE( st.bytes == std::filesystem::file_size(fname) );
+    }
+
+    /* Contention */
+    dfxml_writer dw(fname, false);
+    dw.set_writer_stats();
+    dw.set_final_reports(dfxml_writer::REPORT_WRITER_STATS);
+    dw.push("dfxml", "version='1.0'");
+    const int threads = 4, per_thread = 20000;
+    std::vector<std::thread> workers;
+    for (int t=0; t<threads; t++) {
+        workers.emplace_back([&dw, t]() {
+            for (int i=0; i<per_thread; i++) dw.xmlout("n", (uint64_t)(t*per_thread + i));
+        });
+    }
+    for (auto &it : workers) it.join();
+    const auto st = dw.get_writer_stats();
+    REQUIRE( st.lock_acquisitions >= threads*per_thread );
+    REQUIRE( st.lock_wait.count <= st.lock_acquisitions );
+    REQUIRE( st.lock_hold.count == st.lock_acquisitions / dfxml::stat_mutex::hold_sample );
+    uint64_t histogram = 0;
+    for (auto n : st.lock_hold.histogram) histogram += n;
+    REQUIRE( histogram == st.lock_hold.count );
+    REQUIRE( st.elements == 1 + threads*per_thread );
+    dw.pop();
+    dw.close();
+
+    const std::string xml = read_file(fname);
+    REQUIRE( parses(xml) );
+    REQUIRE( xml.find("<writer_stats>") != std::string::npos );
+    REQUIRE( xml.find("<elements>80001</elements>") != std::string::npos );
+    REQUIRE( xml.find("<lock acquisitions='") != std::string::npos );
+    REQUIRE( xml.find("<hold count='") != std::string::npos );
+}
+
+TEST_CASE("to8601", "[dfxml_writer]") {
+    auto same = [](time_t sec, long usec) {
+        struct timeval tv;
+        tv.tv_sec  = sec;
+        tv.tv_usec = usec;
+        INFO( sec << " " << usec );
+        REQUIRE( dfxml_writer::to8601(tv) == dfxml_writer::to8601_strftime(tv) );
+    };
+    REQUIRE( dfxml_writer::to8601(timeval{0, 0}) == "1970-01-01T00:00:00Z" );
+    REQUIRE( dfxml_writer::to8601(timeval{1614834367, 8}) == "2021-03-04T05:06:07.000008Z" );
+    const time_t edges[] = {0, 1, -1, 59, 86399, 86400, -86400, -86401,
+                            951782400,        // 2000-02-29
+                            4107542400,       // 2100-03-01
+                            -2208988800,      // 1900-01-01
+                            -30610224000,     // 1000-01-01
+                            -30610224001,     // 0999-12-31T23:59:59, not padded by strftime
+                            253402300799,     // 9999-12-31T23:59:59
+                            253402300800};    // 10000-01-01
+    for (time_t sec : edges) {
+        for (long usec : {0L, 1L, 999999L, -5L, 1000000L, 1234567L}) same(sec, usec);
+    }
+    uint64_t x = 88172645463325252ULL;  // xorshift
+    for (int i=0; i<50000; i++) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        same((time_t)(x % 8000000000ULL) - 2000000000, (i % 3) ? (long)(x % 1000000) : 0);
+    }
+
+    /* Other inputs give the timeval's output, truncated to microseconds */
+    struct timespec ts;
+    ts.tv_sec  = 1614834367;
+    ts.tv_nsec = 8999;
+    REQUIRE( dfxml_writer::to8601(ts) == "2021-03-04T05:06:07.000008Z" );
+    const auto tp = std::chrono::system_clock::time_point(std::chrono::nanoseconds(1614834367000008999LL));
+    REQUIRE( dfxml_writer::to8601(std::chrono::time_point_cast<std::chrono::system_clock::duration>(tp))
+             == "2021-03-04T05:06:07.000008Z" );
+    const auto before = std::chrono::system_clock::time_point(std::chrono::microseconds(-1));
+    REQUIRE( dfxml_writer::to8601(before) == dfxml_writer::to8601(timeval{-1, 999999}) );
+    std::string buf = "<mtime>";
+    dfxml_writer::append_8601(buf, 0, 0);
+    REQUIRE( buf == "<mtime>1970-01-01T00:00:00Z" );
+}
+
 TEST_CASE("hash_generator", "[vector]") {
     std::cout << "hash implementation: " << dfxml::digest_implementation_name() << std::endl;
     REQUIRE( count_wrongs() ==  0 );